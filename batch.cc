@@ -0,0 +1,67 @@
+#include "batch.hh"
+
+using namespace batch;
+
+runner::runner(size_t threads) : pool(threads), slots(pool.size()) {
+}
+
+std::vector<result> runner::run(std::span<const job> jobs) {
+  std::vector<result> results(jobs.size());
+  if (jobs.empty()) return results;
+
+  // images may have changed in place since the last run
+  for (auto& s : slots) s.image = nullptr;
+
+  // a few runs of jobs per worker, enough to steal from when
+  // budgets are uneven
+  size_t per = std::max<size_t>(jobs.size() / (pool.size() * 16), 1);
+  for (size_t from = 0; from < jobs.size(); from += per) {
+    pool.submit([&, from, to = std::min(from + per, jobs.size())] {
+      auto& s = slots[pool.workerIndex()];
+      for (size_t i = from; i < to; i++) runOne(s, jobs[i], results[i]);
+    });
+  }
+
+  pool.wait();
+  return results;
+}
+
+void runner::runOne(slot& s, const job& j, result& out) {
+  if (!s.emu || s.image != j.image.data() || s.size != j.image.size()) {
+    s.emu.reset();
+    s.emu   = std::make_unique<::emu>(j.image, 0);
+    s.image = j.image.data();
+    s.size  = j.image.size();
+    s.emu->cpu.snapshot();
+  } else
+    s.emu->restore();
+
+  auto& e    = *s.emu;
+  e.cpu.eip  = j.entry;
+  e.cpu.gprs = j.gprs;
+  e.cpu.flags   = j.flags;
+  e.cpu.lazy.op = ::emu::softCPU::flagOp::none;
+
+  // whole blocks while they can't overshoot, single steps after
+  size_t executed = 0;
+  bool   stopped  = false;
+  while (!stopped && j.budget - executed >= ::emu::maxBlockInsns) {
+    auto n = e.runBlock();
+    executed += n;
+    stopped = n == 0;
+  }
+  while (!stopped && executed < j.budget) {
+    stopped = !e.execBool();
+    if (!stopped) executed++;
+  }
+
+  out.eip      = e.cpu.eip;
+  out.gprs     = e.cpu.gprs;
+  out.flags    = e.cpu.eflags();
+  out.executed = executed;
+  out.stop     = stopReason::budget;
+  if (stopped) {
+    disasm::disassembler ds(e.cpu.memoryAt(e.cpu.eip), e.cpu.eip);
+    out.stop = ds.next().valid() ? stopReason::fault : stopReason::invalid;
+  }
+}
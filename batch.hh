@@ -0,0 +1,83 @@
+#pragma once
+
+#include "emu.hh"
+#include "pool.hh"
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <vector>
+
+namespace batch {
+  /// Registers a job starts with unless it says otherwise, like a
+  /// freshly constructed emu
+  constexpr std::array<uint32_t, proc::gpr::GPR_MAX> initialGprs = [] {
+    std::array<uint32_t, proc::gpr::GPR_MAX> gprs = {0};
+    gprs[proc::gpr::esp] = gprs[proc::gpr::ebp] = 0xffffffff;
+    return gprs;
+  }();
+
+  ///
+  /// A guest to run: image is loaded at 0 and must outlive the run.
+  /// Jobs are told apart by where their image is, those sharing one
+  /// buffer share emus
+  ///
+  struct job {
+    disasm::memoryViewType                   image;
+    uint32_t                                 entry  = 0;
+    std::array<uint32_t, proc::gpr::GPR_MAX> gprs   = initialGprs;
+    uint32_t                                 flags  = 0b10;
+    size_t                                   budget = 0; // instructions
+  };
+
+  enum class stopReason : uint8_t {
+    budget,  // ran all of it
+    invalid, // nothing decodes at eip
+    fault,   // the instruction at eip touched unmapped memory
+  };
+
+  /// What's left of a job's softCPU once it stops
+  struct result {
+    uint32_t                                 eip = 0;
+    std::array<uint32_t, proc::gpr::GPR_MAX> gprs;
+    uint32_t                                 flags    = 0;
+    size_t                                   executed = 0;
+    stopReason                               stop     = stopReason::budget;
+  };
+
+  ///
+  /// Runs batches of jobs over a work stealing pool. Each worker keeps
+  /// an emu for the image it last ran, with a snapshot taken right
+  /// after loading it, so the next job of that image only pays for
+  /// the pages the last one wrote, and finds its blocks cached and
+  /// compiled already. Jobs of one image are best kept next to each
+  /// other, workers take them in runs
+  ///
+  struct runner {
+    /// threads = 0 uses every hardware thread
+    explicit runner(size_t threads = 0);
+
+    runner& operator=(const runner&) = delete;
+    runner(const runner&)            = delete;
+
+    /// Results in the order of jobs
+    std::vector<result> run(std::span<const job> jobs);
+
+    size_t threads() const noexcept {
+      return pool.size();
+    }
+
+private:
+    /// A worker's emu, on its own cache line
+    struct alignas(64) slot {
+      std::unique_ptr<::emu> emu;
+      const uint8_t*         image = nullptr;
+      size_t                 size  = 0;
+    };
+
+    void runOne(slot& s, const job& j, result& out);
+
+    utl::workPool     pool;
+    std::vector<slot> slots;
+  };
+} // namespace batch
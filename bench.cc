@@ -0,0 +1,295 @@
+#include "utl.hh"
+#include "disasm.hh"
+#include "sweep.hh"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <vector>
+
+///
+/// Decoder throughput benchmarks, over generated corpora
+///
+///   bench [corpus MiB = 16] [repeats = 7]
+///
+
+namespace bench {
+  struct rng {
+    uint64_t state;
+
+    uint32_t next() noexcept {
+      // xorshift64*
+      state ^= state >> 12;
+      state ^= state << 25;
+      state ^= state >> 27;
+      return (uint32_t)((state * 0x2545f4914f6cdd1dull) >> 32);
+    }
+
+    uint32_t below(uint32_t n) noexcept {
+      return next() % n;
+    }
+  };
+
+  ///
+  /// Appends a random instruction the decoder knows, 16-bit
+  /// operand size every now and then
+  ///
+  void emitValid(std::vector<uint8_t>& out, rng& r, bool branchesOnly = false) {
+    auto bytes = [&](size_t n) {
+      for (size_t i = 0; i < n; i++) out.push_back((uint8_t)r.next());
+    };
+
+    bool   o16  = r.below(4) == 0;
+    size_t immz = o16 ? 2 : 4;
+    if (o16) out.push_back(0x66);
+
+    uint8_t reg   = (uint8_t)r.below(8);
+    auto    which = branchesOnly ? 11 + r.below(3) : r.below(14);
+    switch (which) {
+    case 0:
+      out.push_back(0x6a);
+      bytes(1);
+      break;
+    case 1:
+      out.push_back(0x68);
+      bytes(immz);
+      break;
+    case 2:
+      out.push_back(0x50 + reg);
+      break;
+    case 3:
+      out.push_back(0x58 + reg);
+      break;
+    case 4:
+      out.push_back(0xb8 + reg);
+      bytes(immz);
+      break;
+    case 5: {
+      constexpr uint8_t groups[] = {0, 1, 2, 4, 5, 6, 7};
+      out.push_back(0x83);
+      out.push_back(0xc0 | (groups[r.below(std::size(groups))] << 3) | reg);
+      bytes(1);
+      break;
+    }
+    case 6:
+      out.push_back(0x81);
+      out.push_back(0xc0 | reg);
+      bytes(immz);
+      break;
+    case 7:
+      out.push_back(0x05);
+      bytes(immz);
+      break;
+    case 8:
+      out.push_back(0x40 + reg);
+      break;
+    case 9:
+      out.push_back(0x48 + reg);
+      break;
+    case 10:
+      out.push_back(0x85);
+      out.push_back(0xc0 | r.below(64));
+      break;
+    case 11:
+      out.push_back(0xe8);
+      bytes(immz);
+      break;
+    case 12:
+      out.push_back(0xe9);
+      bytes(immz);
+      break;
+    default:
+      out.push_back(0xc3);
+      break;
+    }
+  }
+
+  struct corpus {
+    const char*          name;
+    std::vector<uint8_t> code;
+  };
+
+  std::vector<corpus> makeCorpora(size_t size) {
+    std::vector<corpus> corpora;
+    rng                 r {0x9e3779b97f4a7c15ull};
+
+    // every instruction equally likely
+    {
+      corpus c {"uniform", {}};
+      c.code.reserve(size + 16);
+      while (c.code.size() < size) emitValid(c.code, r);
+      corpora.push_back(std::move(c));
+    }
+
+    // 1 to 4 legacy prefixes in front of everything
+    {
+      constexpr uint8_t prefixes[] = {0xf0, 0xf2, 0xf3, 0x2e, 0x36, 0x3e, 0x26, 0x64, 0x65, 0x67};
+
+      corpus c {"prefixed", {}};
+      c.code.reserve(size + 32);
+      while (c.code.size() < size) {
+        auto n = 1 + r.below(4);
+        for (size_t i = 0; i < n; i++) c.code.push_back(prefixes[r.below(std::size(prefixes))]);
+        emitValid(c.code, r);
+      }
+      corpora.push_back(std::move(c));
+    }
+
+    // mostly call/jmp/ret
+    {
+      corpus c {"branchy", {}};
+      c.code.reserve(size + 16);
+      while (c.code.size() < size) emitValid(c.code, r, r.below(4) != 0);
+      corpora.push_back(std::move(c));
+    }
+
+    // instructions cut short, and plain noise
+    {
+      corpus c {"invalid", {}};
+      c.code.reserve(size + 16);
+      while (c.code.size() < size) {
+        if (r.below(2)) {
+          c.code.push_back((uint8_t)r.next());
+          continue;
+        }
+
+        auto before = c.code.size();
+        emitValid(c.code, r);
+        if (c.code.size() - before > 1 && r.below(2)) c.code.pop_back();
+      }
+      corpora.push_back(std::move(c));
+    }
+
+    return corpora;
+  }
+
+  struct stats {
+    double min;
+    double median;
+    double mean;
+    double stddev;
+  };
+
+  stats summarize(std::vector<double> seconds) {
+    std::sort(seconds.begin(), seconds.end());
+
+    stats s {};
+    s.min    = seconds.front();
+    s.median = seconds[seconds.size() / 2];
+    for (auto t : seconds) s.mean += t;
+    s.mean /= seconds.size();
+    for (auto t : seconds) s.stddev += (t - s.mean) * (t - s.mean);
+    s.stddev = std::sqrt(s.stddev / seconds.size());
+    return s;
+  }
+
+  ///
+  /// Runs f once to warm up, then repeats times, f returns
+  /// how many instructions it went through
+  ///
+  void run(const char* path, const corpus& c, size_t repeats, const std::function<size_t()>& f) {
+    size_t insns = f();
+
+    std::vector<double> seconds;
+    for (size_t i = 0; i < repeats; i++) {
+      auto begin = std::chrono::steady_clock::now();
+      auto n     = f();
+      auto end   = std::chrono::steady_clock::now();
+      seconds.push_back(std::chrono::duration<double>(end - begin).count());
+
+      // every run has to do the same work
+      if (n != insns) {
+        fprintf(stderr, "%s/%s: %zu instructions, expected %zu\n", c.name, path, n, insns);
+        exit(1);
+      }
+    }
+
+    auto s = summarize(seconds);
+    printf("%-9s %-20s %10zu %10.2f %10.2f %10.2f %8.2f %8.2f %7.1f%%\n", c.name, path, insns,
+           insns / s.median / 1e6, c.code.size() / s.median / (1 << 20), s.median * 1e9 / insns, s.min * 1e3,
+           s.median * 1e3, s.stddev / s.mean * 100);
+  }
+} // namespace bench
+
+int main(int argc, char** argv) {
+  size_t mib     = argc > 1 ? strtoul(argv[1], nullptr, 10) : 16;
+  size_t repeats = argc > 2 ? strtoul(argv[2], nullptr, 10) : 7;
+  if (mib == 0 || repeats == 0) {
+    fprintf(stderr, "usage: %s [corpus MiB] [repeats]\n", argv[0]);
+    return 1;
+  }
+
+  auto corpora = bench::makeCorpora(mib << 20);
+
+  printf("%-9s %-20s %10s %10s %10s %10s %8s %8s %8s\n", "corpus", "path", "insns", "Minsn/s", "MiB/s", "ns/insn",
+         "min ms", "med ms", "stddev");
+  utl::delim();
+
+  for (auto& c : corpora) {
+    disasm::memoryViewType code = c.code;
+    uint64_t               sink = 0;
+
+    // undecodable bytes are skipped one at a time everywhere,
+    // so every path sees the same instructions
+    bench::run("consume", c, repeats, [&] {
+      size_t n = 0;
+      for (size_t at = 0; at < code.size(); n++) {
+        disasm::disassembler d(code, at);
+        auto                 v = d.consume();
+        sink += v.index();
+        at += d.length() ? d.length() : 1;
+      }
+      return n;
+    });
+
+    bench::run("next", c, repeats, [&] {
+      size_t n = 0;
+      for (size_t at = 0; at < code.size(); n++) {
+        disasm::disassembler d(code, at);
+        auto                 i = d.next();
+        sink += i.imm;
+        at += disasm::sweepLength(i);
+      }
+      return n;
+    });
+
+    bench::run("lengthAt", c, repeats, [&] {
+      size_t n = 0;
+      for (size_t at = 0; at < code.size(); n++) {
+        auto length = disasm::lengthAt(code, at);
+        sink += length;
+        at += length ? length : 1;
+      }
+      return n;
+    });
+
+    // only counts instructions that decode, unlike the other paths
+    std::vector<uint64_t> starts((code.size() + 63) / 64);
+    bench::run("markStarts", c, repeats, [&] {
+      std::fill(starts.begin(), starts.end(), 0);
+      auto marked = disasm::markStarts(code, starts);
+      sink += starts[starts.size() / 2];
+      return marked;
+    });
+
+    disasm::insnBuffer buffer(code.size());
+    bench::run("decodeRange", c, repeats, [&] {
+      disasm::decodeRange(code, buffer);
+      sink += buffer.imms[buffer.size() / 2];
+      return buffer.size();
+    });
+
+    bench::run("decodeRangeParallel", c, repeats, [&] {
+      disasm::insnBuffer out;
+      disasm::decodeRangeParallel(code, out);
+      sink += out.imms[out.size() / 2];
+      return out.size();
+    });
+
+    if (sink == 42) printf("\n");
+  }
+
+  return 0;
+}
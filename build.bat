@@ -1,4 +1,6 @@
 clang-format.exe -i *.cc
 clang-format.exe -i *.hh
-cl.exe main.cc disasm.cc emu.cc /std:c++latest
+cl.exe main.cc disasm.cc emu.cc sweep.cc cfg.cc xref.cc stream.cc fmt.cc index.cc patch.cc pool.cc jit.cc batch.cc lockstep.cc /std:c++latest
+cl.exe bench.cc disasm.cc sweep.cc /std:c++latest /O2 /Fe:bench.exe
+cl.exe cli.cc disasm.cc fmt.cc pool.cc /std:c++latest /O2 /Fe:imp.exe
 
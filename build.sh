@@ -1,3 +1,5 @@
 clang-format -i *.cc
 clang-format -i *.hh
-clang++ main.cc disasm.cc emu.cc -std=c++2b -lm
+clang++ main.cc disasm.cc emu.cc sweep.cc cfg.cc xref.cc stream.cc fmt.cc index.cc patch.cc pool.cc jit.cc batch.cc lockstep.cc -std=c++2b -lm -pthread
+clang++ bench.cc disasm.cc sweep.cc -std=c++2b -O2 -lm -pthread -o bench
+clang++ cli.cc disasm.cc fmt.cc pool.cc -std=c++2b -O2 -lm -pthread -o imp
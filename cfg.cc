@@ -0,0 +1,200 @@
+#include "cfg.hh"
+#include <algorithm>
+#include <numeric>
+
+using namespace disasm;
+
+namespace {
+  bool endsBlock(const insn& i) noexcept {
+    if (!i.valid()) return true;
+
+    auto t = info(i.id).type;
+    return t == instructionType::CALL || t == instructionType::JMP || t == instructionType::RET;
+  }
+
+  bool fallsThrough(const insn& i) noexcept {
+    auto t = info(i.id).type;
+    return i.valid() && t != instructionType::JMP && t != instructionType::RET;
+  }
+
+  ///
+  /// Turns per-node edge lists into begin/flat arrays
+  ///
+  void flatten(const std::vector<std::vector<uint32_t>>& lists, std::vector<uint32_t>& begin,
+               std::vector<uint32_t>& flat) {
+    begin.assign(lists.size() + 1, 0);
+    for (size_t i = 0; i < lists.size(); i++) begin[i + 1] = begin[i] + lists[i].size();
+
+    flat.clear();
+    flat.reserve(begin.back());
+    for (auto& l : lists) flat.insert(flat.end(), l.begin(), l.end());
+  }
+} // namespace
+
+uint32_t flowGraph::blockAt(uint32_t offset) const noexcept {
+  auto it = std::upper_bound(blockStarts.begin(), blockStarts.end(), offset);
+  if (it == blockStarts.begin()) return npos;
+
+  auto b = (uint32_t)(it - blockStarts.begin()) - 1;
+  if (offset >= blockEnds[b]) return npos;
+  return b;
+}
+
+uint32_t flowGraph::insnAt(uint32_t offset) const noexcept {
+  auto it = std::lower_bound(insnOffsets.begin(), insnOffsets.end(), offset);
+  if (it == insnOffsets.end() || *it != offset) return npos;
+  return (uint32_t)(it - insnOffsets.begin());
+}
+
+flowGraph disasm::recursiveDescent(memoryViewType code, std::span<const uint32_t> entries) {
+  flowGraph g;
+
+  // per byte, whether an instruction starts there, so that a target
+  // in the middle of a run is only decoded once, and whether a block
+  // starts there
+  std::vector<uint8_t>  decoded(code.size(), 0);
+  std::vector<uint8_t>  leader(code.size(), 0);
+  std::vector<uint32_t> work;
+  std::vector<uint32_t> funcs;
+
+  auto enqueue = [&](uint32_t offset) {
+    if (offset >= code.size() || leader[offset]) return;
+    leader[offset] = 1;
+    work.push_back(offset);
+  };
+
+  for (auto e : entries) {
+    if (e >= code.size()) continue;
+    funcs.push_back(e);
+    enqueue(e);
+  }
+
+  // discover
+  std::vector<std::pair<uint32_t, insn>> found;
+  while (!work.empty()) {
+    auto at = work.back();
+    work.pop_back();
+
+    while (at < code.size()) {
+      // ran into code that's already decoded, it starts a block
+      if (decoded[at]) {
+        leader[at] = 1;
+        break;
+      }
+
+      auto i      = decodeAt(code, at);
+      decoded[at] = 1;
+      found.push_back({at, i});
+
+      if (i.hasTarget()) {
+        enqueue(i.imm);
+        if (info(i.id).type == instructionType::CALL && i.imm < code.size()) funcs.push_back(i.imm);
+      }
+
+      if (!fallsThrough(i)) break;
+      at += i.length;
+      if (endsBlock(i)) enqueue(at);
+    }
+  }
+
+  std::sort(found.begin(), found.end(), [](auto& a, auto& b) {
+    return a.first < b.first;
+  });
+  g.insns.reserve(found.size());
+  g.insnOffsets.reserve(found.size());
+  for (auto& [at, i] : found) {
+    g.insnOffsets.push_back(at);
+    g.insns.push_back(i);
+  }
+
+  // blocks, run from each leader until something ends them
+  std::vector<uint32_t> blockLast;
+  for (uint32_t idx = 0; idx < g.insns.size(); idx++) {
+    auto at = g.insnOffsets[idx];
+    if (!leader[at]) continue;
+
+    g.blockStarts.push_back(at);
+    g.blockInsns.push_back(idx);
+
+    auto cur = idx;
+    while (true) {
+      auto& i    = g.insns[cur];
+      auto  next = g.insnOffsets[cur] + (uint32_t)i.length;
+      if (endsBlock(i) || next >= code.size() || leader[next]) break;
+
+      auto n = g.insnAt(next);
+      if (n == flowGraph::npos) break;
+      cur = n;
+    }
+
+    blockLast.push_back(cur);
+    g.blockEnds.push_back(g.insnOffsets[cur] + std::max<uint32_t>(g.insns[cur].length, 1));
+  }
+  g.blockInsns.push_back((uint32_t)g.insns.size());
+
+  // edges
+  auto blockStarting = [&](uint32_t offset) -> uint32_t {
+    auto it = std::lower_bound(g.blockStarts.begin(), g.blockStarts.end(), offset);
+    if (it == g.blockStarts.end() || *it != offset) return flowGraph::npos;
+    return (uint32_t)(it - g.blockStarts.begin());
+  };
+
+  std::vector<std::vector<uint32_t>> succs(g.blockCount()), preds(g.blockCount()), calls(g.blockCount());
+  for (uint32_t b = 0; b < g.blockCount(); b++) {
+    auto& last = g.insns[blockLast[b]];
+    auto  type = info(last.id).type;
+
+    auto link = [&](uint32_t offset) {
+      if (auto to = blockStarting(offset); to != flowGraph::npos) {
+        succs[b].push_back(to);
+        preds[to].push_back(b);
+      }
+    };
+
+    if (last.valid() && type == instructionType::JMP) link(last.imm);
+    else if (fallsThrough(last))
+      link(g.blockEnds[b]);
+
+    if (last.valid() && type == instructionType::CALL) {
+      if (auto to = blockStarting(last.imm); to != flowGraph::npos) calls[b].push_back(to);
+    }
+  }
+
+  flatten(succs, g.succBegin, g.succs);
+  flatten(preds, g.predBegin, g.preds);
+  flatten(calls, g.callBegin, g.calls);
+
+  // functions
+  std::sort(funcs.begin(), funcs.end());
+  funcs.erase(std::unique(funcs.begin(), funcs.end()), funcs.end());
+
+  // stamped with the function being walked, to avoid clearing it
+  std::vector<uint32_t>              seen(g.blockCount(), flowGraph::npos);
+  std::vector<std::vector<uint32_t>> members;
+  for (auto f : funcs) {
+    auto entry = blockStarting(f);
+    if (entry == flowGraph::npos) continue;
+
+    auto                  stamp = (uint32_t)members.size();
+    std::vector<uint32_t> blocks, stack {entry};
+    seen[entry] = stamp;
+    while (!stack.empty()) {
+      auto b = stack.back();
+      stack.pop_back();
+      blocks.push_back(b);
+      for (auto s : g.successors(b)) {
+        if (seen[s] != stamp) {
+          seen[s] = stamp;
+          stack.push_back(s);
+        }
+      }
+    }
+
+    std::sort(blocks.begin(), blocks.end());
+    g.funcEntries.push_back(entry);
+    members.push_back(std::move(blocks));
+  }
+  flatten(members, g.funcBegin, g.funcBlocks);
+
+  return g;
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include "disasm.hh"
+#include <cstdint>
+#include <span>
+#include <vector>
+
+namespace disasm {
+  ///
+  /// Control flow graph recovered by recursive descent. Everything is
+  /// addressed by index into flat arrays, edge lists use the
+  /// xBegin[i]..xBegin[i + 1] ranges of the matching x array
+  ///
+  struct flowGraph {
+    static constexpr uint32_t npos = (uint32_t)-1;
+
+    /// Decoded instructions, sorted by offset. Bytes that are never
+    /// reached from an entry point are never decoded
+    std::vector<insn>     insns;
+    std::vector<uint32_t> insnOffsets;
+
+    /// Basic blocks, sorted by start offset. A block ends after a
+    /// call/jmp/ret, before another block's start, or where
+    /// decoding fails
+    std::vector<uint32_t> blockStarts;
+    std::vector<uint32_t> blockEnds;
+    std::vector<uint32_t> blockInsns; // index of the first instruction, blockInsns[i + 1] past the last
+
+    std::vector<uint32_t> succBegin;
+    std::vector<uint32_t> succs;
+    std::vector<uint32_t> predBegin;
+    std::vector<uint32_t> preds;
+    /// Blocks the last instruction of a block calls
+    std::vector<uint32_t> callBegin;
+    std::vector<uint32_t> calls;
+
+    /// Functions, entry points and call targets, by entry block.
+    /// A function spans the blocks reachable from its entry without
+    /// following calls, those are in funcBlocks
+    std::vector<uint32_t> funcEntries;
+    std::vector<uint32_t> funcBegin;
+    std::vector<uint32_t> funcBlocks;
+
+    size_t blockCount() const noexcept {
+      return blockStarts.size();
+    }
+
+    /// Block containing offset, npos if none
+    uint32_t blockAt(uint32_t offset) const noexcept;
+
+    /// Index of the instruction starting at offset, npos if none
+    uint32_t insnAt(uint32_t offset) const noexcept;
+
+    std::span<const uint32_t> successors(uint32_t block) const noexcept {
+      return {succs.data() + succBegin[block], succs.data() + succBegin[block + 1]};
+    }
+
+    std::span<const uint32_t> predecessors(uint32_t block) const noexcept {
+      return {preds.data() + predBegin[block], preds.data() + predBegin[block + 1]};
+    }
+
+    std::span<const uint32_t> callees(uint32_t block) const noexcept {
+      return {calls.data() + callBegin[block], calls.data() + callBegin[block + 1]};
+    }
+
+    std::span<const uint32_t> functionBlocks(uint32_t func) const noexcept {
+      return {funcBlocks.data() + funcBegin[func], funcBlocks.data() + funcBegin[func + 1]};
+    }
+  };
+
+  ///
+  /// Follows call/jmp targets from the entry offsets, decoding only
+  /// what is reachable, and builds the blocks and edges out of it.
+  /// Targets outside of code are treated as external
+  ///
+  flowGraph recursiveDescent(memoryViewType code, std::span<const uint32_t> entries);
+} // namespace disasm
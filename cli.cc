@@ -0,0 +1,266 @@
+#include "utl.hh"
+#include "disasm.hh"
+#include "fmt.hh"
+#include "pool.hh"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+///
+/// Batch disassembler
+///
+///   imp [-j threads] [-s] [-c chunk bytes] [-b base] path...
+///
+/// Directories are walked recursively, in name order. Every file is
+/// swept from its first byte as flat 32-bit code, and its listing, or
+/// with -s a one line summary, written to stdout in the order the files
+/// were found; always the same output for the same inputs, however many
+/// threads. Files larger than a chunk are listed a chunk at a time, in
+/// parallel
+///
+
+namespace cli {
+  namespace fs = std::filesystem;
+
+  struct options {
+    size_t   threads   = 0;
+    bool     summaries = false;
+    size_t   chunkSize = 0x400000;
+    uint32_t base      = 0;
+  };
+
+  struct summary {
+    size_t insns    = 0;
+    size_t invalid  = 0; // undecodable bytes
+    size_t calls    = 0;
+    size_t jmps     = 0;
+    size_t rets     = 0;
+    size_t prefixed = 0;
+
+    void add(const summary& o) noexcept {
+      insns += o.insns;
+      invalid += o.invalid;
+      calls += o.calls;
+      jmps += o.jmps;
+      rets += o.rets;
+      prefixed += o.prefixed;
+    }
+  };
+
+  ///
+  /// Output of one file, filled in by one task per chunk
+  ///
+  struct result {
+    std::string              path;
+    std::vector<uint8_t>     code;
+    bool                     readable = true;
+    std::vector<std::string> listings;
+    std::vector<summary>     summaries;
+    std::atomic<size_t>      remaining = 0;
+    std::atomic<bool>        finished  = false;
+  };
+
+  bool readFile(const std::string& path, std::vector<uint8_t>& out) {
+    auto f = fopen(path.c_str(), "rb");
+    if (!f) return false;
+
+    // what can't seek, pipes and the like, has no size to read up to
+    long size = -1;
+    if (fseek(f, 0, SEEK_END) == 0) size = ftell(f);
+    if (size < 0 || fseek(f, 0, SEEK_SET) != 0) {
+      fclose(f);
+      return false;
+    }
+
+    out.resize((size_t)size);
+    bool ok = fread(out.data(), 1, out.size(), f) == out.size();
+    fclose(f);
+    return ok;
+  }
+
+  std::vector<std::string> gather(int argc, char** argv, int first) {
+    std::vector<std::string> paths;
+    for (int i = first; i < argc; i++) {
+      std::error_code ec;
+      if (!fs::is_directory(argv[i], ec)) {
+        paths.push_back(argv[i]);
+        continue;
+      }
+
+      std::vector<std::string> found;
+      for (auto& e : fs::recursive_directory_iterator(argv[i], fs::directory_options::skip_permission_denied, ec)) {
+        if (e.is_regular_file(ec)) found.push_back(e.path().string());
+      }
+      std::sort(found.begin(), found.end());
+      paths.insert(paths.end(), found.begin(), found.end());
+    }
+    return paths;
+  }
+
+  ///
+  /// Chunk boundaries, on instruction boundaries so that every chunk
+  /// lists exactly what a sweep of the whole file would. Lengths only,
+  /// the expensive part is left to the chunks
+  ///
+  std::vector<size_t> split(disasm::memoryViewType code, size_t chunkSize) {
+    std::vector<size_t> bounds {0};
+    for (size_t at = 0; at < code.size();) {
+      if (at - bounds.back() >= chunkSize) bounds.push_back(at);
+      auto length = disasm::lengthAt(code, at);
+      at += length ? length : 1;
+    }
+    bounds.push_back(code.size());
+    return bounds;
+  }
+
+  void list(disasm::memoryViewType code, size_t at, uint32_t base, std::string& out) {
+    char buffer[0x10000];
+    while (at < code.size()) {
+      auto n = disasm::formatListing(code, at, buffer, base);
+      out.append(buffer, n);
+    }
+  }
+
+  void summarize(disasm::memoryViewType code, size_t at, summary& s) {
+    while (at < code.size()) {
+      auto i = disasm::decodeAt(code, at);
+      at += disasm::sweepLength(i);
+      if (!i.valid()) {
+        s.invalid++;
+        continue;
+      }
+
+      s.insns++;
+      if (i.flags & ~disasm::insnFlags::operandSize16) s.prefixed++;
+      switch (disasm::info(i.id).type) {
+      case disasm::CALL:
+        s.calls++;
+        break;
+      case disasm::JMP:
+        s.jmps++;
+        break;
+      case disasm::RET:
+        s.rets++;
+        break;
+      default:
+        break;
+      }
+    }
+  }
+
+  void usage(const char* self) {
+    fprintf(stderr, "usage: %s [-j threads] [-s] [-c chunk bytes] [-b base] path...\n", self);
+  }
+} // namespace cli
+
+int main(int argc, char** argv) {
+  cli::options opts;
+
+  int i = 1;
+  for (; i < argc && argv[i][0] == '-'; i++) {
+    auto flag = std::string_view(argv[i]);
+    if (flag == "-s") opts.summaries = true;
+    else if ((flag == "-j" || flag == "-c" || flag == "-b") && i + 1 < argc) {
+      auto n = strtoull(argv[++i], nullptr, 0);
+      if (flag == "-j") opts.threads = n;
+      else if (flag == "-c")
+        opts.chunkSize = std::max<size_t>(n, disasm::maxInsnLength);
+      else
+        opts.base = (uint32_t)n;
+    } else {
+      cli::usage(argv[0]);
+      return 1;
+    }
+  }
+
+  auto paths = cli::gather(argc, argv, i);
+  if (paths.empty()) {
+    cli::usage(argv[0]);
+    return 1;
+  }
+
+  std::vector<std::unique_ptr<cli::result>> results;
+  for (auto& p : paths) {
+    results.push_back(std::make_unique<cli::result>());
+    results.back()->path = p;
+  }
+
+  // results are written in order as soon as they're finished
+  std::mutex              finishedLock;
+  std::condition_variable finishedOne;
+  auto                    finish = [&](cli::result& r) {
+    {
+      std::lock_guard l(finishedLock);
+      r.finished = true;
+    }
+    finishedOne.notify_one();
+  };
+
+  utl::workPool pool(opts.threads);
+  for (auto& owned : results) {
+    auto r = owned.get();
+    pool.submit([&, r] {
+      r->readable = cli::readFile(r->path, r->code);
+      auto bounds = cli::split(r->code, opts.chunkSize);
+      auto chunks = bounds.size() - 1;
+      if (!r->readable || chunks == 0) {
+        finish(*r);
+        return;
+      }
+
+      r->listings.resize(chunks);
+      r->summaries.resize(chunks);
+      r->remaining = chunks;
+      for (size_t c = 0; c < chunks; c++) {
+        pool.submit([&, r, c, from = bounds[c], to = bounds[c + 1]] {
+          auto code = disasm::memoryViewType(r->code).first(to);
+          if (opts.summaries) cli::summarize(code, from, r->summaries[c]);
+          else
+            cli::list(code, from, opts.base, r->listings[c]);
+
+          if (--r->remaining == 0) finish(*r);
+        });
+      }
+    });
+  }
+
+  int status = 0;
+  for (auto& r : results) {
+    {
+      std::unique_lock l(finishedLock);
+      finishedOne.wait(l, [&] {
+        return r->finished.load();
+      });
+    }
+
+    if (!r->readable) {
+      fprintf(stderr, "%s: can't read\n", r->path.c_str());
+      status = 1;
+      continue;
+    }
+
+    if (opts.summaries) {
+      cli::summary s;
+      for (auto& part : r->summaries) s.add(part);
+      printf("%s: %zu bytes, %zu insns, %zu undecodable, %zu calls, %zu jmps, %zu rets, %zu prefixed\n",
+             r->path.c_str(), r->code.size(), s.insns, s.invalid, s.calls, s.jmps, s.rets, s.prefixed);
+    } else {
+      printf("==== %s\n", r->path.c_str());
+      for (auto& part : r->listings) fwrite(part.data(), 1, part.size(), stdout);
+    }
+
+    // done with it
+    r.reset();
+  }
+
+  pool.wait();
+  return status;
+}
@@ -1,201 +1,552 @@
 #include "utl.hh"
 #include "disasm.hh"
-
-#define __IMP_CONCAT(x, y)  __IMP_CONCAT2(x, y)
-#define __IMP_CONCAT2(x, y) x##y
-#ifdef defer
-#error "imp uses defer"
-#else
-#define defer ::utl::defer __IMP_CONCAT(__, __LINE__)
-#endif
+#include <algorithm>
+#include <array>
 
 using namespace disasm;
 
-ret disassembler::consume() {
-#define CANT_HAVE_PREFIX()                                                                                             \
-  if (operandSizePrefix || addressSizePrefix) return none;
-  code       = code.subspan(lastLength);
-  lastLength = 0;
-  if (code.empty()) return none {};
+namespace {
+  ///
+  /// State shared by the opcode handlers while decoding
+  /// a single instruction
+  ///
+  struct context {
+    memoryViewType code;
+    const uint8_t* c;
+    size_t&        lastLength;
+    bool           operandSizePrefix;
+    bool           addressSizePrefix;
+    /// Where code starts, relative to the start of the view
+    /// targets are resolved against
+    size_t offset;
+
+    uintptr_t dist(const void* p) const noexcept {
+      return (uintptr_t)(p) - (uintptr_t)(&code[0]);
+    }
+
+    void setLen(uint32_t used = 0) noexcept {
+      auto nextDist = dist(c) + used + 1;
+      lastLength    = nextDist;
+    }
+
+    template <typename T>
+    bool tryEnsureAndSetLen(bool check, T t, T f) noexcept {
+      auto nextDist = dist(c) + 1;
+      if (code.subspan(nextDist).size() < (size_t)(check ? t : f)) return false; // could not ensure enough bytes
+
+      setLen(check ? t : f);
+      return true;
+    }
+
+    /// Resolves a displacement relative to the next instruction,
+    /// wrapping around at operand size
+    template <typename T>
+    T handleSizeWraparound(T n) const noexcept {
+      return (T)(n + offset + lastLength);
+    }
+
+    /// Register encoded in the low 3 bits of the opcode
+    proc::gpr low() const noexcept {
+      return (proc::gpr)(*c & 7);
+    }
+
+    /// Register encoded in the reg field of a ModR/M byte
+    proc::gpr mid() const noexcept {
+      return (proc::gpr)((*c >> 3) & 7);
+    }
+  };
+
+  using handler = insn (*)(context&);
+  using table   = std::array<handler, 256>;
 
-  // cursor
-  const uint8_t* c = &code[(operandSizePrefix || addressSizePrefix) ? 1 : 0];
+#define ENSURE_AND_SET_LEN2$(n)                                                                                        \
+  if (!x.tryEnsureAndSetLen(true, n, 0)) return insn {};
+
+  insn invalid(context&) {
+    return insn {};
+  }
 
-  auto dist = [&](const void* p) -> uintptr_t {
-    return (uintptr_t)(p) - (uintptr_t)(&code[0]);
+  ///
+  /// What a ModR/M byte encodes, one table per address size
+  ///
+  struct modrmEntry {
+    /// Also the register of register-direct operands
+    uint8_t base      = proc::gpr::GPR_MAX;
+    uint8_t index     = proc::gpr::GPR_MAX; // 16-bit addressing only
+    uint8_t dispBytes = 0;
+    bool    sib       = false;
+    bool    memory    = false;
   };
 
-  auto setLen = [&](uint32_t used = 0) {
-    auto nextDist = dist(c) + used + 1;
-    lastLength    = nextDist;
+  using modrmTable = std::array<modrmEntry, 256>;
+
+  constexpr modrmTable modrm32 = [] {
+    modrmTable t {};
+    for (size_t b = 0; b < 256; b++) {
+      auto  mod = b >> 6, rm = b & 7;
+      auto& e   = t[b];
+      if (mod == 3) {
+        e.base = (uint8_t)rm;
+        continue;
+      }
+
+      e.memory    = true;
+      e.dispBytes = mod == 1 ? 1 : mod == 2 ? 4 : 0;
+      if (rm == 4) e.sib = true; // base and index come from the SIB byte
+      else if (mod == 0 && rm == 5)
+        e.dispBytes = 4; // disp32 alone
+      else
+        e.base = (uint8_t)rm;
+    }
+    return t;
+  }();
+
+  constexpr modrmTable modrm16 = [] {
+    using enum proc::gpr;
+    constexpr uint8_t bases[]   = {ebx, ebx, ebp, ebp, GPR_MAX, GPR_MAX, ebp, ebx};
+    constexpr uint8_t indices[] = {esi, edi, esi, edi, esi, edi, GPR_MAX, GPR_MAX};
+
+    modrmTable t {};
+    for (size_t b = 0; b < 256; b++) {
+      auto  mod = b >> 6, rm = b & 7;
+      auto& e   = t[b];
+      if (mod == 3) {
+        e.base = (uint8_t)rm;
+        continue;
+      }
+
+      e.memory    = true;
+      e.dispBytes = mod == 1 ? 1 : mod == 2 ? 2 : 0;
+      e.base      = bases[rm];
+      e.index     = indices[rm];
+      if (mod == 0 && rm == 6) {
+        e.base      = GPR_MAX; // disp16 alone
+        e.dispBytes = 2;
+      }
+    }
+    return t;
+  }();
+
+  struct sibEntry {
+    uint8_t base      = proc::gpr::GPR_MAX;
+    uint8_t index     = proc::gpr::GPR_MAX;
+    uint8_t scaleLog2 = 0;
+    /// On top of the ones of the ModR/M byte
+    uint8_t dispBytes = 0;
   };
 
-  auto tryEnsureAndSetLen = [&]<typename T>(bool check, T t, T f) {
-    auto nextDist = dist(c) + 1;
-    if (code.subspan(nextDist).size() < (check ? t : f)) return false; // could not ensure enough bytes
+  using sibTable = std::array<sibEntry, 256>;
+
+  /// Indexed by whether ModR/M mod is 0, then by the SIB byte
+  constexpr std::array<sibTable, 2> sibs = [] {
+    std::array<sibTable, 2> ts {};
+    for (size_t mod0 = 0; mod0 < 2; mod0++) {
+      for (size_t b = 0; b < 256; b++) {
+        auto& e     = ts[mod0][b];
+        auto  base  = b & 7;
+        auto  index = (b >> 3) & 7;
+        e.scaleLog2 = (uint8_t)(b >> 6);
+        if (index != proc::gpr::esp) e.index = (uint8_t)index; // no index
+        if (mod0 && base == proc::gpr::ebp) e.dispBytes = 4;   // disp32 in place of the base
+        else
+          e.base = (uint8_t)base;
+      }
+    }
+    return ts;
+  }();
+
+  ///
+  /// Decodes the ModR/M byte after the cursor, along with its SIB byte
+  /// and displacement, into i. The ModR/M byte is known to be there.
+  /// Returns how many bytes follow the ModR/M byte, -1 if code ends
+  /// before they do
+  ///
+  int decodeModRM(context& x, insn& i) noexcept {
+    uint8_t modrm = x.c[1];
+    auto&   e     = (x.addressSizePrefix ? modrm16 : modrm32)[modrm];
+    if (!e.memory) {
+      i.setGpr((proc::gpr)e.base);
+      return 0;
+    }
+
+    auto    rest = x.code.subspan(x.dist(x.c) + 2);
+    uint8_t base = e.base, index = e.index, scaleLog2 = 0;
+    size_t  used = 0, dispBytes = e.dispBytes;
+    if (e.sib) {
+      if (rest.empty()) return -1;
+
+      auto& s   = sibs[(modrm >> 6) == 0][rest[0]];
+      base      = s.base;
+      index     = s.index;
+      scaleLog2 = s.scaleLog2;
+      dispBytes += s.dispBytes;
+      used = 1;
+    }
+
+    if (rest.size() < used + dispBytes) return -1;
+
+    int32_t disp = 0;
+    auto    d    = &rest[used];
+    if (dispBytes == 1) disp = (int8_t)utl::readU8(d);
+    else if (dispBytes == 2)
+      disp = (int16_t)utl::readU16(d);
+    else if (dispBytes == 4)
+      disp = (int32_t)utl::readU32(d);
+
+    i.setMemory((proc::gpr)base, (proc::gpr)index, scaleLog2, disp);
+    return (int)(used + dispBytes);
+  }
+
+  ///
+  /// Decodes the operands of I, the cursor points at the opcode
+  ///
+  template <typename I>
+  insn decode(context& x) {
+    constexpr auto f = I::form;
+
+    insn i {};
+
+    // SIB byte and displacement
+    size_t rmBytes = 0;
+    if constexpr (hasModRM(f)) {
+      auto n = decodeModRM(x, i);
+      if (n < 0) return insn {};
+      rmBytes = (size_t)n;
+    }
+
+    if (!x.tryEnsureAndSetLen(true, operandBytes(f, I::bits) + rmBytes, (size_t)0)) return insn {};
+
+    i.id = I::id;
+    if constexpr (I::bits == 16) i.flags |= insnFlags::operandSize16;
+
+    if constexpr (hasOpcodeReg(f)) i.setGpr(x.low());
+    if constexpr (f == operandForm::accImmz) i.setGpr(proc::gpr::eax);
+    if constexpr (hasModRM(f)) {
+      x.c++;
+      if constexpr (f == operandForm::rmReg || f == operandForm::regRm) i.setGpr2(x.mid());
+      x.c += rmBytes;
+    }
+
+    if constexpr (f == operandForm::imm8 || f == operandForm::rmImm8) {
+      x.c++;
+      i.imm = utl::readU8(x.c);
+    } else if constexpr (f == operandForm::opRegImmz || f == operandForm::immz || f == operandForm::accImmz
+                         || f == operandForm::rmImmz) {
+      x.c++;
+      if constexpr (I::bits == 16) i.imm = utl::readU16(x.c);
+      else
+        i.imm = utl::readU32(x.c);
+    } else if constexpr (f == operandForm::relz) {
+      x.c++;
+      if constexpr (I::bits == 16) i.imm = x.handleSizeWraparound(utl::readU16(x.c));
+      else
+        i.imm = x.handleSizeWraparound(utl::readU32(x.c));
+    }
+
+    return i;
+  }
+
+  template <typename I16, typename I32>
+  insn decode(context& x) {
+    if (x.operandSizePrefix) return decode<I16>(x);
+    return decode<I32>(x);
+  }
+
+  ///
+  /// Opcodes followed by a ModR/M byte get a secondary table each,
+  /// indexed by that byte
+  ///
+  constexpr size_t secondaryCount = [] {
+    std::array<bool, 256> seen {};
+    size_t                n = 0;
+#define IMP_ISA_COUNT(name16, name32, type, opcode, group, form)                                                       \
+  if (hasModRM(operandForm::form) && !seen[opcode]) {                                                                  \
+    seen[opcode] = true;                                                                                               \
+    n++;                                                                                                               \
+  }
+    IMP_ISA(IMP_ISA_COUNT)
+#undef IMP_ISA_COUNT
+    return n;
+  }();
+
+  /// Secondary table slot of an opcode
+  constexpr std::array<uint8_t, 256> secondarySlot = [] {
+    std::array<uint8_t, 256> slots {};
+    std::array<bool, 256>    seen {};
+    uint8_t                  n = 0;
+#define IMP_ISA_SLOT(name16, name32, type, opcode, group, form)                                                        \
+  if (hasModRM(operandForm::form) && !seen[opcode]) {                                                                  \
+    seen[opcode]  = true;                                                                                              \
+    slots[opcode] = n++;                                                                                               \
+  }
+    IMP_ISA(IMP_ISA_SLOT)
+#undef IMP_ISA_SLOT
+    return slots;
+  }();
+
+  ///
+  /// Fills the 32 entries of ModR/M bytes with the given reg field,
+  /// decodeModRM tells them apart
+  ///
+  constexpr void fillReg(table& t, uint8_t reg, handler h) {
+    for (size_t mod = 0; mod < 4; mod++) {
+      for (size_t rm = 0; rm < 8; rm++) t[(mod << 6) | (reg << 3) | rm] = h;
+    }
+  }
+
+  constexpr std::array<table, secondaryCount> secondary = [] {
+    std::array<table, secondaryCount> ts {};
+    for (auto& t : ts) t.fill(&invalid);
+#define IMP_ISA_SECONDARY(name16, name32, type, opcode, group, form)                                                   \
+  if constexpr (hasModRM(operandForm::form)) {                                                                         \
+    auto& t = ts[secondarySlot[opcode]];                                                                               \
+    if constexpr (group == noGroup) {                                                                                  \
+      for (size_t reg = 0; reg < 8; reg++) fillReg(t, reg, &decode<name16, name32>);                                  \
+    } else                                                                                                             \
+      fillReg(t, group, &decode<name16, name32>);                                                                      \
+  }
+    IMP_ISA(IMP_ISA_SECONDARY)
+#undef IMP_ISA_SECONDARY
+    return ts;
+  }();
+
+  ///
+  /// Primary handler for opcodes followed by a ModR/M byte, after
+  /// making sure the ModR/M byte is available it jumps straight into
+  /// the secondary table, with the cursor still at the opcode
+  ///
+  template <uint8_t Opcode>
+  insn viaSecondary(context& x) {
+    ENSURE_AND_SET_LEN2$(1);
+
+    return secondary[secondarySlot[Opcode]][x.c[1]](x);
+  }
 
-    setLen(check ? t : f);
-    return true;
+  /// Indexed by the first non-prefix byte
+  constexpr table primary = [] {
+    table t {};
+    t.fill(&invalid);
+#define IMP_ISA_PRIMARY(name16, name32, type, opcode, group, form)                                                     \
+  if constexpr (hasModRM(operandForm::form))                                                                           \
+    t[opcode] = &viaSecondary<opcode>;                                                                                 \
+  else if constexpr (hasOpcodeReg(operandForm::form))                                                                  \
+    for (size_t r = 0; r < 8; r++) t[opcode + r] = &decode<name16, name32>;                                           \
+  else                                                                                                                 \
+    t[opcode] = &decode<name16, name32>;
+    IMP_ISA(IMP_ISA_PRIMARY)
+#undef IMP_ISA_PRIMARY
+    return t;
+  }();
+
+#undef ENSURE_AND_SET_LEN2$
+
+  ///
+  /// How each legacy prefix changes insn::flags, prefixes of
+  /// the same group override each other. Zero for non-prefixes
+  ///
+  struct prefixEffect {
+    uint8_t clear;
+    uint8_t set;
   };
-#define ENSURE_AND_SET_LEN$(c, t, f)                                                                                   \
-  if (!tryEnsureAndSetLen(c, t, f)) return none {};
-#define ENSURE_AND_SET_LEN2$(n)                                                                                        \
-  if (!tryEnsureAndSetLen(true, n, 0)) return none {};
 
-  // non-instructions
-  if (*c == 0x66) {
-    if (operandSizePrefix) return none {};
+  constexpr std::array<prefixEffect, 256> prefixes = [] {
+    std::array<prefixEffect, 256> t {};
+
+    auto seg = [&](uint8_t byte, segment s) {
+      t[byte] = {insnFlags::segmentMask, (uint8_t)((uint8_t)s << 5)};
+    };
+
+    // group 1
+    t[0xf0] = {0, insnFlags::lockPrefix};
+    t[0xf2] = {insnFlags::repPrefix | insnFlags::repnePrefix, insnFlags::repnePrefix};
+    t[0xf3] = {insnFlags::repPrefix | insnFlags::repnePrefix, insnFlags::repPrefix};
+    // group 2
+    seg(0x26, segment::es);
+    seg(0x2e, segment::cs);
+    seg(0x36, segment::ss);
+    seg(0x3e, segment::ds);
+    seg(0x64, segment::fs);
+    seg(0x65, segment::gs);
+    // group 3
+    t[0x66] = {0, insnFlags::operandSize16};
+    // group 4
+    t[0x67] = {0, insnFlags::addressSize16};
+    return t;
+  }();
+
+  ///
+  /// What the length decoder needs to know about a primary opcode,
+  /// generated from the same IMP_ISA lines as primary and secondary
+  ///
+  struct lengthEntry {
+    bool    valid   = false;
+    bool    modrm   = false;
+    uint8_t bytes16 = 0; // operandBytes under the operand size prefix
+    uint8_t bytes32 = 0; // ditto, without
+    uint8_t regs    = 0; // ModR/M reg fields that decode, a bit each
+  };
+
+  constexpr std::array<lengthEntry, 256> lengths = [] {
+    std::array<lengthEntry, 256> t {};
+
+    auto set = [&](size_t opcode, operandForm f, int8_t group) {
+      auto& e   = t[opcode];
+      e.valid   = true;
+      e.modrm   = hasModRM(f);
+      e.bytes16 = (uint8_t)operandBytes(f, 16);
+      e.bytes32 = (uint8_t)operandBytes(f, 32);
+      if (e.modrm) e.regs |= group == noGroup ? 0xff : (uint8_t)(1 << group);
+    };
+
+#define IMP_ISA_LENGTHS(name16, name32, type, opcode, group, form)                                                     \
+  if constexpr (hasOpcodeReg(operandForm::form))                                                                       \
+    for (size_t r = 0; r < 8; r++) set(opcode + r, operandForm::form, group);                                         \
+  else                                                                                                                 \
+    set(opcode, operandForm::form, group);
+    IMP_ISA(IMP_ISA_LENGTHS)
+#undef IMP_ISA_LENGTHS
+    return t;
+  }();
+
+  ///
+  /// Length of the instruction at p, with n bytes available,
+  /// 0 where decodeAt wouldn't decode anything
+  ///
+  inline size_t lengthOf(const uint8_t* p, size_t n) noexcept {
+    uint8_t flags = 0;
+
+    size_t i = 0;
+    for (; i < n; i++) {
+      auto effect = prefixes[p[i]];
+      if (effect.set == 0) break;
+
+      if (i == maxInsnLength - 1) return 0;
+      flags = (flags & ~effect.clear) | effect.set;
+    }
+    if (i == n) return 0;
+
+    auto& e = lengths[p[i]];
+    if (!e.valid) return 0;
+
+    size_t length = i + 1 + ((flags & insnFlags::operandSize16) ? e.bytes16 : e.bytes32);
+    if (e.modrm) {
+      if (i + 1 >= n) return 0;
 
-    operandSizePrefix = true;
-    return consume();
-  } else if (*c == 0x67) {
-    if (addressSizePrefix) return none {};
+      uint8_t modrm = p[i + 1];
+      if (!((e.regs >> ((modrm >> 3) & 7)) & 1)) return 0;
 
-    addressSizePrefix = true;
-    return consume();
+      auto& m = ((flags & insnFlags::addressSize16) ? modrm16 : modrm32)[modrm];
+      length += m.dispBytes;
+      if (m.sib) {
+        if (i + 2 >= n) return 0;
+        length += 1 + sibs[(modrm >> 6) == 0][p[i + 2]].dispBytes;
+      }
+    }
+
+    if (length > n || length > maxInsnLength) return 0;
+    return length;
   }
+} // namespace
+
+size_t disasm::lengthAt(memoryViewType code, size_t at) {
+  if (at >= code.size()) return 0;
+  return lengthOf(&code[at], code.size() - at);
+}
+
+size_t disasm::markStarts(memoryViewType code, std::span<uint64_t> starts) {
+  size_t marked = 0;
+  size_t n      = std::min(code.size(), starts.size() * 64);
+
+  for (size_t at = 0; at < n;) {
+    auto length = lengthOf(&code[at], code.size() - at);
+    if (length) {
+      starts[at / 64] |= 1ull << (at % 64);
+      marked++;
+      at += length;
+    } else
+      at++;
+  }
+
+  return marked;
+}
+
+insn disasm::decodeAt(memoryViewType code, size_t at) {
+  auto    insnCode = code.subspan(at);
+  uint8_t flags    = 0;
+
+  // non-instructions, in one forward pass
+  size_t i = 0;
+  for (; i < insnCode.size(); i++) {
+    auto effect = prefixes[insnCode[i]];
+    if (effect.set == 0) break;
+
+    // leave room for at least the opcode
+    if (i == maxInsnLength - 1) return insn {};
+    flags = (flags & ~effect.clear) | effect.set;
+  }
+  if (i == insnCode.size()) return insn {};
   //
 
-  // reset after applying...
-  defer {[&] {
-    operandSizePrefix = addressSizePrefix = false;
-  }};
+  size_t  length = 0;
+  context x {insnCode,
+             &insnCode[i],
+             length,
+             (bool)(flags & insnFlags::operandSize16),
+             (bool)(flags & insnFlags::addressSize16),
+             at};
+  auto    decoded = primary[insnCode[i]](x);
+
+  // a rejected instruction consumes nothing
+  if (!decoded.valid() || length > maxInsnLength) return insn {};
+
+  decoded.length = (uint8_t)length;
+  decoded.flags |= flags;
+  return decoded;
+}
 
-  auto handleSizeWraparound = [&]<typename T>(T n) -> T {
-    auto space = utl::maxN<sizeof(T) * 8>::u - n;
-    if (space < lastLength) return (lastLength - space) - 1;
-    return n + lastLength;
-  };
+insn disassembler::next() {
+  at += lastLength;
+  if (at >= code.size()) {
+    lastLength = 0;
+    return insn {};
+  }
 
-  if (*c == 0x6a) {
-    // push imm8, extended to imm16 if prefix
+  auto decoded = decodeAt(code, at);
+  lastLength   = decoded.length;
+  return decoded;
+}
 
-    // operand
-    ENSURE_AND_SET_LEN2$(1);
-    c++;
-
-    if (operandSizePrefix) return pushImm16From8 {(uint16_t)utl::readU8(c)};
-    return pushImm8 {utl::readU8(c)};
-  } else if (*c == 0x68) {
-    // push imm32/imm16 if prefix
-
-    // operand
-    ENSURE_AND_SET_LEN$(operandSizePrefix, 2, 4);
-    c++;
-
-    if (operandSizePrefix) return pushImm16 {utl::readU16(c)};
-    return pushImm32 {utl::readU32(c)};
-  } else if (auto r = proc::utl::within(*c, 0x40, 0x47)) {
-    // inc reg32/reg16 if prefix
-
-    setLen();
-
-    if (operandSizePrefix) return incReg16 {*r};
-    return incReg32 {*r};
-  } else if (auto r = proc::utl::within(*c, 0x48, 0x4f)) {
-    // dec reg32/reg16 if prefix
-
-    setLen();
-
-    if (operandSizePrefix) return decReg16 {*r};
-    return decReg32 {*r};
-  } else if (auto r = proc::utl::within(*c, 0x50, 0x57)) {
-    // push reg32/reg16 if prefix
-
-    setLen();
-
-    if (operandSizePrefix) return pushReg16 {*r};
-    return pushReg32 {*r};
-  } else if (auto r = proc::utl::within(*c, 0x58, 0x5f)) {
-    // pop reg32/reg16 if prefix
-
-    setLen();
-
-    if (operandSizePrefix) return popReg16 {*r};
-    return popReg32 {*r};
-  } else if (auto r = proc::utl::within(*c, 0xb8, 0xbf)) {
-    // mov reg32/reg16 if prefix, imm32/imm16 if prefix
-
-    // operand
-    ENSURE_AND_SET_LEN$(operandSizePrefix, 2, 4);
-    c++;
-
-    if (operandSizePrefix) return movReg16 {*r, utl::readU16(c)};
-    return movReg32 {*r, utl::readU32(c)};
-  } else if (*c == 0x83) {
-    // Following machine code byte, operand
-    ENSURE_AND_SET_LEN2$(2);
-    c++;
-
-    // add reg32/reg16 if prefix, imm8
-    if (auto r = proc::utl::within(*c, 0xc0, 0xc7)) {
-      c++;
-
-      if (operandSizePrefix) return addReg16Imm8 {*r, utl::readU8(c)};
-      return addReg32Imm8 {*r, utl::readU8(c)};
-    } // adc reg32/reg16 if prefix, imm8
-    else if (auto r = proc::utl::within(*c, 0xd0, 0xd7)) {
-      c++;
-
-      if (operandSizePrefix) return adcReg16Imm8 {*r, utl::readU8(c)};
-      return adcReg32Imm8 {*r, utl::readU8(c)};
-    } // and reg32/reg16 if prefix, imm8
-    else if (auto r = proc::utl::within(*c, 0xe0, 0xe7)) {
-      c++;
-
-      if (operandSizePrefix) return andReg16Imm8 {*r, utl::readU8(c)};
-      return andReg32Imm8 {*r, utl::readU8(c)};
-    }
-  } else if (*c == 0x81) {
-    // Following machine code byte, operand
-    ENSURE_AND_SET_LEN$(operandSizePrefix, 3, 5);
-    c++;
-
-    // add reg32/reg16 if prefix, imm32/imm16 if prefix
-    if (auto r = proc::utl::within(*c, 0xc0, 0xc7)) {
-      c++;
-
-      if (operandSizePrefix) return addReg16Imm16 {*r, utl::readU16(c)};
-      return addReg32Imm32 {*r, utl::readU32(c)};
-    }
-  } else if (*c == 0x05) {
-    // operand
-    ENSURE_AND_SET_LEN$(operandSizePrefix, 2, 4);
-    c++;
-
-    // add eax/ax if prefix, imm32/imm16 if prefix
-    if (operandSizePrefix) return addAxImm16 {utl::readU16(c)};
-    return addEaxImm32 {utl::readU32(c)};
-  } else if (*c == 0x85) {
-    ENSURE_AND_SET_LEN2$(1);
-    c++;
-
-    // test reg32/reg16 if prefix, reg32/reg16 if prefix
-    if (auto rs = proc::utl::within2(*c, 0xc0, 0xff)) {
-      auto [r1, r2] = *rs;
-      if (operandSizePrefix) return testReg16Reg16 {r1, r2};
-      return testReg32Reg32 {r1, r2};
-    }
-  } else if (*c == 0xe8) {
-    // operand
-    ENSURE_AND_SET_LEN$(operandSizePrefix, 2, 4);
-    c++;
-
-    if (operandSizePrefix) return callNear16 {handleSizeWraparound(utl::readU16(c))};
-    return callNear32 {handleSizeWraparound(utl::readU32(c))};
-  } else if (*c == 0xe9) {
-    ENSURE_AND_SET_LEN$(operandSizePrefix, 2, 4);
-    c++;
-
-    if (operandSizePrefix) return jmpNear16 {handleSizeWraparound(utl::readU16(c))};
-    return jmpNear32 {handleSizeWraparound(utl::readU32(c))};
+size_t disasm::decodeRange(memoryViewType code, insnBuffer& out, size_t at) {
+  out.count = 0;
+
+  while (at < code.size() && out.count < out.capacity()) {
+    auto decoded = decodeAt(code, at);
+    out.store(out.count++, at, decoded);
+    at += sweepLength(decoded);
   }
 
-  return none {};
-#undef ENSURE_AND_SET_LEN$
-#undef CANT_HAVE_PREFIX
+  return at;
+}
+void disasm::insnBuffer::store(size_t n, size_t at, const insn& decoded) noexcept {
+  kinds[n]    = decoded.id;
+  lengths[n]  = (uint8_t)sweepLength(decoded);
+  gprs[n]     = decoded.gpr();
+  gprs2[n]    = decoded.gpr2();
+  imms[n]     = decoded.imm;
+  disps[n]    = decoded.disp;
+  memRegs[n]  = decoded.memRegs;
+  memInfos[n] = decoded.memInfo;
+  targets[n]  = 0;
+  offsets[n]  = (uint32_t)at;
+
+  // the target lives in imm
+  if (decoded.hasTarget()) {
+    targets[n] = decoded.imm;
+    imms[n]    = 0;
+  }
 }
 
-#undef defer
-#undef __IMP_CONCAT2
-#undef __IMP_CONCAT
+disasm::insnBuffer::insnBuffer(size_t capacity)
+    : kinds(capacity), lengths(capacity), gprs(capacity), gprs2(capacity), imms(capacity), disps(capacity),
+      memRegs(capacity), memInfos(capacity), targets(capacity), offsets(capacity) {
+}
@@ -1,203 +1,295 @@
 #pragma once
 
 #include "proc.hh"
+#include "isa.hh"
 #include <cstdint>
 #include <variant>
 #include <span>
+#include <vector>
 
 namespace disasm {
-  enum instructionType {
-    MOV,
-    JMP,
-    CALL,
-    TEST,
-    ADD,
-    ADC,
-    AND,
-    INC,
-    DEC,
-    PUSH,
-    POP,
-  };
-
   struct none { };
 
-  struct pushImm8 {
-    static constexpr auto type = instructionType::PUSH;
-    uint8_t               imm;
-  };
-
-  struct pushImm16From8 {
-    static constexpr auto type = instructionType::PUSH;
-    uint16_t              imm;
-  };
-
-  struct pushImm16 {
-    static constexpr auto type = instructionType::PUSH;
-    uint16_t              imm;
-  };
-
-  struct pushImm32 {
-    static constexpr auto type = instructionType::PUSH;
-    uint32_t              imm;
-  };
-
-  struct pushReg16 {
-    static constexpr auto type = instructionType::PUSH;
-    proc::gpr             gpr;
-  };
-
-  struct pushReg32 {
-    static constexpr auto type = instructionType::PUSH;
-    proc::gpr             gpr;
-  };
-
-  struct popReg16 {
-    static constexpr auto type = instructionType::POP;
-    proc::gpr             gpr;
-  };
-
-  struct popReg32 {
-    static constexpr auto type = instructionType::POP;
-    proc::gpr             gpr;
-  };
-
-  struct movReg16 {
-    static constexpr auto type = instructionType::MOV;
-    proc::gpr             gpr;
-    uint16_t              imm;
-  };
+  /// Every decodable instruction, ordered like the alternatives of ret
+#define IMP_ISA_KINDS(name16, name32, type, opcode, group, form) name16, name32,
+  enum class kind : uint8_t { none, IMP_ISA(IMP_ISA_KINDS) count };
+#undef IMP_ISA_KINDS
 
-  struct movReg32 {
-    static constexpr auto type = instructionType::MOV;
-    proc::gpr             gpr;
-    uint32_t              imm;
+  ///
+  /// Decoded instructions, generated from IMP_ISA
+  ///
+#define IMP_ISA_STRUCT(name, bits_, type_, opcode_, group_, form_)                                                     \
+  struct name : operands<operandForm::form_, bits_> {                                                                  \
+    static constexpr auto    id     = kind::name;                                                                     \
+    static constexpr auto    type   = instructionType::type_;                                                         \
+    static constexpr auto    form   = operandForm::form_;                                                             \
+    static constexpr size_t  bits   = bits_;                                                                          \
+    static constexpr uint8_t opcode = opcode_;                                                                        \
+    static constexpr int8_t  group  = group_;                                                                         \
   };
+#define IMP_ISA_DECLARE(name16, name32, type, opcode, group, form)                                                     \
+  IMP_ISA_STRUCT(name16, 16, type, opcode, group, form)                                                                \
+  IMP_ISA_STRUCT(name32, 32, type, opcode, group, form)
 
-  struct addReg16Imm8 {
-    static constexpr auto type = instructionType::ADD;
-    proc::gpr             gpr;
-    uint8_t               imm;
-  };
+  IMP_ISA(IMP_ISA_DECLARE)
 
-  struct addReg32Imm8 {
-    static constexpr auto type = instructionType::ADD;
-    proc::gpr             gpr;
-    uint8_t               imm;
-  };
+#undef IMP_ISA_DECLARE
+#undef IMP_ISA_STRUCT
 
-  struct adcReg16Imm8 {
-    static constexpr auto type = instructionType::ADC;
-    proc::gpr             gpr;
-    uint8_t               imm;
-  };
+  using memoryViewType = std::span<const uint8_t>;
 
-  struct addReg16Imm16 {
-    static constexpr auto type = instructionType::ADD;
-    proc::gpr             gpr;
-    uint16_t              imm;
-  };
+#define IMP_ISA_ALTERNATIVES(name16, name32, type, opcode, group, form) , name16, name32
+  using ret = std::variant<none IMP_ISA(IMP_ISA_ALTERNATIVES)>;
+#undef IMP_ISA_ALTERNATIVES
+
+  static_assert((size_t)kind::count == std::variant_size_v<ret>);
+
+  ///
+  /// What is statically known about a kind, for when there's
+  /// no struct type at hand. Meaningless for kind::none
+  ///
+  struct kindInfo {
+    instructionType type;
+    operandForm     form;
+    uint8_t         bits;
+  };
+
+  inline constexpr kindInfo kindInfos[] = {
+      kindInfo {},
+#define IMP_ISA_INFO(name16, name32, type, opcode, group, form)                                                        \
+  kindInfo {instructionType::type, operandForm::form, 16}, kindInfo {instructionType::type, operandForm::form, 32},
+      IMP_ISA(IMP_ISA_INFO)
+#undef IMP_ISA_INFO
+  };
+
+  static constexpr kindInfo info(kind k) noexcept {
+    return kindInfos[(size_t)k];
+  }
+
+  /// Segment override prefixes, stored in the top 3 bits of insn::flags
+  enum class segment : uint8_t { none, es, cs, ss, ds, fs, gs };
+
+  enum insnFlags : uint8_t {
+    operandSize16 = (1 << 0), // 0x66
+    addressSize16 = (1 << 1), // 0x67
+    lockPrefix    = (1 << 2), // 0xf0
+    repPrefix     = (1 << 3), // 0xf3
+    repnePrefix   = (1 << 4), // 0xf2
+    segmentMask   = (0b111 << 5),
+  };
+
+  /// Longest instruction the i386 accepts, prefixes included
+  static constexpr size_t maxInsnLength = 15;
+
+  enum memFlags : uint8_t {
+    scaleMask     = 0b11, // log2 of the index scale
+    memoryOperand = (1 << 7),
+  };
+
+  ///
+  /// Compact decoded instruction, what the decoder produces natively.
+  /// Trivially copyable and 16 bytes, so caches of decoded instructions
+  /// stay dense; toRet() turns it into the matching ret alternative
+  ///
+  struct insn {
+    /// Immediate, or resolved call/jmp target
+    uint32_t imm = 0;
+    /// Displacement of a ModR/M memory operand
+    int32_t disp = 0;
+    kind    id   = kind::none;
+    /// 0 if nothing was decoded
+    uint8_t length = 0;
+    /// gpr in the low nibble, gpr2 in the high one, GPR_MAX if unused
+    uint8_t gprs  = proc::gpr::GPR_MAX | (proc::gpr::GPR_MAX << 4);
+    uint8_t flags = 0;
+    /// Base of a ModR/M memory operand in the low nibble, index in
+    /// the high one, GPR_MAX if unused
+    uint8_t memRegs = proc::gpr::GPR_MAX | (proc::gpr::GPR_MAX << 4);
+    /// memFlags
+    uint8_t memInfo = 0;
+
+    proc::gpr gpr() const noexcept {
+      return (proc::gpr)(gprs & 0xf);
+    }
 
-  struct addReg32Imm32 {
-    static constexpr auto type = instructionType::ADD;
-    proc::gpr             gpr;
-    uint32_t              imm;
-  };
+    proc::gpr gpr2() const noexcept {
+      return (proc::gpr)(gprs >> 4);
+    }
 
-  struct addAxImm16 {
-    static constexpr auto type = instructionType::ADD;
-    uint16_t              imm;
-  };
+    void setGpr(proc::gpr r) noexcept {
+      gprs = (gprs & 0xf0) | r;
+    }
 
-  struct addEaxImm32 {
-    static constexpr auto type = instructionType::ADD;
-    uint32_t              imm;
-  };
+    void setGpr2(proc::gpr r) noexcept {
+      gprs = (gprs & 0x0f) | (r << 4);
+    }
 
-  struct adcReg32Imm8 {
-    static constexpr auto type = instructionType::ADC;
-    proc::gpr             gpr;
-    uint8_t               imm;
-  };
+    void setMemory(proc::gpr base, proc::gpr index, uint8_t scaleLog2, int32_t displacement) noexcept {
+      memRegs = base | (index << 4);
+      memInfo = memFlags::memoryOperand | scaleLog2;
+      disp    = displacement;
+    }
 
-  struct andReg16Imm8 {
-    static constexpr auto type = instructionType::AND;
-    proc::gpr             gpr;
-    uint8_t               imm;
-  };
+    bool isMemory() const noexcept {
+      return memInfo & memFlags::memoryOperand;
+    }
 
-  struct andReg32Imm8 {
-    static constexpr auto type = instructionType::AND;
-    proc::gpr             gpr;
-    uint8_t               imm;
-  };
+    /// ModR/M operand, meaningless for forms without one
+    rmOperand rm() const noexcept {
+      rmOperand r;
+      if (!isMemory()) {
+        r.base = gpr();
+        return r;
+      }
+
+      r.base   = (proc::gpr)(memRegs & 0xf);
+      r.index  = (proc::gpr)(memRegs >> 4);
+      r.scale  = (uint8_t)(1 << (memInfo & memFlags::scaleMask));
+      r.disp   = disp;
+      r.memory = true;
+      return r;
+    }
 
-  struct incReg16 {
-    static constexpr auto type = instructionType::INC;
-    proc::gpr             gpr;
-  };
+    bool valid() const noexcept {
+      return id != kind::none;
+    }
 
-  struct incReg32 {
-    static constexpr auto type = instructionType::INC;
-    proc::gpr             gpr;
-  };
+    segment segmentOverride() const noexcept {
+      return (segment)(flags >> 5);
+    }
 
-  struct decReg16 {
-    static constexpr auto type = instructionType::DEC;
-    proc::gpr             gpr;
-  };
+    /// Whether imm is a resolved call/jmp target
+    bool hasTarget() const noexcept {
+      auto t = info(id).type;
+      return valid() && (t == instructionType::CALL || t == instructionType::JMP);
+    }
 
-  struct decReg32 {
-    static constexpr auto type = instructionType::DEC;
-    proc::gpr             gpr;
-  };
+    /// Moves a resolved target by delta, wrapping at operand size
+    void rebase(uint64_t delta) noexcept {
+      if (!hasTarget()) return;
 
-  struct testReg16Reg16 {
-    static constexpr auto type = instructionType::TEST;
-    proc::gpr             gpr;
-    proc::gpr             gpr2;
-  };
+      if (info(id).bits == 16) imm = (uint16_t)(imm + delta);
+      else
+        imm = (uint32_t)(imm + delta);
+    }
 
-  struct testReg32Reg32 {
-    static constexpr auto type = instructionType::TEST;
-    proc::gpr             gpr;
-    proc::gpr             gpr2;
-  };
+    /// Fields of the decoded struct I, id must be I::id
+    template <typename I>
+    I as() const noexcept {
+      I i {};
+      if constexpr (requires { i.gpr; }) i.gpr = gpr();
+      if constexpr (requires { i.gpr2; }) i.gpr2 = gpr2();
+      if constexpr (requires { i.imm; }) i.imm = (decltype(i.imm))imm;
+      if constexpr (requires { i.addr; }) i.addr = (decltype(i.addr))imm;
+      if constexpr (requires { i.rm; }) i.rm = rm();
+      return i;
+    }
 
-  struct jmpNear16 {
-    static constexpr auto type = instructionType::JMP;
-    uint16_t              addr; // not short jump, therefore unsigned
+    ret toRet() const noexcept {
+      switch (id) {
+#define IMP_ISA_TO_RET(name16, name32, type, opcode, group, form)                                                      \
+  case kind::name16:                                                                                                   \
+    return as<name16>();                                                                                               \
+  case kind::name32:                                                                                                   \
+    return as<name32>();
+        IMP_ISA(IMP_ISA_TO_RET)
+#undef IMP_ISA_TO_RET
+      default:
+        return none {};
+      }
+    }
   };
 
-  struct jmpNear32 {
-    static constexpr auto type = instructionType::JMP;
-    uint32_t              addr; // ditto
-  };
+  static_assert(sizeof(insn) == 16 && std::is_trivially_copyable_v<insn>);
 
-  struct callNear16 {
-    static constexpr auto type = instructionType::CALL;
-    uint16_t              addr;
-  };
+  ///
+  /// Decoded instructions, as a structure of arrays. Columns
+  /// are allocated once, up front, and filled by decodeRange
+  ///
+  struct insnBuffer {
+    insnBuffer() = default;
+    explicit insnBuffer(size_t capacity);
 
-  struct callNear32 {
-    static constexpr auto type = instructionType::CALL;
-    uint32_t              addr;
-  };
+    size_t size() const noexcept {
+      return count;
+    }
 
-  using memoryViewType = std::span<const uint8_t>;
+    size_t capacity() const noexcept {
+      return kinds.size();
+    }
 
-  using ret
-      = std::variant<none, pushImm8, pushImm16From8, pushImm16, pushImm32, pushReg16, pushReg32, popReg16, popReg32,
-                     movReg16, movReg32, addReg16Imm8, addReg32Imm8, adcReg16Imm8, adcReg32Imm8, andReg16Imm8,
-                     andReg32Imm8, addReg16Imm16, addReg32Imm32, addAxImm16, addEaxImm32, incReg16, incReg32, decReg16,
-                     decReg32, testReg16Reg16, testReg32Reg32, jmpNear16, jmpNear32, callNear16, callNear32>;
+    /// Fills entry n with an instruction decoded at offset at
+    void store(size_t n, size_t at, const insn& decoded) noexcept;
+
+    std::vector<kind>     kinds;
+    std::vector<uint8_t>  lengths;
+    std::vector<uint8_t>  gprs;  // proc::gpr, GPR_MAX if none
+    std::vector<uint8_t>  gprs2; // ditto
+    std::vector<uint32_t> imms;
+    std::vector<int32_t>  disps;    // see insn::disp
+    std::vector<uint8_t>  memRegs;  // see insn::memRegs
+    std::vector<uint8_t>  memInfos; // see insn::memInfo
+    std::vector<uint32_t> targets;  // resolved call/jmp targets
+    std::vector<uint32_t> offsets; // where each instruction starts
+    size_t                count = 0;
+  };
+
+  ///
+  /// Decodes the single instruction at code[at], call/jmp targets
+  /// are resolved relative to code[0]
+  ///
+  insn decodeAt(memoryViewType code, size_t at);
+
+  /// How far a linear sweep moves past an instruction, undecodable
+  /// bytes are skipped one at a time
+  inline size_t sweepLength(const insn& decoded) noexcept {
+    return decoded.valid() ? decoded.length : 1;
+  }
+
+  ///
+  /// Length of the instruction at code[at] without decoding its
+  /// operands, the same as disassembler::length() would give
+  ///
+  size_t lengthAt(memoryViewType code, size_t at);
+
+  ///
+  /// Linear sweep that only marks where decodable instructions start,
+  /// bit n of starts being code[n]; bytes that don't decode are skipped
+  /// one at a time and left clear. Stops early if starts has fewer bits
+  /// than code has bytes. Bits are only ever set, returns how many were
+  ///
+  size_t markStarts(memoryViewType code, std::span<uint64_t> starts);
+
+  ///
+  /// Linear sweep over code starting at code[at], until either the
+  /// end of code or out is full. Bytes that don't decode are recorded
+  /// as 1 byte long kind::none entries. Returns where it stopped
+  ///
+  size_t decodeRange(memoryViewType code, insnBuffer& out, size_t at = 0);
 
   struct disassembler {
     disassembler() = default;
     disassembler(memoryViewType code) : code(code) {
     }
 
-    ret consume();
+    ///
+    /// Starts decoding at code[at], call/jmp targets are
+    /// still resolved relative to code[0]
+    ///
+    disassembler(memoryViewType code, size_t at) : code(code), at(at) {
+    }
+
+    /// Decodes the next instruction
+    insn next();
+
+    ///
+    /// next, as the struct of its kind. The conversion is a switch
+    /// over every kind on top of decoding, hot loops should stay on
+    /// next
+    ///
+    ret consume() {
+      return next().toRet();
+    }
 
     size_t length() const noexcept {
       return lastLength;
@@ -205,8 +297,7 @@ namespace disasm {
 
 private:
     memoryViewType code;
-    size_t         lastLength        = 0;
-    bool           operandSizePrefix = false;
-    bool           addressSizePrefix = false;
+    size_t         at         = 0;
+    size_t         lastLength = 0;
   };
 } // namespace disasm
@@ -1,8 +1,111 @@
 #include "emu.hh"
+#include <bit>
+#include <mutex>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+#ifdef IMP_GUEST_SIGNALS
+#include <csetjmp>
+#include <csignal>
+#endif
+
+namespace {
+  ///
+  /// Reserves the guest address space, and maps the bottom ramSize
+  /// and top stackSize bytes of it. nullptr if that can't be done
+  ///
+  uint8_t* mapGuest(size_t ramSize, size_t stackSize) noexcept {
+    constexpr auto reserved = emu::softCPU::addressSpace + emu::softCPU::guardSize;
+    auto           stack    = emu::softCPU::addressSpace - stackSize;
+#ifdef _WIN32
+    auto base = (uint8_t*)VirtualAlloc(nullptr, reserved, MEM_RESERVE, PAGE_NOACCESS);
+    if (!base) return nullptr;
+    if (!VirtualAlloc(base, ramSize, MEM_COMMIT, PAGE_READWRITE)
+        || !VirtualAlloc(base + stack, stackSize, MEM_COMMIT, PAGE_READWRITE)) {
+      VirtualFree(base, 0, MEM_RELEASE);
+      return nullptr;
+    }
+#else
+    auto mapping = mmap(nullptr, reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mapping == MAP_FAILED) return nullptr;
+    auto base = (uint8_t*)mapping;
+    if (mprotect(base, ramSize, PROT_READ | PROT_WRITE) || mprotect(base + stack, stackSize, PROT_READ | PROT_WRITE)) {
+      munmap(base, reserved);
+      return nullptr;
+    }
+#endif
+    return base;
+  }
+
+  void unmapGuest(uint8_t* base) noexcept {
+    if (!base) return;
+#ifdef _WIN32
+    VirtualFree(base, 0, MEM_RELEASE);
+#else
+    munmap(base, emu::softCPU::addressSpace + emu::softCPU::guardSize);
+#endif
+  }
+
+#ifdef IMP_GUEST_SIGNALS
+  ///
+  /// Where a fault in the guest memory of the emu running on this
+  /// thread goes, set up by step/runBlock
+  ///
+  struct faultScope {
+    sigjmp_buf     target;
+    const uint8_t* base;
+    faultScope*    previous;
+
+    explicit faultScope(const uint8_t* base) noexcept;
+    ~faultScope();
+  };
+
+  thread_local faultScope* activeFault = nullptr;
+
+  struct sigaction previousSegv, previousBus;
+
+  void onFault(int sig, siginfo_t* info, void* context) {
+    auto address = (const uint8_t*)info->si_addr;
+    auto scope   = activeFault;
+    if (scope && address >= scope->base && address < scope->base + emu::softCPU::addressSpace + emu::softCPU::guardSize)
+      siglongjmp(scope->target, 1);
+
+    // not the guest's, whoever had it before gets it
+    auto& previous = sig == SIGSEGV ? previousSegv : previousBus;
+    if (previous.sa_flags & SA_SIGINFO) previous.sa_sigaction(sig, info, context);
+    else if (previous.sa_handler != SIG_IGN && previous.sa_handler != SIG_DFL)
+      previous.sa_handler(sig);
+    else
+      // the access happens again, and takes the process down
+      signal(sig, SIG_DFL);
+  }
+
+  faultScope::faultScope(const uint8_t* base) noexcept : base(base), previous(activeFault) {
+    static std::once_flag installed;
+    std::call_once(installed, [] {
+      struct sigaction action = {};
+      action.sa_sigaction     = onFault;
+      // left with siglongjmp, which doesn't unblock it
+      action.sa_flags = SA_SIGINFO | SA_NODEFER;
+      sigemptyset(&action.sa_mask);
+      sigaction(SIGSEGV, &action, &previousSegv);
+      sigaction(SIGBUS, &action, &previousBus);
+    });
+
+    activeFault = this;
+  }
+
+  faultScope::~faultScope() {
+    activeFault = previous;
+  }
+#endif
+} // namespace
 
 emu::softCPU::softCPU() {
-  ram.size = 0x1000000;
-  ram.ptr  = std::move(std::unique_ptr<uint8_t[]>(new uint8_t[ram.size] {0}));
+  ram.base = mapGuest(ram.size, ram.stackSize);
+  assert(ram.base);
   // stack grows downward, artificially descends
   // from 0xffffffff
   gprs[proc::gpr::esp] = gprs[proc::gpr::ebp] = 0xffffffff;
@@ -10,83 +113,500 @@ emu::softCPU::softCPU() {
 
 emu::softCPU::softCPU(disasm::memoryViewType code, uint32_t ep) : emu::softCPU() {
   // copy code to virtual ram, at the beginning
-  memcpy((void *)ram.ptr.get(), (const void *)code.data(), code.size());
+  memcpy((void *)ram.base, (const void *)code.data(), std::min(code.size(), ram.size));
   // set entry point
   eip = ep;
 }
 
-disasm::ret emu::exec() {
-  disasm::disassembler ds(cpu.memory().subspan(cpu.eip));
-  auto                 insn = ds.consume();
-
-  // note: it would probably be faster to switch by idx
-  if (std::holds_alternative<disasm::none>(insn)) return insn;
-
-  if (auto *pushimm8 = std::get_if<disasm::pushImm8>(&insn)) pushImm(pushimm8->imm);
-  else if (auto *pushimm16from8 = std::get_if<disasm::pushImm16From8>(&insn))
-    pushImm(pushimm16from8->imm);
-  else if (auto *pushimm16 = std::get_if<disasm::pushImm16>(&insn))
-    pushImm(pushimm16->imm);
-  else if (auto *pushimm32 = std::get_if<disasm::pushImm32>(&insn))
-    pushImm(pushimm32->imm);
-  else if (auto *pushreg16 = std::get_if<disasm::pushReg16>(&insn))
-    pushReg<uint16_t>(pushreg16->gpr);
-  else if (auto *pushreg32 = std::get_if<disasm::pushReg32>(&insn))
-    pushReg<uint32_t>(pushreg32->gpr);
-  else if (auto *popreg16 = std::get_if<disasm::popReg16>(&insn))
-    popReg<uint16_t>(popreg16->gpr);
-  else if (auto *popreg32 = std::get_if<disasm::popReg32>(&insn))
-    popReg<uint32_t>(popreg32->gpr);
-  else if (auto *movreg16 = std::get_if<disasm::movReg16>(&insn))
-    movReg<uint16_t>(movreg16->gpr, movreg16->imm);
-  else if (auto *movreg32 = std::get_if<disasm::movReg32>(&insn))
-    movReg<uint32_t>(movreg32->gpr, movreg32->imm);
-  else if (auto *addreg16imm8 = std::get_if<disasm::addReg16Imm8>(&insn))
-    addOp<uint16_t>(addreg16imm8->gpr, addreg16imm8->imm);
-  else if (auto *addreg32imm8 = std::get_if<disasm::addReg32Imm8>(&insn))
-    addOp<uint32_t>(addreg32imm8->gpr, addreg32imm8->imm);
-  else if (auto *adcreg16imm8 = std::get_if<disasm::adcReg16Imm8>(&insn))
-    adcOp<uint16_t>(adcreg16imm8->gpr, adcreg16imm8->imm);
-  else if (auto *adcreg32imm8 = std::get_if<disasm::adcReg32Imm8>(&insn))
-    adcOp<uint32_t>(adcreg32imm8->gpr, adcreg32imm8->imm);
-  else if (auto *andreg16imm8 = std::get_if<disasm::andReg16Imm8>(&insn))
-    andOp<uint16_t>(andreg16imm8->gpr, andreg16imm8->imm);
-  else if (auto *andreg32imm8 = std::get_if<disasm::andReg32Imm8>(&insn))
-    andOp<uint32_t>(andreg32imm8->gpr, andreg32imm8->imm);
-  else if (auto *addreg16imm16 = std::get_if<disasm::addReg16Imm16>(&insn))
-    addOp<uint16_t>(addreg16imm16->gpr, addreg16imm16->imm);
-  else if (auto *addreg32imm32 = std::get_if<disasm::addReg32Imm32>(&insn))
-    addOp<uint32_t>(addreg32imm32->gpr, addreg32imm32->imm);
-  else if (auto *addaximm16 = std::get_if<disasm::addAxImm16>(&insn))
-    addOp<uint16_t>(proc::gpr::eax, addaximm16->imm);
-  else if (auto *addeaximm32 = std::get_if<disasm::addEaxImm32>(&insn))
-    addOp<uint32_t>(proc::gpr::eax, addeaximm32->imm);
-  else if (auto *increg16 = std::get_if<disasm::incReg16>(&insn))
-    incOp<uint16_t>(increg16->gpr);
-  else if (auto *increg32 = std::get_if<disasm::incReg32>(&insn))
-    incOp<uint32_t>(increg32->gpr);
-  else if (auto *decreg16 = std::get_if<disasm::decReg16>(&insn))
-    decOp<uint16_t>(decreg16->gpr);
-  else if (auto *decreg32 = std::get_if<disasm::decReg32>(&insn))
-    decOp<uint32_t>(decreg32->gpr);
-  else if (auto *testreg16reg16 = std::get_if<disasm::testReg16Reg16>(&insn))
-    testOp<uint16_t>(testreg16reg16->gpr, testreg16reg16->gpr2);
-  else if (auto *testreg32reg32 = std::get_if<disasm::testReg32Reg32>(&insn))
-    testOp<uint32_t>(testreg32reg32->gpr, testreg32reg32->gpr2);
-  else if (auto *callnear16 = std::get_if<disasm::callNear16>(&insn))
-    callAbs<uint16_t>(callnear16->addr,
-                      ds.length()); // already handled disp on addr for us
-  else if (auto *callnear32 = std::get_if<disasm::callNear32>(&insn))
-    callAbs<uint32_t>(callnear32->addr, ds.length()); // ditto
-  else if (auto *jmpnear16 = std::get_if<disasm::jmpNear16>(&insn))
-    jmpAbs<uint16_t>(jmpnear16->addr); // already handled disp for us
-  else if (auto *jmpnear32 = std::get_if<disasm::jmpNear32>(&insn))
-    jmpAbs<uint32_t>(jmpnear32->addr); // ditto
+emu::softCPU::~softCPU() {
+  unmapGuest(ram.base);
+}
+
+void emu::softCPU::snapshot() {
+  saved.taken = true;
+  saved.eip   = eip;
+  saved.gprs  = gprs;
+  saved.flags = flags;
+  saved.lazy  = lazy;
+
+  // what's in memory now is the snapshot
+  if (saved.written.empty()) saved.written.resize(addressSpace / pageSize / 64);
+  for (auto page : saved.pages) saved.written[page / 64] &= ~(1ull << (page % 64));
+  saved.pages.clear();
+  saved.copies.clear();
+}
+
+bool emu::softCPU::restore() noexcept {
+  if (!saved.taken) return false;
+
+  eip   = saved.eip;
+  gprs  = saved.gprs;
+  flags = saved.flags;
+  lazy  = saved.lazy;
+
+  for (size_t i = 0; i < saved.pages.size(); i++) {
+    auto page = saved.pages[i];
+    memcpy(&ram.base[page * pageSize], &saved.copies[i * pageSize], pageSize);
+    saved.written[page / 64] &= ~(1ull << (page % 64));
+  }
+
+  // capacity stays for the next run
+  saved.pages.clear();
+  saved.copies.clear();
+  return true;
+}
+
+void emu::softCPU::preserve(uint32_t address, size_t n) noexcept {
+  if (n == 0) return;
+
+  uint64_t end = (uint64_t)address + n - 1;
+  for (uint64_t page = address / pageSize; page <= end / pageSize && page < addressSpace / pageSize; page++) {
+    auto& word = saved.written[page / 64];
+    auto  bit  = 1ull << (page % 64);
+    // unmapped pages can't change, the write faults
+    if ((word & bit) || !mapped((uint32_t)(page * pageSize), pageSize)) continue;
+
+    word |= bit;
+    saved.pages.push_back((uint32_t)page);
+    auto from = &ram.base[page * pageSize];
+    saved.copies.insert(saved.copies.end(), from, from + pageSize);
+  }
+}
+
+uint32_t emu::softCPU::resolveFlags(uint32_t flags, flagOp op, uint8_t size, uint32_t dst, uint32_t src,
+                                    uint32_t result) noexcept {
+  if (op == flagOp::none) return flags;
+
+  auto resolve = [flags, op]<typename T>(T dst, uint32_t src, T result) -> uint32_t {
+    using enum emu::softCPU::flagOp;
+    constexpr uint32_t arithmetic = proc::flags::carryFlag | proc::flags::parityFlag | proc::flags::zeroFlag
+                                  | proc::flags::signFlag | proc::flags::overflowFlag;
+    constexpr T sign = (T)1 << ((sizeof(T) * 8) - 1);
+
+    // inc/dec keep the carry flag, as do 16-bit adds wrapping around
+    uint32_t out = flags & ~arithmetic;
+    switch (op) {
+    case add: {
+      T space = utl::maxN<sizeof(T) * 8>::u - dst;
+      if (src > 0 && (space == 0 || src > space)) {
+        if constexpr (sizeof(T) == 4) out |= proc::flags::carryFlag;
+        else
+          out |= flags & proc::flags::carryFlag;
+      }
+      if (emu::willOverflow<T, T>(dst, (T)src)) out |= proc::flags::overflowFlag;
+      break;
+    }
+    case sub:
+      // borrow
+      if (src > dst) out |= proc::flags::carryFlag;
+      // operands of different signs, and the sign of the result
+      // differs from the one of the destination
+      if ((dst ^ (T)src) & (dst ^ result) & sign) out |= proc::flags::overflowFlag;
+      break;
+    case inc:
+      out |= flags & proc::flags::carryFlag;
+      if (emu::willOverflow<T, T>(dst, 1)) out |= proc::flags::overflowFlag;
+      break;
+    case dec:
+      out |= flags & proc::flags::carryFlag;
+      if (emu::willOverflow<T, std::make_signed_t<T>>(dst, -1)) out |= proc::flags::overflowFlag;
+      break;
+    default:
+      break;
+    }
+
+    if (result & sign) out |= proc::flags::signFlag;
+    if (result == 0) out |= proc::flags::zeroFlag;
+    if (!(std::popcount((uint8_t)result) & 1)) out |= proc::flags::parityFlag;
+    return out;
+  };
+
+  if (size == 2) return resolve((uint16_t)dst, src, (uint16_t)result);
+  return resolve(dst, src, result);
+}
+
+template <typename I>
+bool emu::execute(const disasm::insn& decoded) noexcept {
+  using T             = std::conditional_t<I::bits == 16, uint16_t, uint32_t>;
+  using enum disasm::operandForm;
+  constexpr auto f    = I::form;
+  const auto     insn = decoded.as<I>();
+
+  constexpr bool writesRm = (I::type == disasm::MOV && (f == rmImmz || f == rmReg))
+                         || (disasm::hasModRM(f) && I::type != disasm::MOV && I::type != disasm::CMP
+                             && I::type != disasm::TEST);
+
+  // destination of two operand instructions: the ModR/M operand,
+  // or the register the decoder filled in for the accumulator forms
+  T* dst = nullptr;
+  if constexpr (disasm::hasModRM(f)) {
+    dst = rmOperand<T, writesRm>(decoded);
+    if (!dst) return false;
+  } else if constexpr (f == accImmz)
+    dst = (T*)&cpu.gprs[decoded.gpr()];
+
+  // register in the ModR/M reg field
+  auto reg = [&]() -> T& {
+    return *(T*)&cpu.gprs[decoded.gpr2()];
+  };
+
+  if constexpr (I::type == disasm::PUSH) {
+    if constexpr (f == opReg) {
+      if (!pushReg<T>(insn.gpr)) return false;
+    } else if (!pushImm(insn.imm))
+      return false;
+  } else if constexpr (I::type == disasm::POP) {
+    if (!popReg<T>(insn.gpr)) return false;
+  } else if constexpr (I::type == disasm::MOV) {
+    if constexpr (f == opRegImmz) movReg<T>(insn.gpr, insn.imm);
+    else if constexpr (f == rmImmz)
+      *dst = insn.imm;
+    else if constexpr (f == rmReg)
+      *dst = reg();
+    else
+      reg() = *dst;
+  } else if constexpr (I::type == disasm::ADD)
+    addOp<T>(*dst, insn.imm);
+  else if constexpr (I::type == disasm::ADC)
+    adcOp<T>(*dst, insn.imm);
+  else if constexpr (I::type == disasm::SUB)
+    subOp<T>(*dst, insn.imm);
+  else if constexpr (I::type == disasm::CMP)
+    cmpOp<T>(*dst, insn.imm);
+  else if constexpr (I::type == disasm::AND)
+    andOp<T>(*dst, insn.imm);
+  else if constexpr (I::type == disasm::OR)
+    orOp<T>(*dst, insn.imm);
+  else if constexpr (I::type == disasm::XOR)
+    xorOp<T>(*dst, insn.imm);
+  else if constexpr (I::type == disasm::INC)
+    incOp<T>(insn.gpr);
+  else if constexpr (I::type == disasm::DEC)
+    decOp<T>(insn.gpr);
+  else if constexpr (I::type == disasm::TEST)
+    testOp<T>(*dst, reg());
+  else if constexpr (I::type == disasm::CALL) {
+    if (!callAbs<T>(insn.addr, decoded.length)) return false; // already handled disp on addr for us
+  } else if constexpr (I::type == disasm::JMP)
+    jmpAbs<T>(insn.addr); // ditto
+  else if constexpr (I::type == disasm::RET) {
+    if (!retNear<T>()) return false;
+  } else
+    static_assert(!sizeof(I), "no emulation for this instruction type");
+
+  // guest code may be writing over cached code
+  if constexpr (writesRm) {
+    if (decoded.isMemory()) noteWrite(dst, sizeof(T));
+  }
+
+  return true;
+}
+
+bool emu::dispatch(const disasm::insn& insn) noexcept {
+  // indexed by kind
+  static constexpr bool (emu::*handlers[])(const disasm::insn&) noexcept = {
+      nullptr,
+#define IMP_EMU_HANDLERS(name16, name32, type, opcode, group, form)                                                    \
+  &emu::execute<disasm::name16>, &emu::execute<disasm::name32>,
+      IMP_ISA(IMP_EMU_HANDLERS)
+#undef IMP_EMU_HANDLERS
+  };
+
+  static_assert(std::size(handlers) == (size_t)disasm::kind::count);
+
+  // faults leave eip where it was
+  if (!(this->*handlers[(size_t)insn.id])(insn)) {
+    increaseEip = true;
+    return false;
+  }
 
   // eip increase may be disabled (e.g.) just call/jmp-ed
   // and this has changed eip. make increase eip true (default)
   // again afterward, as it should be unless is explicitly told not to
-  if (increaseEip) cpu.eip += ds.length();
+  if (increaseEip) cpu.eip += insn.length;
   increaseEip = true;
+  return true;
+}
+
+disasm::insn emu::step() {
+  disasm::disassembler ds(cpu.memoryAt(cpu.eip), cpu.eip);
+  auto                 insn = ds.next();
+
+  if (!insn.valid()) return insn;
+  if (!step(insn)) return disasm::insn {};
   return insn;
 }
+
+bool emu::step(const disasm::insn& insn) {
+#ifdef IMP_GUEST_SIGNALS
+  faultScope scope(cpu.ram.base);
+  if (sigsetjmp(scope.target, 0)) {
+    increaseEip = true;
+    return false;
+  }
+#endif
+
+  return dispatch(insn);
+}
+
+emu::translatedBlock* emu::translate(uint32_t eip) {
+  translatedBlock      block;
+  disasm::disassembler ds(cpu.memoryAt(eip), eip);
+  uint32_t             end = eip;
+  while (block.insns.size() < maxBlockInsns) {
+    auto insn = ds.next();
+    if (!insn.valid()) break;
+
+    block.insns.push_back(insn);
+    end += insn.length;
+
+    auto type = disasm::info(insn.id).type;
+    if (type == disasm::CALL || type == disasm::JMP || type == disasm::RET) break;
+  }
+
+  if (block.insns.empty()) return nullptr;
+  block.end = end;
+
+  block.ops.resize(block.insns.size());
+  for (size_t i = 0; i < block.insns.size(); i++) block.ops[i] = (uint16_t)block.insns[i].id;
+  for (size_t i = 0; fusing && i + 1 < block.insns.size(); i++) {
+    if (auto op = fuse(block.insns[i], block.insns[i + 1])) block.ops[i] = op, i++;
+  }
+
+  if (cache.codePages.empty()) cache.codePages.resize(softCPU::addressSpace / cachePageSize);
+  for (auto page = eip / cachePageSize; page <= (end - 1) / cachePageSize; page++) cache.codePages[page] = 1;
+
+  return &cache.blocks.insert_or_assign(eip, std::move(block)).first->second;
+}
+
+size_t emu::runBlock() {
+#ifdef IMP_GUEST_SIGNALS
+  // a fault leaves eip at the instruction that faulted, what ran is
+  // what's before it in the block, if the block is still there
+  const uint32_t start = cpu.eip;
+  faultScope     scope(cpu.ram.base);
+  if (sigsetjmp(scope.target, 0)) {
+    increaseEip = true;
+
+    auto it = cache.blocks.find(start);
+    if (it == cache.blocks.end()) return 0;
+    uint32_t at = start;
+    for (size_t n = 0; n < it->second.insns.size(); n++) {
+      if (at == cpu.eip) return n;
+      at += it->second.insns[n].length;
+    }
+    return 0;
+  }
+#endif
+
+  translatedBlock* block = nullptr;
+  if (auto it = cache.blocks.find(cpu.eip); it != cache.blocks.end()) {
+    cache.hits++;
+    block = &it->second;
+  } else {
+    cache.misses++;
+    block = translate(cpu.eip);
+    if (!block) return 0;
+  }
+
+  if (!block->native && jitEnabled && ++block->runs == jitThreshold) compile(*block, cpu.eip);
+  if (!block->native) return interpret(*block, 0);
+
+  // compiled code runs as much as it can, the rest is interpreted
+  auto generation = cache.generation;
+  auto jitted     = block->jitted;
+  auto n          = block->native(this);
+  if (n < jitted || cache.generation != generation) return n;
+  return interpret(*block, n);
+}
+
+size_t emu::interpret(const translatedBlock& block, size_t from) {
+  // a write to cached code drops the block being run too,
+  // nothing of it may be touched after that
+  auto                generation = cache.generation;
+  const disasm::insn* insns      = block.insns.data();
+  const uint16_t*     ops        = block.ops.data();
+  size_t              count      = block.insns.size();
+  size_t              n          = from;
+
+#if defined(__GNUC__) && !defined(IMP_NO_THREADED)
+  // threaded: every handler ends in its own jump to the next one's,
+  // so each gets a branch history of its own, and where a kind is in
+  // IMP_ISA doesn't matter. IMP_NO_THREADED runs the dispatch() loop
+  static void* const labels[] = {
+      &&done,
+#define IMP_EMU_LABELS(name16, name32, type, opcode, group, form) &&run_##name16, &&run_##name32,
+      IMP_ISA(IMP_EMU_LABELS)
+#undef IMP_EMU_LABELS
+      &&run_pushMov,
+      &&run_pushPop,
+      &&run_addAdc,
+  };
+
+  static_assert(std::size(labels) == fusedOpsEnd);
+
+  disasm::insn insn;
+
+#define IMP_EMU_NEXT()                                                                                                 \
+  if (n == count) goto done;                                                                                           \
+  insn = insns[n];                                                                                                     \
+  goto* labels[ops[n]];
+
+#define IMP_EMU_RUN(name)                                                                                              \
+  run_##name : if (!execute<disasm::name>(insn)) {                                                                     \
+    increaseEip = true;                                                                                                \
+    goto done;                                                                                                         \
+  }                                                                                                                    \
+  if (increaseEip) cpu.eip += insn.length;                                                                             \
+  increaseEip = true;                                                                                                  \
+  n++;                                                                                                                 \
+  if (cache.generation != generation) goto done;                                                                       \
+  IMP_EMU_NEXT()
+
+#define IMP_EMU_RUNS(name16, name32, type, opcode, group, form) IMP_EMU_RUN(name16) IMP_EMU_RUN(name32)
+
+#define IMP_EMU_FUSED(name)                                                                                            \
+  run_##name : {                                                                                                       \
+    auto ran = runFused<name>(insns + n);                                                                              \
+    n += ran;                                                                                                          \
+    if (ran < 2 || cache.generation != generation) goto done;                                                          \
+  }                                                                                                                    \
+  IMP_EMU_NEXT()
+
+  IMP_EMU_NEXT()
+  IMP_ISA(IMP_EMU_RUNS)
+  IMP_EMU_FUSED(pushMov)
+  IMP_EMU_FUSED(pushPop)
+  IMP_EMU_FUSED(addAdc)
+
+#undef IMP_EMU_FUSED
+#undef IMP_EMU_RUNS
+#undef IMP_EMU_RUN
+#undef IMP_EMU_NEXT
+
+done:
+#else
+  while (n < count) {
+    if (ops[n] >= pushMov) {
+      size_t ran = 0;
+      switch (ops[n]) {
+      case pushMov:
+        ran = runFused<pushMov>(insns + n);
+        break;
+      case pushPop:
+        ran = runFused<pushPop>(insns + n);
+        break;
+      default:
+        ran = runFused<addAdc>(insns + n);
+        break;
+      }
+
+      n += ran;
+      if (ran < 2 || cache.generation != generation) break;
+      continue;
+    }
+
+    auto insn = insns[n];
+    if (!dispatch(insn)) break;
+    n++;
+    if (cache.generation != generation) break;
+  }
+#endif
+
+  return n;
+}
+
+uint16_t emu::fuse(const disasm::insn& first, const disasm::insn& second) noexcept {
+  using enum disasm::kind;
+  if (first.id == pushReg32 && (second.id == movRm32Reg32 || second.id == movReg32Rm32) && !second.isMemory())
+    return pushMov;
+  if (first.id == pushImm32 && second.id == popReg32) return pushPop;
+  if ((first.id == addReg32Imm8 || first.id == addReg32Imm32 || first.id == addEaxImm32) && !first.isMemory()
+      && second.id == adcReg32Imm8 && !second.isMemory())
+    return addAdc;
+  return 0;
+}
+
+template <uint16_t F>
+size_t emu::runFused(const disasm::insn* pair) noexcept {
+  // the block may go away under the first one
+  auto first      = pair[0];
+  auto second     = pair[1];
+  auto generation = cache.generation;
+
+  if constexpr (F == pushMov) {
+    if (!pushReg<uint32_t>(first.gpr())) return 0;
+    cpu.eip += first.length;
+    if (cache.generation != generation) return 1;
+
+    if (second.id == disasm::kind::movRm32Reg32) cpu.gprs[second.gpr()] = cpu.gprs[second.gpr2()];
+    else
+      cpu.gprs[second.gpr2()] = cpu.gprs[second.gpr()];
+  } else if constexpr (F == pushPop) {
+    if (!pushImm<uint32_t>(first.imm)) return 0;
+    cpu.eip += first.length;
+    if (cache.generation != generation || !popReg<uint32_t>(second.gpr())) return 1;
+  } else if constexpr (F == addAdc) {
+    // the adc overwrites every flag of the add but its carry,
+    // that is a wrap around, so only the adc records its flags
+    auto&    dst    = cpu.gprs[first.gpr()];
+    uint32_t before = dst;
+    dst += first.id == disasm::kind::addReg32Imm8 ? (uint8_t)first.imm : first.imm;
+
+    adcOp<uint32_t>(cpu.gprs[second.gpr()], (uint8_t)second.imm, dst < before);
+    cpu.eip += first.length;
+  } else
+    static_assert(!F, "no such fused op");
+
+  cpu.eip += second.length;
+  return 2;
+}
+
+void emu::setFusion(bool on) {
+  fusing = on;
+
+  cache.blocks.clear();
+  std::fill(cache.codePages.begin(), cache.codePages.end(), 0);
+  cache.generation++;
+}
+
+size_t emu::run(size_t limit) {
+  size_t ran = 0;
+  while (ran < limit) {
+    auto n = runBlock();
+    if (n == 0) break;
+    ran += n;
+  }
+  return ran;
+}
+
+void emu::flushPage(size_t page) noexcept {
+  uint32_t from = (uint32_t)(page * cachePageSize);
+  uint32_t to   = from + cachePageSize;
+  std::erase_if(cache.blocks, [&](const auto& b) {
+    return b.first < to && b.second.end > from;
+  });
+
+  cache.codePages[page] = 0;
+  cache.generation++;
+  cache.flushes++;
+}
+
+bool emu::restore() {
+  static_assert(softCPU::pageSize == cachePageSize);
+
+  for (auto page : cpu.dirtyPages()) {
+    if (page < cache.codePages.size() && cache.codePages[page]) flushPage(page);
+  }
+
+  increaseEip = true;
+  return cpu.restore();
+}
+
+void emu::invalidate(uint32_t address, size_t n) {
+  if (n == 0 || cache.codePages.empty()) return;
+
+  for (auto page = address / cachePageSize; page <= (address + n - 1) / cachePageSize; page++) {
+    if (page < cache.codePages.size() && cache.codePages[page]) flushPage(page);
+  }
+}
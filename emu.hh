@@ -2,11 +2,24 @@
 
 #include "proc.hh"
 #include "disasm.hh"
+#include "jit.hh"
 #include <cstdint>
 #include <memory>
+#include <span>
 #include <array>
+#include <functional>
+#include <unordered_map>
+#include <vector>
 #include <assert.h>
 
+///
+/// Guest memory faults come in as SIGSEGV/SIGBUS where there are
+/// signals, elsewhere toRam checks accesses against what's mapped
+///
+#if defined(__unix__) || defined(__APPLE__)
+#define IMP_GUEST_SIGNALS
+#endif
+
 struct emu {
   emu() = delete;
   emu(disasm::memoryViewType code, uint32_t ep) : cpu(code, ep), increaseEip(true) {
@@ -17,34 +30,92 @@ struct emu {
   emu& operator=(emu&&)      = delete;
   emu(emu&&)                 = delete;
 
-  disasm::ret exec();
+  /// Executes the instruction at eip, kept for callers that
+  /// want the decoded struct
+  disasm::ret exec() {
+    return step().toRet();
+  }
+
+  /// Executes the instruction at eip
+  disasm::insn step();
+
+  /// Executes insn, decoded at eip already, false on a fault
+  bool step(const disasm::insn& insn);
 
   bool execBool() {
-    auto insn = exec();
-    return !std::holds_alternative<disasm::none>(insn);
+    return step().valid();
   }
 
+  ///
+  /// Runs the basic block at eip, from the block cache, translating it
+  /// first if it isn't there. Stops early at a fault, or when the block
+  /// overwrites cached code. Returns how many instructions ran, 0 if
+  /// nothing decodes at eip or the first one faults
+  ///
+  size_t runBlock();
+
+  /// Runs blocks until nothing decodes at eip or limit instructions ran
+  size_t run(size_t limit);
+
+  /// Drops cached blocks decoded from pages in [address, address + n)
+  void invalidate(uint32_t address, size_t n);
+
+  ///
+  /// cpu.restore, also dropping cached blocks from the pages it puts
+  /// back. False if there's no snapshot
+  ///
+  bool restore();
+
   struct softCPU {
+    /// Guest addresses, and what of them is mapped by default
+    static constexpr uint64_t addressSpace = 0x100000000;
+    static constexpr size_t   ramSize      = 0x1000000;
+    static constexpr size_t   stackSize    = 0x1000000;
+    /// Unmapped past the end, so accesses at the very top fault
+    static constexpr size_t guardSize = 0x10000;
+    /// Granularity of snapshot dirty tracking
+    static constexpr size_t pageSize = 0x1000;
+
     softCPU();
     softCPU(disasm::memoryViewType code, uint32_t ep);
+    ~softCPU();
 
     softCPU& operator=(const softCPU&) = delete;
     softCPU(const softCPU&)            = delete;
 
     softCPU& operator=(softCPU&& other) noexcept {
-      eip      = other.eip;
-      gprs     = other.gprs;
-      flags    = other.flags;
-      ram.ptr  = std::move(other.ram.ptr);
-      ram.size = other.ram.size;
+      std::swap(eip, other.eip);
+      std::swap(gprs, other.gprs);
+      std::swap(flags, other.flags);
+      std::swap(lazy, other.lazy);
+      std::swap(ram, other.ram);
+      std::swap(saved, other.saved);
+      return *this;
     }
 
     softCPU(softCPU&& other) noexcept {
       (*this) = std::move(other);
     }
 
+    /// The bottom of guest memory, where code is loaded
     inline disasm::memoryViewType memory() const noexcept {
-      return disasm::memoryViewType {(const uint8_t*)ram.ptr.get(), ram.size};
+      return disasm::memoryViewType {ram.base, ram.size};
+    }
+
+    ///
+    /// Guest memory indexed by guest address, up to the end of the
+    /// mapped range address is in, for decoding without faulting.
+    /// Empty if address isn't mapped
+    ///
+    inline disasm::memoryViewType memoryAt(uint32_t address) const noexcept {
+      if (address < ram.size) return memory();
+      if (address >= addressSpace - ram.stackSize) return disasm::memoryViewType {ram.base, addressSpace};
+      return {};
+    }
+
+    inline bool mapped(uint32_t address, size_t n) const noexcept {
+      uint64_t end = (uint64_t)address + n;
+      return end <= ram.size || (address >= addressSpace - ram.stackSize && end <= addressSpace);
     }
 
     inline uint32_t usedStack() const noexcept {
@@ -52,7 +123,44 @@ struct emu {
     }
 
     inline void* stackToRam() noexcept {
-      return &(ram.ptr.get()[ram.size - usedStack()]);
+      return &ram.base[gprs[proc::gpr::esp]];
+    }
+
+    ///
+    /// Host pointer to n bytes of guest memory at address, guest
+    /// address a is host ram.base + a. With IMP_GUEST_SIGNALS an
+    /// access that isn't mapped faults the guest when it happens,
+    /// otherwise this is nullptr for it
+    ///
+    inline void* toRam(uint32_t address, size_t n) noexcept {
+#ifndef IMP_GUEST_SIGNALS
+      if (!mapped(address, n)) return nullptr;
+#else
+      (void)n;
+#endif
+      return &ram.base[address];
+    }
+
+    /// toRam, for what's about to be written
+    inline void* toRamForWrite(uint32_t address, size_t n) noexcept {
+      if (saved.taken) preserve(address, n);
+      return toRam(address, n);
+    }
+
+    ///
+    /// Takes registers, eip and flags as they are. Memory is copied
+    /// on write from here on, a page at a time, so restore only puts
+    /// back the pages written since. Taking another snapshot drops
+    /// the last one
+    ///
+    void snapshot();
+
+    /// Back to the last snapshot, which stays. False if there's none
+    bool restore() noexcept;
+
+    /// Pages written since the last snapshot, or restore
+    inline std::span<const uint32_t> dirtyPages() const noexcept {
+      return saved.pages;
     }
 
     inline void dump() const noexcept {
@@ -69,8 +177,8 @@ struct emu {
       ::utl::delim();
 
       print("eip", eip);
-      print("flags", flags);
-      print("ram.ptr", (size_t)ram.ptr.get());
+      print("flags", resolvedFlags());
+      print("ram.base", (size_t)ram.base);
       print("ram.size", ram.size);
 
       ::utl::delim();
@@ -88,13 +196,75 @@ struct emu {
     /// having been there before the extension.
     /// The second least significant bit is always
     /// 1, and is reserved.
+    ///
+    /// Flags as they were before the operation in lazy, read them
+    /// through eflags()
     uint32_t flags = 0b10;
 
-    /// Virtual RAM
+    ///
+    /// Flag producing operations only record themselves, and the
+    /// flags are worked out once something reads them. Most are
+    /// overwritten by the next operation before that happens
+    ///
+    enum class flagOp : uint8_t { none, add, sub, logic, inc, dec };
+
+    struct {
+      flagOp   op     = flagOp::none;
+      uint8_t  size   = 4;
+      uint32_t dst    = 0; // before the operation
+      uint32_t src    = 0;
+      uint32_t result = 0;
+    } lazy;
+
+    /// Flags with the recorded operation applied
+    uint32_t resolvedFlags() const noexcept {
+      return resolveFlags(flags, lazy.op, lazy.size, lazy.dst, lazy.src, lazy.result);
+    }
+
+    /// resolvedFlags, for flags and a record kept elsewhere
+    static uint32_t resolveFlags(uint32_t flags, flagOp op, uint8_t size, uint32_t dst, uint32_t src,
+                                 uint32_t result) noexcept;
+
+    /// Up to date flags
+    uint32_t eflags() noexcept {
+      if (lazy.op != flagOp::none) {
+        flags   = resolvedFlags();
+        lazy.op = flagOp::none;
+      }
+      return flags;
+    }
+
+    ///
+    /// Guest memory: 4 GiB and a guard reserved, of which the bottom
+    /// size and the top stackSize bytes are mapped. The OS commits
+    /// pages as they're first touched
+    ///
     struct {
-      std::unique_ptr<uint8_t[]> ptr;
-      size_t                     size;
+      uint8_t* base      = nullptr;
+      size_t   size      = ramSize;
+      size_t   stackSize = softCPU::stackSize;
     } ram;
+
+private:
+    /// Keeps a copy of the pages in [address, address + n) that
+    /// weren't written since the snapshot
+    void preserve(uint32_t address, size_t n) noexcept;
+
+    struct {
+      bool taken = false;
+
+      uint32_t                                 eip;
+      std::array<uint32_t, proc::gpr::GPR_MAX> gprs;
+      uint32_t                                 flags;
+      decltype(softCPU::lazy)                  lazy;
+
+      /// Bit per page, set once it's been copied
+      std::vector<uint64_t> written;
+      /// Pages in the order they were written, and their contents
+      /// at the snapshot, pageSize bytes each
+      std::vector<uint32_t> pages;
+      std::vector<uint8_t>  copies;
+    } saved;
   } cpu;
 
   ///
@@ -102,13 +272,85 @@ struct emu {
   ///
   bool increaseEip = true;
 
+  ///
+  /// Predecoded basic blocks, by the guest eip they start at. A block
+  /// ends after a call/jmp/ret, before something that doesn't decode,
+  /// or at maxBlockInsns
+  ///
+  static constexpr size_t maxBlockInsns = 64;
+  static constexpr size_t cachePageSize = 0x1000;
+
+  /// Compiled block, returns how many of its instructions ran
+  using nativeBlock = uint32_t (*)(emu*);
+
+  struct translatedBlock {
+    uint32_t                  end;
+    std::vector<disasm::insn> insns;
+
+    /// Per instruction, the handler running it: its kind, or for the
+    /// first of a fused pair a fusedOp
+    std::vector<uint16_t> ops;
+
+    /// Runs so far, compiled at jitThreshold
+    uint32_t runs = 0;
+    /// Compiled leading instructions, the interpreter goes on from there
+    uint32_t    jitted = 0;
+    nativeBlock native = nullptr;
+  };
+
+  struct {
+    std::unordered_map<uint32_t, translatedBlock> blocks;
+    /// Per page of ram, whether a cached block was decoded from it,
+    /// writes to those pages drop the page's blocks
+    std::vector<uint8_t> codePages;
+    /// Bumped on every drop, so a running block knows to stop
+    uint64_t generation = 0;
+
+    uint64_t hits     = 0;
+    uint64_t misses   = 0;
+    uint64_t flushes  = 0;
+    uint64_t compiled = 0;
+  } cache;
+
+  ///
+  /// Where set, called with the guest address and size of every write
+  /// guest code makes, for code decoded from this emu's memory
+  /// somewhere else than its cache
+  ///
+  std::function<void(uint32_t address, size_t n)> onWrite;
+
+  ///
+  /// Blocks run this many times are compiled to host code, where
+  /// IMP_JIT is defined
+  ///
+  static constexpr uint32_t jitThreshold = 8;
+  bool                      jitEnabled   = true;
+
+  ///
+  /// Instruction pairs run as one, with one dispatch and one flags
+  /// record, numbered past the kinds:
+  ///
+  ///   push reg; mov reg, reg      e.g. push ebp; mov ebp, esp
+  ///   push imm32; pop reg
+  ///   add reg, imm; adc reg, imm  carry handed over without the
+  ///                               flags of the add being worked out
+  ///
+  enum fusedOp : uint16_t { pushMov = (uint16_t)disasm::kind::count, pushPop, addAdc, fusedOpsEnd };
+
+  bool fusion() const noexcept {
+    return fusing;
+  }
+
+  /// Fusion on or off, drops every cached block
+  void setFusion(bool on);
+
   ///
   /// Operation helpers
   ///
   private:
   template <typename T, typename T2>
     requires(std::is_unsigned_v<T> && sizeof(T2) <= sizeof(T))
-  bool willOverflow(T dst, T2 n) noexcept {
+  static bool willOverflow(T dst, T2 n) noexcept {
     if (std::is_signed_v<T2> && n < 0 && dst < std::labs(n)) return true;
     if (dst <= utl::maxN<sizeof(T) * 8>::s) {
       if ((dst + n) > utl::maxN<sizeof(T) * 8>::s) return true;
@@ -117,78 +359,62 @@ struct emu {
     return false;
   }
 
-  template <typename T, typename T2>
-    requires(std::is_unsigned_v<T> && sizeof(T2) <= sizeof(T))
-  void updateOverflowFlag(T dst, T2 n) noexcept {
-    if (willOverflow<T, T2>(dst, n)) cpu.flags |= proc::flags::overflowFlag;
-    else
-      cpu.flags &= ~proc::flags::overflowFlag;
-  }
-
-  template <typename T>
-    requires(std::is_unsigned_v<T>)
-  void updateSignFlag(T n) noexcept {
-    if (n & (1 << ((sizeof(T) * 8) - 1))) cpu.flags |= proc::flags::signFlag;
-    else
-      cpu.flags &= ~proc::flags::signFlag;
-  }
-
-  template <typename T>
-    requires(std::is_unsigned_v<T>)
-  void updateZeroFlag(T n) noexcept {
-    if (n == 0) cpu.flags |= proc::flags::zeroFlag;
-    else
-      cpu.flags &= ~proc::flags::zeroFlag;
-  }
-
+  ///
+  /// Records a flag producing operation of T sized operands, see
+  /// softCPU::lazy. Operations keeping the carry flag as it was need
+  /// the previous one worked out first
+  ///
   template <typename T>
     requires(std::is_unsigned_v<T>)
-  void updateParityFlag(T n) noexcept {
-    uint8_t paritysub = n & 0b11111111;
-    int     setbits   = 0;
-    for (size_t i = 0; i < 8; i++) {
-      if (paritysub & 1) setbits++;
-      paritysub >>= 1;
-    }
-
-    if (setbits & 1) cpu.flags &= ~proc::flags::parityFlag;
-    else
-      cpu.flags |= proc::flags::parityFlag;
+  void recordFlags(softCPU::flagOp op, uint32_t dst, uint32_t src, T result, bool keepsCarry = false) noexcept {
+    if (keepsCarry) cpu.eflags();
+
+    cpu.lazy.op     = op;
+    cpu.lazy.size   = sizeof(T);
+    cpu.lazy.dst    = dst;
+    cpu.lazy.src    = src;
+    cpu.lazy.result = result;
   }
 
   ///
   /// Operations
   ///
   private:
+  ///
+  /// Stack operations return false on a fault, before esp changes
+  ///
   template <typename T>
     requires(std::is_unsigned_v<T> && (sizeof(T) == 1 || sizeof(T) == 2 || sizeof(T) == 4))
-  void pushImm(T n) noexcept {
-    // make space
-    cpu.gprs[proc::gpr::esp] -= sizeof(T);
-    // write
-    *(T*)cpu.stackToRam() = n;
+  bool pushImm(T n) noexcept {
+    uint32_t esp  = cpu.gprs[proc::gpr::esp] - sizeof(T);
+    auto     slot = (T*)cpu.toRamForWrite(esp, sizeof(T));
+    if (!slot) return false;
+
+    // write, then make space
+    *slot                    = n;
+    cpu.gprs[proc::gpr::esp] = esp;
+    noteWrite(slot, sizeof(T));
+    return true;
   }
 
   template <typename T>
     requires(std::is_unsigned_v<T> && (sizeof(T) == 2 || sizeof(T) == 4))
-  void pushReg(proc::gpr r) noexcept {
-    // make space
-    cpu.gprs[proc::gpr::esp] -= sizeof(T);
-    // write
-    (*(T*)cpu.stackToRam()) = cpu.gprs[r] & utl::maxN<sizeof(T) * 8>::u;
+  bool pushReg(proc::gpr r) noexcept {
+    return pushImm<T>(cpu.gprs[r] & utl::maxN<sizeof(T) * 8>::u);
   }
 
   template <typename T>
     requires(std::is_unsigned_v<T> && (sizeof(T) == 2 || sizeof(T) == 4))
-  void popReg(proc::gpr r) noexcept {
-    // check if there's something to pop
-    assert(cpu.usedStack() >= sizeof(T));
+  bool popReg(proc::gpr r) noexcept {
+    auto slot = (T*)cpu.toRam(cpu.gprs[proc::gpr::esp], sizeof(T));
+    if (!slot) return false;
 
     // write
-    (*(T*)&cpu.gprs[r]) = *(T*)cpu.stackToRam();
+    (*(T*)&cpu.gprs[r]) = *slot;
 
     // reallocate space
     cpu.gprs[proc::gpr::esp] += sizeof(T);
+    return true;
   }
 
   template <typename T>
@@ -202,36 +428,21 @@ struct emu {
     requires(std::is_unsigned_v<T> && std::is_unsigned_v<T2> && (sizeof(T) == 2 || sizeof(T) == 4)
              && sizeof(T2) <= sizeof(T))
   void addOp(T& dst, T2 n) noexcept {
-    updateOverflowFlag<T, T2>(dst, n);
-
-    // Carry flag and addition
-    T space = utl::maxN<sizeof(T) * 8>::u - dst;
-
-    // holy fuck, refactor this!!!!!!!!!!! written at 3:33am
-
-    // NOTE: the comment above is from earlyh november, it's late
-    // november now, and it's 5:50AM, so it survived a port, so
-    // I guess it's staying for now
+    T before = dst;
+    T space  = utl::maxN<sizeof(T) * 8>::u - dst;
 
     // carry flag is only applied when you wrap around
-    // at register size
+    // at register size, 16-bit wraps keep it as it was
+    bool wraps = n > 0 && (space == 0 || n > space);
     if (n > 0) {
-      if (space == 0) {
-        if constexpr (sizeof(T) == 4) cpu.flags |= proc::flags::carryFlag;
-        dst = n - 1;
-      } else if (n > space) {
-        if constexpr (sizeof(T) == 4) cpu.flags |= proc::flags::carryFlag;
+      if (space == 0) dst = n - 1;
+      else if (n > space)
         dst = (n - space) - 1;
-      } else {
-        cpu.flags &= ~proc::flags::carryFlag;
+      else
         dst += n;
-      }
-    } else
-      cpu.flags &= ~proc::flags::carryFlag;
+    }
 
-    updateSignFlag(dst);
-    updateZeroFlag(dst);
-    updateParityFlag(dst);
+    recordFlags<T>(softCPU::flagOp::add, before, n, dst, sizeof(T) != 4 && wraps);
   }
 
   template <typename T, typename T2>
@@ -244,9 +455,16 @@ struct emu {
   template <typename T, typename T2>
     requires(std::is_unsigned_v<T> && std::is_unsigned_v<T2> && (sizeof(T) == 2 || sizeof(T) == 4)
              && sizeof(T2) <= sizeof(T))
-  void adcOp(T& dst, T2 n) noexcept {
+  void adcOp(T& dst, T2 n, bool carry) noexcept {
     // TODO: handle overflowing with n here
-    addOp<T, T2>(dst, n + (T2)(cpu.flags & proc::flags::carryFlag ? 1 : 0));
+    addOp<T, T2>(dst, n + (T2)(carry ? 1 : 0));
+  }
+
+  template <typename T, typename T2>
+    requires(std::is_unsigned_v<T> && std::is_unsigned_v<T2> && (sizeof(T) == 2 || sizeof(T) == 4)
+             && sizeof(T2) <= sizeof(T))
+  void adcOp(T& dst, T2 n) noexcept {
+    adcOp<T, T2>(dst, n, cpu.eflags() & proc::flags::carryFlag);
   }
 
   template <typename T, typename T2>
@@ -261,12 +479,7 @@ struct emu {
              && sizeof(T2) <= sizeof(T))
   void andOp(T& dst, T2 n) noexcept {
     dst &= n;
-
-    cpu.flags &= ~proc::flags::carryFlag;
-    cpu.flags &= ~proc::flags::overflowFlag;
-    updateSignFlag(dst);
-    updateZeroFlag(dst);
-    updateParityFlag(dst);
+    recordFlags<T>(softCPU::flagOp::logic, 0, 0, dst);
   }
 
   template <typename T, typename T2>
@@ -276,18 +489,78 @@ struct emu {
     andOp(*(T*)&cpu.gprs[r], n);
   }
 
+  template <typename T, typename T2>
+    requires(std::is_unsigned_v<T> && std::is_unsigned_v<T2> && (sizeof(T) == 2 || sizeof(T) == 4)
+             && sizeof(T2) <= sizeof(T))
+  void orOp(T& dst, T2 n) noexcept {
+    dst |= n;
+    recordFlags<T>(softCPU::flagOp::logic, 0, 0, dst);
+  }
+
+  template <typename T, typename T2>
+    requires(std::is_unsigned_v<T> && std::is_unsigned_v<T2> && (sizeof(T) == 2 || sizeof(T) == 4)
+             && sizeof(T2) <= sizeof(T))
+  void orOp(proc::gpr r, T2 n) noexcept {
+    orOp(*(T*)&cpu.gprs[r], n);
+  }
+
+  template <typename T, typename T2>
+    requires(std::is_unsigned_v<T> && std::is_unsigned_v<T2> && (sizeof(T) == 2 || sizeof(T) == 4)
+             && sizeof(T2) <= sizeof(T))
+  void xorOp(T& dst, T2 n) noexcept {
+    dst ^= n;
+    recordFlags<T>(softCPU::flagOp::logic, 0, 0, dst);
+  }
+
+  template <typename T, typename T2>
+    requires(std::is_unsigned_v<T> && std::is_unsigned_v<T2> && (sizeof(T) == 2 || sizeof(T) == 4)
+             && sizeof(T2) <= sizeof(T))
+  void xorOp(proc::gpr r, T2 n) noexcept {
+    xorOp(*(T*)&cpu.gprs[r], n);
+  }
+
+  template <typename T, typename T2>
+    requires(std::is_unsigned_v<T> && std::is_unsigned_v<T2> && (sizeof(T) == 2 || sizeof(T) == 4)
+             && sizeof(T2) <= sizeof(T))
+  void subOp(T& dst, T2 n) noexcept {
+    T result = dst - n;
+    recordFlags<T>(softCPU::flagOp::sub, dst, n, result);
+    dst = result;
+  }
+
+  template <typename T, typename T2>
+    requires(std::is_unsigned_v<T> && std::is_unsigned_v<T2> && (sizeof(T) == 2 || sizeof(T) == 4)
+             && sizeof(T2) <= sizeof(T))
+  void subOp(proc::gpr r, T2 n) noexcept {
+    subOp<T, T2>(*(T*)&cpu.gprs[r], n);
+  }
+
+  ///
+  /// Note: basically SUB with auxiliary state
+  ///
+  template <typename T, typename T2>
+    requires(std::is_unsigned_v<T> && std::is_unsigned_v<T2> && (sizeof(T) == 2 || sizeof(T) == 4)
+             && sizeof(T2) <= sizeof(T))
+  void cmpOp(T dst, T2 n) noexcept {
+    subOp<T, T2>(dst, n);
+  }
+
+  template <typename T, typename T2>
+    requires(std::is_unsigned_v<T> && std::is_unsigned_v<T2> && (sizeof(T) == 2 || sizeof(T) == 4)
+             && sizeof(T2) <= sizeof(T))
+  void cmpOp(proc::gpr r, T2 n) noexcept {
+    cmpOp<T, T2>(*(T*)&cpu.gprs[r], n);
+  }
+
   template <typename T>
     requires(std::is_unsigned_v<T> && (sizeof(T) == 2 || sizeof(T) == 4))
   void incOp(T& dst) noexcept {
-    updateOverflowFlag<T, T>(dst, 1);
-
+    T before = dst;
     if ((dst - utl::maxN<sizeof(T) * 8>::u) > 0) dst += 1;
     else
       dst = 0;
 
-    updateSignFlag(dst);
-    updateZeroFlag(dst);
-    updateParityFlag(dst);
+    recordFlags<T>(softCPU::flagOp::inc, before, 1, dst, true);
   }
 
   template <typename T>
@@ -299,15 +572,12 @@ struct emu {
   template <typename T>
     requires(std::is_unsigned_v<T> && (sizeof(T) == 2 || sizeof(T) == 4))
   void decOp(T& dst) noexcept {
-    updateOverflowFlag<T, std::make_signed_t<T>>(dst, -1);
-
+    T before = dst;
     if (dst == 0) dst = utl::maxN<sizeof(T) * 8>::u;
     else
       dst -= 1;
 
-    updateSignFlag(dst);
-    updateZeroFlag(dst);
-    updateParityFlag(dst);
+    recordFlags<T>(softCPU::flagOp::dec, before, 1, dst, true);
   }
 
   template <typename T>
@@ -321,14 +591,14 @@ struct emu {
   ///
   template <typename T>
     requires(std::is_unsigned_v<T> && (sizeof(T) == 2 || sizeof(T) == 4))
-  void testOp(proc::gpr r, proc::gpr r2) noexcept {
-    T n = (T)((*(T*)&cpu.gprs[r]) & (*(T*)&cpu.gprs[r2]));
+  void testOp(T dst, T src) noexcept {
+    recordFlags<T>(softCPU::flagOp::logic, 0, 0, (T)(dst & src));
+  }
 
-    cpu.flags &= ~proc::flags::carryFlag;
-    cpu.flags &= ~proc::flags::overflowFlag;
-    updateSignFlag(n);
-    updateZeroFlag(n);
-    updateParityFlag(n);
+  template <typename T>
+    requires(std::is_unsigned_v<T> && (sizeof(T) == 2 || sizeof(T) == 4))
+  void testOp(proc::gpr r, proc::gpr r2) noexcept {
+    testOp<T>(*(T*)&cpu.gprs[r], *(T*)&cpu.gprs[r2]);
   }
 
   template <typename T>
@@ -341,23 +611,134 @@ struct emu {
 
   template <typename T>
     requires(std::is_unsigned_v<T> && (sizeof(T) == 2 || sizeof(T) == 4))
-  void callAbs(T n, size_t lastLength) noexcept {
+  bool callAbs(T n, size_t lastLength) noexcept {
     uint32_t ret = cpu.eip + lastLength;
-    // set up return address
-    // will be at ebp+4
-    pushImm(ret); // push the would-be eip
-                  // (once the instruction is fetched, it starts
-                  // executing, and fetching should continue.
-                  //
-                  // - does this imply some logical error in the
-                  //   emulator?
-    // set up ebp
-    pushImm(cpu.gprs[proc::gpr::ebp]);
+    uint32_t esp = cpu.gprs[proc::gpr::esp];
+    // set up return address, will be at ebp+4, then ebp. Both
+    // written before anything changes, either may fault
+    auto frame = (uint32_t*)cpu.toRamForWrite(esp - 8, 8);
+    if (!frame) return false;
+
+    frame[1] = ret; // the would-be eip
+                    // (once the instruction is fetched, it starts
+                    // executing, and fetching should continue.
+                    //
+                    // - does this imply some logical error in the
+                    //   emulator?
+    frame[0] = cpu.gprs[proc::gpr::ebp];
+    noteWrite(frame, 8);
+
     // logically, if we dereference ebp now, we get the contents
     // at ebp, which is the previous stack frame
-    cpu.gprs[proc::gpr::ebp] = cpu.gprs[proc::gpr::esp];
+    cpu.gprs[proc::gpr::esp] = cpu.gprs[proc::gpr::ebp] = esp - 8;
     // actually go where we decided to go
     // is also responsible for preventing eip increase
     jmpAbs(n);
+    return true;
+  }
+
+  ///
+  /// Note: undoes callAbs, which also takes care of the frame
+  ///
+  template <typename T>
+    requires(std::is_unsigned_v<T> && (sizeof(T) == 2 || sizeof(T) == 4))
+  bool retNear() noexcept {
+    // the frame: previous ebp, then the return address
+    uint32_t ebp   = cpu.gprs[proc::gpr::ebp];
+    auto     frame = (uint32_t*)cpu.toRam(ebp, 8);
+    if (!frame) return false;
+
+    uint32_t previous = frame[0];
+    uint32_t ret      = frame[1];
+    // drop the frame and restore the previous one
+    cpu.gprs[proc::gpr::esp] = ebp + 8;
+    cpu.gprs[proc::gpr::ebp] = previous;
+    jmpAbs<uint32_t>(ret);
+    return true;
+  }
+
+  ///
+  /// Address of a ModR/M memory operand, segments are flat
+  ///
+  uint32_t effectiveAddress(const disasm::insn& decoded) const noexcept {
+    auto     rm = decoded.rm();
+    uint32_t ea = (uint32_t)rm.disp;
+    if (rm.base != proc::gpr::GPR_MAX) ea += cpu.gprs[rm.base];
+    if (rm.index != proc::gpr::GPR_MAX) ea += cpu.gprs[rm.index] * rm.scale;
+    if (decoded.flags & disasm::insnFlags::addressSize16) ea &= 0xffff;
+    return ea;
+  }
+
+  ///
+  /// Where the ModR/M operand of an instruction lives, either a
+  /// register or guest memory, nullptr if ram doesn't back it
+  ///
+  template <typename T, bool forWrite = false>
+  T* rmOperand(const disasm::insn& decoded) noexcept {
+    if (!decoded.isMemory()) return (T*)&cpu.gprs[decoded.gpr()];
+    if constexpr (forWrite) return (T*)cpu.toRamForWrite(effectiveAddress(decoded), sizeof(T));
+    return (T*)cpu.toRam(effectiveAddress(decoded), sizeof(T));
+  }
+
+  ///
+  /// Executes a decoded instruction, specialized per
+  /// instruction struct generated from IMP_ISA. Returns
+  /// false if it touches memory outside of ram
+  ///
+  template <typename I>
+  bool execute(const disasm::insn& insn) noexcept;
+
+  /// Executes a decoded instruction and moves eip past it,
+  /// false on a fault, which leaves eip where it was
+  bool dispatch(const disasm::insn& insn) noexcept;
+
+  /// Decodes the block at eip into the cache, nullptr if
+  /// nothing decodes there
+  translatedBlock* translate(uint32_t eip);
+
+  /// fusedOp of a pair of instructions, 0 if they don't fuse
+  static uint16_t fuse(const disasm::insn& first, const disasm::insn& second) noexcept;
+
+  ///
+  /// Runs a fused pair and moves eip past what ran. Returns how
+  /// many of the two, fewer on a fault or if the first overwrote
+  /// cached code
+  ///
+  template <uint16_t F>
+  size_t runFused(const disasm::insn* pair) noexcept;
+
+  bool fusing = true;
+
+  /// Runs block from its instruction from on, see runBlock
+  size_t interpret(const translatedBlock& block, size_t from);
+
+  ///
+  /// Compiles the leading instructions of block that the JIT knows,
+  /// see jit.cc. Leaves native null if there are none
+  ///
+  void compile(translatedBlock& block, uint32_t eip);
+
+  ///
+  /// What compiled code calls out to, with guest registers in cpu.
+  /// Nonzero when cached code got overwritten
+  ///
+  static uint32_t jitPush(emu* e, uint32_t n) noexcept;
+  static void     jitPop(emu* e, uint32_t r) noexcept;
+  static void     jitCall(emu* e, uint32_t eip, uint32_t target, uint32_t length) noexcept;
+  static void     jitRet(emu* e) noexcept;
+  static void     jitResolveFlags(emu* e) noexcept;
+
+  jit::codeBuffer jitCode;
+
+  /// Drops the cached blocks of a page of ram
+  void flushPage(size_t page) noexcept;
+
+  /// Called after guest code wrote n bytes of ram at p
+  void noteWrite(const void* p, size_t n) noexcept {
+    auto offset = (size_t)((const uint8_t*)p - cpu.ram.base);
+    for (auto page = offset / cachePageSize; page <= (offset + n - 1) / cachePageSize; page++) {
+      if (page < cache.codePages.size() && cache.codePages[page]) flushPage(page);
+    }
+    if (onWrite) onWrite((uint32_t)offset, n);
   }
 };
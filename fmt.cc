@@ -0,0 +1,189 @@
+#include "fmt.hh"
+#include <algorithm>
+#include <iterator>
+
+using namespace disasm;
+
+namespace {
+  constexpr const char* mnemonics[] = {
+      "mov", "jmp", "call", "ret", "test", "add", "adc", "sub", "cmp", "and", "or", "xor", "inc", "dec", "push", "pop",
+  };
+
+  static_assert(std::size(mnemonics) == instructionType::POP + 1);
+
+  constexpr const char* segments[] = {"", "es ", "cs ", "ss ", "ds ", "fs ", "gs "};
+
+  /// Bytes column is padded up to this many bytes
+  constexpr size_t bytesColumn = 8;
+
+  ///
+  /// Cursor over the output, callers make sure there's room
+  ///
+  struct writer {
+    char* p;
+
+    void put(char c) noexcept {
+      *p++ = c;
+    }
+
+    void put(const char* s) noexcept {
+      while (*s) *p++ = *s++;
+    }
+
+    void hex8(uint8_t n) noexcept {
+      constexpr const char* digits = "0123456789abcdef";
+      put(digits[n >> 4]);
+      put(digits[n & 0xf]);
+    }
+
+    /// Zero padded, 8 digits
+    void hex32(uint32_t n) noexcept {
+      for (int shift = 24; shift >= 0; shift -= 8) hex8((uint8_t)(n >> shift));
+    }
+
+    /// 0x prefixed, no leading zeros
+    void imm(uint32_t n) noexcept {
+      constexpr const char* digits = "0123456789abcdef";
+      put("0x");
+
+      int shift = 28;
+      while (shift > 0 && !((n >> shift) & 0xf)) shift -= 4;
+      for (; shift >= 0; shift -= 4) put(digits[(n >> shift) & 0xf]);
+    }
+
+    void reg(proc::gpr r, bool is16) noexcept {
+      put(proc::gprToStr(r, is16));
+    }
+
+    /// ModR/M operand, a register or [base+index*scale+disp]
+    void rm(const insn& i, bool is16) noexcept {
+      auto r = i.rm();
+      if (!r.memory) {
+        reg(r.base, is16);
+        return;
+      }
+
+      bool addr16 = i.flags & insnFlags::addressSize16;
+      put(is16 ? "word ptr [" : "dword ptr [");
+      bool first = true;
+      if (r.base != proc::gpr::GPR_MAX) {
+        reg(r.base, addr16);
+        first = false;
+      }
+      if (r.index != proc::gpr::GPR_MAX) {
+        if (!first) put('+');
+        reg(r.index, addr16);
+        if (r.scale != 1) {
+          put('*');
+          put((char)('0' + r.scale));
+        }
+        first = false;
+      }
+      if (first) imm(addr16 ? (uint16_t)r.disp : (uint32_t)r.disp);
+      else if (r.disp < 0) {
+        put('-');
+        imm(0u - (uint32_t)r.disp);
+      } else if (r.disp > 0) {
+        put('+');
+        imm((uint32_t)r.disp);
+      }
+      put(']');
+    }
+  };
+} // namespace
+
+size_t disasm::formatInsn(std::span<char> out, uint32_t address, memoryViewType bytes, const insn& i) {
+  if (out.size() < maxLineLength) return 0;
+
+  writer w {out.data()};
+  w.hex32(address);
+  w.put(": ");
+
+  // the bytes column
+  size_t shown = i.valid() ? std::min<size_t>(i.length, bytes.size()) : std::min<size_t>(1, bytes.size());
+  for (size_t b = 0; b < shown; b++) {
+    w.hex8(bytes[b]);
+    w.put(' ');
+  }
+  for (size_t b = shown; b < bytesColumn; b++) w.put("   ");
+  w.put(' ');
+
+  if (!i.valid()) {
+    w.put("(bad)\n");
+    return w.p - out.data();
+  }
+
+  auto kinfo = info(i.id);
+  bool is16  = kinfo.bits == 16;
+
+  // prefixes that aren't folded into the operands
+  if (i.flags & insnFlags::lockPrefix) w.put("lock ");
+  if (i.flags & insnFlags::repPrefix) w.put("rep ");
+  if (i.flags & insnFlags::repnePrefix) w.put("repne ");
+  w.put(segments[(size_t)i.segmentOverride()]);
+
+  w.put(mnemonics[kinfo.type]);
+
+  switch (kinfo.form) {
+  case operandForm::bare:
+    break;
+  case operandForm::opReg:
+    w.put(' ');
+    w.reg(i.gpr(), is16);
+    break;
+  case operandForm::imm8:
+  case operandForm::immz:
+    w.put(is16 ? " word " : " ");
+    w.imm(i.imm);
+    break;
+  case operandForm::opRegImmz:
+  case operandForm::accImmz:
+    w.put(' ');
+    w.reg(i.gpr(), is16);
+    w.put(", ");
+    w.imm(i.imm);
+    break;
+  case operandForm::rmImm8:
+  case operandForm::rmImmz:
+    w.put(' ');
+    w.rm(i, is16);
+    w.put(", ");
+    w.imm(i.imm);
+    break;
+  case operandForm::rmReg:
+    w.put(' ');
+    w.rm(i, is16);
+    w.put(", ");
+    w.reg(i.gpr2(), is16);
+    break;
+  case operandForm::regRm:
+    w.put(' ');
+    w.reg(i.gpr2(), is16);
+    w.put(", ");
+    w.rm(i, is16);
+    break;
+  case operandForm::relz:
+    w.put(' ');
+    w.imm(i.imm);
+    break;
+  }
+
+  w.put('\n');
+  return w.p - out.data();
+}
+
+size_t disasm::formatListing(memoryViewType code, size_t& at, std::span<char> out, uint32_t base) {
+  size_t written = 0;
+
+  while (at < code.size() && out.size() - written >= maxLineLength) {
+    auto decoded = decodeAt(code, at);
+
+    // targets were resolved relative to code
+    decoded.rebase(base);
+
+    written += formatInsn(out.subspan(written), (uint32_t)(base + at), code.subspan(at), decoded);
+    at += sweepLength(decoded);
+  }
+
+  return written;
+}
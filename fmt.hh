@@ -0,0 +1,29 @@
+#pragma once
+
+#include "disasm.hh"
+#include <cstdint>
+#include <span>
+
+namespace disasm {
+  /// Longest line formatInsn writes, newline included
+  static constexpr size_t maxLineLength = 128;
+
+  ///
+  /// Writes one listing line, Intel syntax:
+  ///
+  ///   00000010: 66 83 c0 01              add ax, 0x1
+  ///
+  /// bytes are the ones the instruction was decoded from. Nothing is
+  /// allocated and no printf is involved. Returns how many characters
+  /// were written, 0 if less than maxLineLength were available
+  ///
+  size_t formatInsn(std::span<char> out, uint32_t address, memoryViewType bytes, const insn& i);
+
+  ///
+  /// Sweeps code from code[at] like decodeRange, writing a line per
+  /// instruction until either code or out runs out. Addresses and
+  /// targets are shifted by base. Returns how many characters were
+  /// written, at is left after the last instruction written
+  ///
+  size_t formatListing(memoryViewType code, size_t& at, std::span<char> out, uint32_t base = 0);
+} // namespace disasm
@@ -0,0 +1,177 @@
+#include "index.hh"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace disasm;
+
+namespace {
+  constexpr char indexMagic[8] = {'i', 'm', 'p', 'i', 'n', 'd', 'e', 'x'};
+
+  constexpr uint64_t alignUp(uint64_t n) noexcept {
+    return (n + 7) & ~(uint64_t)7;
+  }
+
+  ///
+  /// Bytes, and where they go, of every section, in section order
+  ///
+  struct sectionData {
+    const void* data;
+    uint64_t    count;
+    size_t      elementSize;
+  };
+
+  template <typename T>
+  sectionData section(const std::vector<T>& v) noexcept {
+    return {v.data(), v.size(), sizeof(T)};
+  }
+} // namespace
+
+bool disasm::saveIndex(const char* path, uint64_t codeSize, const flowGraph& g, const xrefIndex& x) {
+  const sectionData sections[] = {
+      section(g.insnOffsets), section(g.insns),  section(g.blockStarts), section(g.blockEnds),
+      section(g.blockInsns),  section(x.targets), section(x.sources),    section(x.isCall),
+  };
+
+  static_assert(std::size(sections) == (size_t)indexSection::count);
+
+  indexHeader header {};
+  memcpy(header.magic, indexMagic, sizeof(indexMagic));
+  header.version   = indexVersion;
+  header.insnSize  = sizeof(insn);
+  header.kindCount = (uint32_t)kind::count;
+  header.codeSize  = codeSize;
+
+  uint64_t at = alignUp(sizeof(header));
+  for (size_t i = 0; i < std::size(sections); i++) {
+    header.sections[i].offset = at;
+    header.sections[i].count  = sections[i].count;
+    at                        = alignUp(at + sections[i].count * sections[i].elementSize);
+  }
+
+  auto f = fopen(path, "wb");
+  if (!f) return false;
+
+  // sections are written back to back, padded to their offsets
+  const uint8_t zeros[8] = {};
+  bool          ok       = fwrite(&header, sizeof(header), 1, f) == 1;
+  uint64_t      written  = sizeof(header);
+  for (size_t i = 0; ok && i < std::size(sections); i++) {
+    auto pad = header.sections[i].offset - written;
+    ok       = fwrite(zeros, 1, pad, f) == pad;
+
+    auto bytes = sections[i].count * sections[i].elementSize;
+    ok         = ok && (bytes == 0 || fwrite(sections[i].data, 1, bytes, f) == bytes);
+    written    = header.sections[i].offset + bytes;
+  }
+
+  ok = fclose(f) == 0 && ok;
+  if (!ok) remove(path);
+  return ok;
+}
+
+imageIndex::imageIndex(const char* path) {
+#ifdef _WIN32
+  file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (file == INVALID_HANDLE_VALUE) {
+    file = nullptr;
+    return;
+  }
+
+  LARGE_INTEGER fileSize;
+  GetFileSizeEx(file, &fileSize);
+  size = (size_t)fileSize.QuadPart;
+  if (size < sizeof(indexHeader)) return;
+
+  fileMapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  if (!fileMapping) return;
+  mapping = MapViewOfFile(fileMapping, FILE_MAP_READ, 0, 0, 0);
+#else
+  file = ::open(path, O_RDONLY);
+  if (file < 0) return;
+
+  struct stat st;
+  fstat(file, &st);
+  size = (size_t)st.st_size;
+  if (size < sizeof(indexHeader)) return;
+
+  mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, file, 0);
+  if (mapping == MAP_FAILED) mapping = nullptr;
+#endif
+
+  if (mapping) valid = load();
+}
+
+imageIndex::~imageIndex() {
+#ifdef _WIN32
+  if (mapping) UnmapViewOfFile(mapping);
+  if (fileMapping) CloseHandle(fileMapping);
+  if (file) CloseHandle(file);
+#else
+  if (mapping) munmap(mapping, size);
+  if (file >= 0) ::close(file);
+#endif
+}
+
+bool imageIndex::load() noexcept {
+  auto h = (const indexHeader*)mapping;
+  if (memcmp(h->magic, indexMagic, sizeof(indexMagic)) != 0) return false;
+  if (h->version != indexVersion || h->insnSize != sizeof(insn)) return false;
+  if (h->kindCount != (uint32_t)kind::count) return false;
+
+  // every section has to be aligned, and inside of the file
+  auto get = [&]<typename T>(indexSection s, std::span<const T>& out) {
+    auto& sec = h->sections[(size_t)s];
+    if (sec.offset % alignof(T) || sec.offset > size || sec.count > (size - sec.offset) / sizeof(T)) return false;
+
+    out = {(const T*)((const uint8_t*)mapping + sec.offset), (size_t)sec.count};
+    return true;
+  };
+
+  bool ok = get(indexSection::insnOffsets, insnOffsets) && get(indexSection::insns, insns)
+            && get(indexSection::blockStarts, blockStarts) && get(indexSection::blockEnds, blockEnds)
+            && get(indexSection::blockInsns, blockInsns) && get(indexSection::xrefTargets, xrefTargets)
+            && get(indexSection::xrefSources, xrefSources) && get(indexSection::xrefIsCall, xrefIsCall);
+
+  // lookups index across these
+  ok = ok && insns.size() == insnOffsets.size() && blockEnds.size() == blockStarts.size()
+       && xrefSources.size() == xrefTargets.size() && xrefIsCall.size() == xrefTargets.size();
+
+  if (!ok) {
+    insnOffsets = blockStarts = blockEnds = blockInsns = xrefTargets = xrefSources = {};
+    insns                                                                         = {};
+    xrefIsCall                                                                    = {};
+    return false;
+  }
+
+  header = h;
+  return true;
+}
+
+const insn* imageIndex::insnAt(uint32_t offset) const noexcept {
+  auto it = std::lower_bound(insnOffsets.begin(), insnOffsets.end(), offset);
+  if (it == insnOffsets.end() || *it != offset) return nullptr;
+  return &insns[it - insnOffsets.begin()];
+}
+
+uint32_t imageIndex::blockAt(uint32_t offset) const noexcept {
+  auto it = std::upper_bound(blockStarts.begin(), blockStarts.end(), offset);
+  if (it == blockStarts.begin()) return npos;
+
+  auto b = (uint32_t)(it - blockStarts.begin()) - 1;
+  if (offset >= blockEnds[b]) return npos;
+  return b;
+}
+
+std::span<const uint32_t> imageIndex::sourcesOf(uint32_t target) const noexcept {
+  auto [b, e] = std::equal_range(xrefTargets.begin(), xrefTargets.end(), target);
+  return {xrefSources.data() + (b - xrefTargets.begin()), xrefSources.data() + (e - xrefTargets.begin())};
+}
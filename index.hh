@@ -0,0 +1,105 @@
+#pragma once
+
+#include "disasm.hh"
+#include "cfg.hh"
+#include "xref.hh"
+#include <cstdint>
+#include <span>
+
+namespace disasm {
+  ///
+  /// On-disk index of a disassembled image. A header followed by
+  /// 8-byte aligned sections that are the flowGraph/xrefIndex arrays
+  /// as they are in memory, in host byte order, so a mapped file is
+  /// used in place without parsing. Bump indexVersion whenever the
+  /// layout, or insn, changes. What ids mean is in kindCount, the ISA
+  /// changing refuses older indexes too
+  ///
+  static constexpr uint32_t indexVersion = 2;
+
+  enum class indexSection : uint32_t {
+    insnOffsets,
+    insns,
+    blockStarts,
+    blockEnds,
+    blockInsns,
+    xrefTargets,
+    xrefSources,
+    xrefIsCall,
+    count,
+  };
+
+  struct indexHeader {
+    char     magic[8];
+    uint32_t version;
+    uint32_t insnSize; // sizeof(insn) when written
+    uint32_t kindCount; // kind::count when written, insn::id values follow it
+    uint64_t codeSize;
+    struct {
+      uint64_t offset; // from the start of the file
+      uint64_t count;  // elements, not bytes
+    } sections[(size_t)indexSection::count];
+  };
+
+  ///
+  /// Writes the instructions and blocks of g, and the references of
+  /// x, both recovered from codeSize bytes of code, to path
+  ///
+  bool saveIndex(const char* path, uint64_t codeSize, const flowGraph& g, const xrefIndex& x);
+
+  ///
+  /// A saved index, mapped read-only. The spans point into the
+  /// mapping, they are empty if the file couldn't be opened or
+  /// doesn't hold a valid index of this version
+  ///
+  struct imageIndex {
+    static constexpr uint32_t npos = flowGraph::npos;
+
+    explicit imageIndex(const char* path);
+    ~imageIndex();
+
+    imageIndex& operator=(const imageIndex&) = delete;
+    imageIndex(const imageIndex&)            = delete;
+
+    bool ok() const noexcept {
+      return valid;
+    }
+
+    uint64_t codeSize() const noexcept {
+      return header ? header->codeSize : 0;
+    }
+
+    /// Instruction starting at offset, nullptr if none
+    const insn* insnAt(uint32_t offset) const noexcept;
+
+    /// Block containing offset, npos if none
+    uint32_t blockAt(uint32_t offset) const noexcept;
+
+    /// Offsets of the calls/jmps to target
+    std::span<const uint32_t> sourcesOf(uint32_t target) const noexcept;
+
+    std::span<const uint32_t> insnOffsets;
+    std::span<const insn>     insns;
+    std::span<const uint32_t> blockStarts;
+    std::span<const uint32_t> blockEnds;
+    std::span<const uint32_t> blockInsns;
+    std::span<const uint32_t> xrefTargets;
+    std::span<const uint32_t> xrefSources;
+    std::span<const uint8_t>  xrefIsCall;
+
+private:
+    /// Checks the header and points the spans into the mapping
+    bool load() noexcept;
+
+    const indexHeader* header  = nullptr;
+    bool               valid   = false;
+    void*              mapping = nullptr;
+    size_t             size    = 0;
+#ifdef _WIN32
+    void* file        = nullptr;
+    void* fileMapping = nullptr;
+#else
+    int file = -1;
+#endif
+  };
+} // namespace disasm
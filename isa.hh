@@ -0,0 +1,199 @@
+#pragma once
+
+#include "proc.hh"
+#include <cstdint>
+#include <cstddef>
+#include <type_traits>
+
+namespace disasm {
+  enum instructionType {
+    MOV,
+    JMP,
+    CALL,
+    RET,
+    TEST,
+    ADD,
+    ADC,
+    SUB,
+    CMP,
+    AND,
+    OR,
+    XOR,
+    INC,
+    DEC,
+    PUSH,
+    POP,
+  };
+
+  ///
+  /// How the operands of an instruction are laid out after its opcode,
+  /// this decides both the fields of the decoded struct and how they
+  /// are read out of the instruction stream
+  ///
+  enum class operandForm {
+    bare,      // nothing
+    opReg,     // register in the low 3 bits of the opcode
+    opRegImmz, // ditto, followed by imm32/imm16 if prefix
+    imm8,      // imm8, extended to imm16 if prefix
+    immz,      // imm32/imm16 if prefix
+    accImmz,   // eax/ax if prefix implied, imm32/imm16 if prefix
+    rmImm8,    // ModR/M, imm8
+    rmImmz,    // ModR/M, imm32/imm16 if prefix
+    rmReg,     // ModR/M, register in the reg field
+    regRm,     // ditto, the register in the reg field is the destination
+    relz,      // rel32/rel16 if prefix, resolved to a target
+  };
+
+  /// ModR/M reg field of instructions that aren't part of a group
+  static constexpr int8_t noGroup = -1;
+
+  static constexpr bool hasModRM(operandForm f) noexcept {
+    return f == operandForm::rmImm8 || f == operandForm::rmImmz || f == operandForm::rmReg || f == operandForm::regRm;
+  }
+
+  static constexpr bool hasOpcodeReg(operandForm f) noexcept {
+    return f == operandForm::opReg || f == operandForm::opRegImmz;
+  }
+
+  /// Bytes following the opcode byte, not counting the SIB byte
+  /// and displacement of ModR/M forms
+  static constexpr size_t operandBytes(operandForm f, size_t bits) noexcept {
+    size_t z = bits == 16 ? 2 : 4;
+    switch (f) {
+    case operandForm::bare:
+    case operandForm::opReg:
+      return 0;
+    case operandForm::imm8:
+    case operandForm::rmReg:
+    case operandForm::regRm:
+      return 1;
+    case operandForm::rmImm8:
+      return 2;
+    case operandForm::rmImmz:
+      return 1 + z;
+    case operandForm::opRegImmz:
+    case operandForm::immz:
+    case operandForm::accImmz:
+    case operandForm::relz:
+      return z;
+    }
+
+    return 0;
+  }
+
+  ///
+  /// Operand encoded by a ModR/M byte, along with its SIB byte and
+  /// displacement: either a register, or [base + index * scale + disp]
+  ///
+  struct rmOperand {
+    /// The register itself if !memory, GPR_MAX if there's no base
+    proc::gpr base   = proc::gpr::GPR_MAX;
+    proc::gpr index  = proc::gpr::GPR_MAX; // GPR_MAX if none
+    uint8_t   scale  = 1;
+    int32_t   disp   = 0;
+    bool      memory = false;
+  };
+
+  template <size_t Bits>
+  using immz = std::conditional_t<Bits == 16, uint16_t, uint32_t>;
+
+  ///
+  /// Fields of the decoded struct, per operand form
+  ///
+  template <operandForm F, size_t Bits>
+  struct operands { };
+
+  template <size_t Bits>
+  struct operands<operandForm::opReg, Bits> {
+    proc::gpr gpr;
+  };
+
+  template <size_t Bits>
+  struct operands<operandForm::opRegImmz, Bits> {
+    proc::gpr   gpr;
+    immz<Bits> imm;
+  };
+
+  template <size_t Bits>
+  struct operands<operandForm::imm8, Bits> {
+    std::conditional_t<Bits == 16, uint16_t, uint8_t> imm;
+  };
+
+  template <size_t Bits>
+  struct operands<operandForm::immz, Bits> {
+    immz<Bits> imm;
+  };
+
+  template <size_t Bits>
+  struct operands<operandForm::accImmz, Bits> {
+    immz<Bits> imm;
+  };
+
+  ///
+  /// For ModR/M forms gpr is the r/m register, GPR_MAX if rm
+  /// is a memory operand
+  ///
+  template <size_t Bits>
+  struct operands<operandForm::rmImm8, Bits> {
+    proc::gpr gpr;
+    uint8_t   imm;
+    rmOperand rm;
+  };
+
+  template <size_t Bits>
+  struct operands<operandForm::rmImmz, Bits> {
+    proc::gpr   gpr;
+    immz<Bits> imm;
+    rmOperand   rm;
+  };
+
+  template <size_t Bits>
+  struct operands<operandForm::rmReg, Bits> {
+    proc::gpr gpr;
+    proc::gpr gpr2; // the reg field
+    rmOperand rm;
+  };
+
+  template <size_t Bits>
+  struct operands<operandForm::regRm, Bits> : operands<operandForm::rmReg, Bits> { };
+
+  template <size_t Bits>
+  struct operands<operandForm::relz, Bits> {
+    immz<Bits> addr; // not short jump, therefore unsigned
+  };
+} // namespace disasm
+
+///
+/// The instruction set, one line per encoding:
+///
+///   X(name16, name32, instructionType, opcode, ModR/M group, operandForm)
+///
+/// name16 is decoded under the operand size prefix, name32 otherwise.
+/// For register-in-opcode forms, opcode is the first of the 8 opcodes
+/// of the row. Both the decoder tables and the emulator handlers are
+/// generated from this list.
+///
+#define IMP_ISA(X)                                                                                                     \
+  X(pushImm16From8, pushImm8, PUSH, 0x6a, noGroup, imm8)                                                              \
+  X(pushImm16, pushImm32, PUSH, 0x68, noGroup, immz)                                                                  \
+  X(pushReg16, pushReg32, PUSH, 0x50, noGroup, opReg)                                                                 \
+  X(popReg16, popReg32, POP, 0x58, noGroup, opReg)                                                                    \
+  X(movReg16, movReg32, MOV, 0xb8, noGroup, opRegImmz)                                                                \
+  X(movRm16Reg16, movRm32Reg32, MOV, 0x89, noGroup, rmReg)                                                            \
+  X(movReg16Rm16, movReg32Rm32, MOV, 0x8b, noGroup, regRm)                                                            \
+  X(movRm16Imm16, movRm32Imm32, MOV, 0xc7, 0, rmImmz)                                                                 \
+  X(addReg16Imm8, addReg32Imm8, ADD, 0x83, 0, rmImm8)                                                                 \
+  X(orReg16Imm8, orReg32Imm8, OR, 0x83, 1, rmImm8)                                                                    \
+  X(adcReg16Imm8, adcReg32Imm8, ADC, 0x83, 2, rmImm8)                                                                 \
+  X(andReg16Imm8, andReg32Imm8, AND, 0x83, 4, rmImm8)                                                                 \
+  X(subReg16Imm8, subReg32Imm8, SUB, 0x83, 5, rmImm8)                                                                 \
+  X(xorReg16Imm8, xorReg32Imm8, XOR, 0x83, 6, rmImm8)                                                                 \
+  X(cmpReg16Imm8, cmpReg32Imm8, CMP, 0x83, 7, rmImm8)                                                                 \
+  X(addReg16Imm16, addReg32Imm32, ADD, 0x81, 0, rmImmz)                                                               \
+  X(addAxImm16, addEaxImm32, ADD, 0x05, noGroup, accImmz)                                                             \
+  X(incReg16, incReg32, INC, 0x40, noGroup, opReg)                                                                    \
+  X(decReg16, decReg32, DEC, 0x48, noGroup, opReg)                                                                    \
+  X(testReg16Reg16, testReg32Reg32, TEST, 0x85, noGroup, rmReg)                                                       \
+  X(jmpNear16, jmpNear32, JMP, 0xe9, noGroup, relz)                                                                   \
+  X(callNear16, callNear32, CALL, 0xe8, noGroup, relz)                                                                \
+  X(retNear16, retNear32, RET, 0xc3, noGroup, bare)
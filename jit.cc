@@ -0,0 +1,554 @@
+#include "emu.hh"
+#include <cstring>
+#ifdef IMP_JIT
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+using namespace jit;
+
+codeBuffer::codeBuffer() {
+#ifdef IMP_JIT
+  auto mapping = mmap(nullptr, capacity, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mapping != MAP_FAILED) base = (uint8_t*)mapping;
+#endif
+}
+
+codeBuffer::~codeBuffer() {
+#ifdef IMP_JIT
+  if (base) munmap(base, capacity);
+#endif
+}
+
+const void* codeBuffer::append(std::span<const uint8_t> code) noexcept {
+#ifdef IMP_JIT
+  if (!base || code.size() > capacity - used) return nullptr;
+
+  auto pageSize = (size_t)sysconf(_SC_PAGESIZE);
+  auto from     = used & ~(pageSize - 1);
+  auto to       = (used + code.size() + pageSize - 1) & ~(pageSize - 1);
+  if (mprotect(base + from, to - from, PROT_READ | PROT_WRITE)) return nullptr;
+  memcpy(base + used, code.data(), code.size());
+  mprotect(base + from, to - from, PROT_READ | PROT_EXEC);
+
+  auto at = base + used;
+  // keep blocks 16 byte aligned
+  used = (used + code.size() + 15) & ~(size_t)15;
+  return at;
+#else
+  (void)code;
+  return nullptr;
+#endif
+}
+
+uint32_t emu::jitPush(emu* e, uint32_t n) noexcept {
+  auto generation = e->cache.generation;
+  e->pushImm(n);
+  return e->cache.generation != generation;
+}
+
+void emu::jitPop(emu* e, uint32_t r) noexcept {
+  e->popReg<uint32_t>((proc::gpr)r);
+}
+
+void emu::jitCall(emu* e, uint32_t eip, uint32_t target, uint32_t length) noexcept {
+  e->cpu.eip = eip;
+  e->callAbs<uint32_t>(target, length);
+  e->increaseEip = true;
+}
+
+void emu::jitRet(emu* e) noexcept {
+  // faults are signals where there's a JIT, these always succeed
+  e->retNear<uint32_t>();
+  e->increaseEip = true;
+}
+
+void emu::jitResolveFlags(emu* e) noexcept {
+  e->cpu.eflags();
+}
+
+#ifdef IMP_JIT
+namespace {
+  /// Host registers, numbered like ModR/M does, REX extends to 16
+  enum reg : uint8_t { rax, rcx, rdx, rbx, rsp, rbp, rsi, rdi, r8 };
+
+  /// Guest registers live in r8-r15, in proc::gpr order
+  reg hostOf(uint32_t guest) noexcept {
+    return (reg)(r8 + guest);
+  }
+
+  ///
+  /// Just the encodings compiled blocks need. rbx holds the emu,
+  /// memory operands are all [rbx + disp32]
+  ///
+  struct assembler {
+    std::vector<uint8_t> out;
+
+    void byte(uint8_t b) {
+      out.push_back(b);
+    }
+
+    void dword(uint32_t n) {
+      for (size_t i = 0; i < 4; i++) byte((uint8_t)(n >> (i * 8)));
+    }
+
+    void qword(uint64_t n) {
+      dword((uint32_t)n);
+      dword((uint32_t)(n >> 32));
+    }
+
+    void rex(bool w, uint8_t r, uint8_t b) {
+      uint8_t prefix = 0x40 | (w << 3) | ((r >> 3) << 2) | (b >> 3);
+      if (prefix != 0x40) byte(prefix);
+    }
+
+    void modrm(uint8_t mod, uint8_t r, uint8_t rm) {
+      byte((uint8_t)((mod << 6) | ((r & 7) << 3) | (rm & 7)));
+    }
+
+    /// opcode r/m32, r32
+    void opRR(uint8_t opcode, reg rm, reg r) {
+      rex(false, r, rm);
+      byte(opcode);
+      modrm(0b11, r, rm);
+    }
+
+    /// 0x81 group: op r/m32, imm32
+    void opRI(uint8_t ext, reg rm, uint32_t imm) {
+      rex(false, 0, rm);
+      byte(0x81);
+      modrm(0b11, ext, rm);
+      dword(imm);
+    }
+
+    /// 0xff group: inc/dec r/m32
+    void opR(uint8_t ext, reg rm) {
+      rex(false, 0, rm);
+      byte(0xff);
+      modrm(0b11, ext, rm);
+    }
+
+    void movRI(reg r, uint32_t imm) {
+      rex(false, 0, r);
+      byte(0xb8 | (r & 7));
+      dword(imm);
+    }
+
+    void movRR(reg dst, reg src) {
+      opRR(0x89, dst, src);
+    }
+
+    void load(reg r, int32_t disp) {
+      rex(false, r, rbx);
+      byte(0x8b);
+      modrm(0b10, r, rbx);
+      dword(disp);
+    }
+
+    void store(int32_t disp, reg r) {
+      rex(false, r, rbx);
+      byte(0x89);
+      modrm(0b10, r, rbx);
+      dword(disp);
+    }
+
+    void storeImm(int32_t disp, uint32_t imm) {
+      byte(0xc7);
+      modrm(0b10, 0, rbx);
+      dword(disp);
+      dword(imm);
+    }
+
+    void storeByte(int32_t disp, uint8_t imm) {
+      byte(0xc6);
+      modrm(0b10, 0, rbx);
+      dword(disp);
+      byte(imm);
+    }
+
+    void call(const void* f) {
+      // mov rax, f; call rax
+      byte(0x48);
+      byte(0xb8);
+      qword((uint64_t)f);
+      byte(0xff);
+      byte(0xd0);
+    }
+
+    /// test eax, eax; jnz, returns where the displacement goes
+    size_t jnzIfEax() {
+      byte(0x85);
+      byte(0xc0);
+      byte(0x0f);
+      byte(0x85);
+      dword(0);
+      return out.size() - 4;
+    }
+
+    void patch(size_t at, size_t target) {
+      auto rel = (uint32_t)(target - (at + 4));
+      memcpy(&out[at], &rel, 4);
+    }
+  };
+
+  /// How an instruction relates to the flags
+  enum class flagUse { none, full, keepsCarry, readsCarry };
+
+  flagUse flagUseOf(disasm::instructionType type) noexcept {
+    switch (type) {
+    case disasm::ADD:
+    case disasm::SUB:
+    case disasm::CMP:
+    case disasm::AND:
+    case disasm::OR:
+    case disasm::XOR:
+    case disasm::TEST:
+      return flagUse::full;
+    case disasm::INC:
+    case disasm::DEC:
+      return flagUse::keepsCarry;
+    case disasm::ADC:
+      return flagUse::readsCarry;
+    default:
+      return flagUse::none;
+    }
+  }
+
+  /// Whether compiled code can run insn: 32-bit, register operands only
+  bool compilable(const disasm::insn& insn) noexcept {
+    using enum disasm::operandForm;
+    auto info = disasm::info(insn.id);
+    if (info.bits != 32) return false;
+    if (disasm::hasModRM(info.form) && insn.isMemory()) return false;
+
+    switch (info.type) {
+    case disasm::PUSH:
+      // push imm8 pushes a byte, left to the interpreter
+      return info.form == opReg || info.form == immz;
+    default:
+      return true;
+    }
+  }
+
+  /// Calls out to the emu, with guest registers spilled
+  bool callsOut(disasm::instructionType type) noexcept {
+    return type == disasm::PUSH || type == disasm::POP || type == disasm::CALL || type == disasm::RET;
+  }
+} // namespace
+#endif
+
+void emu::compile(translatedBlock& block, uint32_t eip) {
+#ifdef IMP_JIT
+  using enum disasm::operandForm;
+
+  size_t count = 0;
+  while (count < block.insns.size() && compilable(block.insns[count])) count++;
+  if (count == 0) return;
+
+  auto offset = [&](const void* field) {
+    return (int32_t)((const uint8_t*)field - (const uint8_t*)this);
+  };
+
+  const auto gprs      = offset(cpu.gprs.data());
+  const auto eipField  = offset(&cpu.eip);
+  const auto flags     = offset(&cpu.flags);
+  const auto lazyOp    = offset(&cpu.lazy.op);
+  const auto lazySize  = offset(&cpu.lazy.size);
+  const auto lazyDst   = offset(&cpu.lazy.dst);
+  const auto lazySrc   = offset(&cpu.lazy.src);
+  const auto lazyRes   = offset(&cpu.lazy.result);
+  const auto calleeArg = [](assembler& a) {
+    a.byte(0x48); // mov rdi, rbx
+    a.byte(0x89);
+    a.byte(0xdf);
+  };
+
+  // where control can leave: after calls out, and at the end
+  std::vector<uint8_t> exitsAfter(count, 0);
+  for (size_t i = 0; i < count; i++) exitsAfter[i] = callsOut(disasm::info(block.insns[i].id).type);
+  exitsAfter[count - 1] = 1;
+
+  // flag upkeep: a record only has to be stored if control may
+  // leave before the next flag producer overwrites it, and the carry
+  // only worked out if the next one keeps or reads it
+  std::vector<uint8_t> needsRecord(count, 0), needsCarry(count, 0);
+  bool                 resolveOnEntry = false;
+  bool                 seenProducer   = false;
+  for (size_t i = 0; i < count; i++) {
+    auto use = flagUseOf(disasm::info(block.insns[i].id).type);
+    if (use == flagUse::none) continue;
+
+    if (!seenProducer && use != flagUse::full) resolveOnEntry = true;
+    seenProducer = true;
+
+    size_t next = i + 1;
+    bool   exits = exitsAfter[i];
+    while (next < count && flagUseOf(disasm::info(block.insns[next].id).type) == flagUse::none) {
+      exits |= exitsAfter[next];
+      next++;
+    }
+
+    needsRecord[i] = exits || next == count;
+    if (next < count && use != flagUse::keepsCarry) {
+      needsCarry[i] = flagUseOf(disasm::info(block.insns[next].id).type) != flagUse::full;
+    }
+  }
+
+  assembler a;
+  auto      spill = [&] {
+    for (uint32_t g = 0; g < proc::gpr::GPR_MAX; g++) a.store(gprs + g * 4, hostOf(g));
+  };
+  auto reload = [&] {
+    for (uint32_t g = 0; g < proc::gpr::GPR_MAX; g++) a.load(hostOf(g), gprs + g * 4);
+  };
+  auto epilogue = [&](uint32_t ran) {
+    a.movRI(rax, ran);
+    a.byte(0x41); // pop r15..r12
+    a.byte(0x5f);
+    a.byte(0x41);
+    a.byte(0x5e);
+    a.byte(0x41);
+    a.byte(0x5d);
+    a.byte(0x41);
+    a.byte(0x5c);
+    a.byte(0x5b); // pop rbx
+    a.byte(0xc3);
+  };
+
+  // callee saved registers used, which also keeps calls out aligned
+  a.byte(0x53); // push rbx
+  a.byte(0x41); // push r12..r15
+  a.byte(0x54);
+  a.byte(0x41);
+  a.byte(0x55);
+  a.byte(0x41);
+  a.byte(0x56);
+  a.byte(0x41);
+  a.byte(0x57);
+  a.byte(0x48); // mov rbx, rdi
+  a.byte(0x89);
+  a.byte(0xfb);
+
+  if (resolveOnEntry) {
+    calleeArg(a);
+    a.call((const void*)&emu::jitResolveFlags);
+  }
+  reload();
+
+  // early exits, taken when a call out overwrote cached code.
+  // Guest registers are in cpu already
+  struct earlyExit {
+    size_t   at;
+    uint32_t ran;
+    uint32_t eip;
+  };
+  std::vector<earlyExit> exits;
+
+  auto record = [&](softCPU::flagOp op, reg result) {
+    a.store(lazyRes, result);
+    a.storeByte(lazyOp, (uint8_t)op);
+    a.storeByte(lazySize, 4);
+  };
+
+  // host carry into the carry of cpu.flags, right after the host
+  // instruction setting it the way the interpreter does
+  auto mergeCarry = [&] {
+    a.byte(0x0f); // setc cl
+    a.byte(0x92);
+    a.byte(0xc1);
+    a.byte(0x81); // and dword [rbx + flags], ~carryFlag
+    a.modrm(0b10, 4, rbx);
+    a.dword(flags);
+    a.dword(~(uint32_t)proc::flags::carryFlag);
+    a.byte(0x0f); // movzx ecx, cl
+    a.byte(0xb6);
+    a.byte(0xc9);
+    a.byte(0x09); // or dword [rbx + flags], ecx
+    a.modrm(0b10, rcx, rbx);
+    a.dword(flags);
+  };
+
+  uint32_t at = eip;
+  for (size_t i = 0; i < count; i++) {
+    const auto& insn = block.insns[i];
+    auto        info = disasm::info(insn.id);
+    auto        next = at + insn.length;
+    uint32_t    imm  = info.form == rmImm8 ? (uint8_t)insn.imm : insn.imm;
+    reg         dst  = hostOf(insn.gpr());
+
+    // 0x81 group extension and r/m, r opcode of the ALU ops
+    auto group = [](disasm::instructionType type) -> uint8_t {
+      switch (type) {
+      case disasm::ADD:
+        return 0;
+      case disasm::OR:
+        return 1;
+      case disasm::AND:
+        return 4;
+      case disasm::SUB:
+        return 5;
+      case disasm::XOR:
+        return 6;
+      default:
+        return 7;
+      }
+    };
+
+    switch (info.type) {
+    case disasm::MOV:
+      if (info.form == opRegImmz || info.form == rmImmz) a.movRI(dst, imm);
+      else if (info.form == rmReg)
+        a.movRR(dst, hostOf(insn.gpr2()));
+      else
+        a.movRR(hostOf(insn.gpr2()), dst);
+      break;
+    case disasm::ADD:
+    case disasm::SUB:
+    case disasm::AND:
+    case disasm::OR:
+    case disasm::XOR: {
+      bool arithmetic = info.type == disasm::ADD || info.type == disasm::SUB;
+      if (needsRecord[i] && arithmetic) {
+        a.store(lazyDst, dst);
+        a.storeImm(lazySrc, imm);
+      }
+      a.opRI(group(info.type), dst, imm);
+      if (needsCarry[i]) mergeCarry();
+      if (needsRecord[i]) {
+        record(info.type == disasm::ADD   ? softCPU::flagOp::add
+               : info.type == disasm::SUB ? softCPU::flagOp::sub
+                                          : softCPU::flagOp::logic,
+               dst);
+      }
+      break;
+    }
+    case disasm::ADC:
+      // carry in, with the interpreter's wrap at the immediate's width
+      a.load(rcx, flags);
+      a.byte(0x83); // and ecx, carryFlag
+      a.byte(0xe1);
+      a.byte(proc::flags::carryFlag);
+      a.opRI(0, rcx, imm);
+      if (info.form == rmImm8) {
+        a.byte(0x0f); // movzx ecx, cl
+        a.byte(0xb6);
+        a.byte(0xc9);
+      }
+      if (needsRecord[i]) {
+        a.store(lazyDst, dst);
+        a.store(lazySrc, rcx);
+      }
+      a.opRR(0x01, dst, rcx);
+      if (needsCarry[i]) mergeCarry();
+      if (needsRecord[i]) record(softCPU::flagOp::add, dst);
+      break;
+    case disasm::CMP:
+      if (!needsRecord[i] && !needsCarry[i]) break;
+      if (needsRecord[i]) {
+        a.store(lazyDst, dst);
+        a.storeImm(lazySrc, imm);
+      }
+      a.movRR(rax, dst);
+      a.opRI(5, rax, imm);
+      if (needsCarry[i]) mergeCarry();
+      if (needsRecord[i]) record(softCPU::flagOp::sub, rax);
+      break;
+    case disasm::TEST:
+      if (!needsRecord[i] && !needsCarry[i]) break;
+      a.movRR(rax, dst);
+      a.opRR(0x21, rax, hostOf(insn.gpr2()));
+      if (needsCarry[i]) mergeCarry();
+      if (needsRecord[i]) record(softCPU::flagOp::logic, rax);
+      break;
+    case disasm::INC:
+    case disasm::DEC:
+      if (needsRecord[i]) {
+        a.store(lazyDst, dst);
+        a.storeImm(lazySrc, 1);
+      }
+      a.opR(info.type == disasm::INC ? 0 : 1, dst);
+      if (needsRecord[i]) record(info.type == disasm::INC ? softCPU::flagOp::inc : softCPU::flagOp::dec, dst);
+      break;
+    case disasm::PUSH:
+      // where a fault leaves eip
+      a.storeImm(eipField, at);
+      spill();
+      calleeArg(a);
+      if (info.form == opReg) a.movRR(rsi, dst);
+      else
+        a.movRI(rsi, imm);
+      a.call((const void*)&emu::jitPush);
+      exits.push_back({a.jnzIfEax(), (uint32_t)i + 1, next});
+      reload();
+      break;
+    case disasm::POP:
+      a.storeImm(eipField, at);
+      spill();
+      calleeArg(a);
+      a.movRI(rsi, insn.gpr());
+      a.call((const void*)&emu::jitPop);
+      reload();
+      break;
+    case disasm::JMP:
+      a.storeImm(eipField, insn.imm);
+      spill();
+      epilogue((uint32_t)i + 1);
+      break;
+    case disasm::CALL:
+      spill();
+      calleeArg(a);
+      a.movRI(rsi, at);
+      a.movRI(rdx, insn.imm);
+      a.movRI(rcx, insn.length);
+      a.call((const void*)&emu::jitCall);
+      epilogue((uint32_t)i + 1);
+      break;
+    case disasm::RET:
+      a.storeImm(eipField, at);
+      spill();
+      calleeArg(a);
+      a.call((const void*)&emu::jitRet);
+      epilogue((uint32_t)i + 1);
+      break;
+    default:
+      break;
+    }
+
+    at = next;
+  }
+
+  // ran out of instructions the JIT knows, or of the block
+  auto last = disasm::info(block.insns[count - 1].id).type;
+  if (last != disasm::JMP && last != disasm::CALL && last != disasm::RET) {
+    a.storeImm(eipField, at);
+    spill();
+    epilogue((uint32_t)count);
+  }
+
+  for (auto& e : exits) {
+    a.patch(e.at, a.out.size());
+    a.storeImm(eipField, e.eip);
+    epilogue(e.ran);
+  }
+
+  auto code = jitCode.append(a.out);
+  if (!code) {
+    // full, start over, nothing compiled survives that
+    for (auto& [_, b] : cache.blocks) {
+      b.native = nullptr;
+      b.jitted = 0;
+      b.runs   = 0;
+    }
+    jitCode.reset();
+    code = jitCode.append(a.out);
+    if (!code) return;
+  }
+
+  block.native = (nativeBlock)code;
+  block.jitted = (uint32_t)count;
+  cache.compiled++;
+#else
+  (void)block;
+  (void)eip;
+#endif
+}
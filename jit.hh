@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+///
+/// Guest blocks are compiled to host code on x86-64 System V hosts,
+/// everywhere else, or with IMP_NO_JIT, the interpreter runs them
+///
+#if defined(__x86_64__) && defined(__unix__) && !defined(__APPLE__) && !defined(IMP_NO_JIT)
+#define IMP_JIT
+#endif
+
+namespace jit {
+  ///
+  /// Executable memory that compiled blocks are appended to. Never
+  /// writable and executable at once: pages are made writable for the
+  /// copy, then executable again
+  ///
+  struct codeBuffer {
+    static constexpr size_t capacity = 0x400000;
+
+    codeBuffer();
+    ~codeBuffer();
+
+    codeBuffer& operator=(const codeBuffer&) = delete;
+    codeBuffer(const codeBuffer&)            = delete;
+
+    /// Copies code in, nullptr if it doesn't fit, or there's no
+    /// executable memory to begin with
+    const void* append(std::span<const uint8_t> code) noexcept;
+
+    /// Forgets everything appended, whatever points into it must
+    /// have been dropped
+    void reset() noexcept {
+      used = 0;
+    }
+
+    size_t size() const noexcept {
+      return used;
+    }
+
+private:
+    uint8_t* base = nullptr;
+    size_t   used = 0;
+  };
+} // namespace jit
@@ -0,0 +1,285 @@
+#include "lockstep.hh"
+#include <algorithm>
+#include <cstring>
+
+using namespace lockstep;
+
+namespace {
+  using flagOp = emu::softCPU::flagOp;
+} // namespace
+
+runner::runner(disasm::memoryViewType image, uint32_t ep, size_t lanes)
+    : detachedLanes(lanes, 0), codePages(::emu::softCPU::addressSpace / ::emu::cachePageSize) {
+  emus.reserve(lanes);
+  for (size_t i = 0; i < lanes; i++) {
+    emus.push_back(std::make_unique<::emu>(image, ep));
+    emus.back()->onWrite = [this, i](uint32_t address, size_t n) {
+      noteWrite(i, address, n);
+    };
+  }
+}
+
+size_t runner::run(size_t limit) {
+  group  g {};
+  size_t ran = 0;
+  for (size_t first = 0; first < lanes(); first += width) {
+    // lanes past the end are there, but never run
+    for (size_t l = 0; l < width; l++) {
+      bool exists = first + l < lanes();
+      if (exists) loadLane(g, l, emus[first + l]->cpu);
+      g.live[l]   = exists && !detachedLanes[first + l] ? ~0u : 0;
+    }
+
+    ran += runGroup(first, g, limit);
+    for (size_t l = 0; l < width && first + l < lanes(); l++) storeLane(g, l, emus[first + l]->cpu);
+  }
+  return ran;
+}
+
+void runner::loadLane(group& g, size_t l, const ::emu::softCPU& cpu) noexcept {
+  for (size_t r = 0; r < proc::gpr::GPR_MAX; r++) g.gprs[r][l] = cpu.gprs[r];
+  g.eip[l]        = cpu.eip;
+  g.flags[l]      = cpu.flags;
+  g.lazyOp[l]     = (uint32_t)cpu.lazy.op;
+  g.lazySize[l]   = cpu.lazy.size;
+  g.lazyDst[l]    = cpu.lazy.dst;
+  g.lazySrc[l]    = cpu.lazy.src;
+  g.lazyResult[l] = cpu.lazy.result;
+}
+
+void runner::storeLane(const group& g, size_t l, ::emu::softCPU& cpu) noexcept {
+  for (size_t r = 0; r < proc::gpr::GPR_MAX; r++) cpu.gprs[r] = g.gprs[r][l];
+  cpu.eip         = g.eip[l];
+  cpu.flags       = g.flags[l];
+  cpu.lazy.op     = (flagOp)g.lazyOp[l];
+  cpu.lazy.size   = (uint8_t)g.lazySize[l];
+  cpu.lazy.dst    = g.lazyDst[l];
+  cpu.lazy.src    = g.lazySrc[l];
+  cpu.lazy.result = g.lazyResult[l];
+}
+
+size_t runner::runGroup(size_t first, group& g, size_t limit) {
+  auto count = [](lanes32 on) {
+    size_t n = 0;
+    for (size_t l = 0; l < width; l++) n += on[l] & 1;
+    return n;
+  };
+
+  size_t ran = 0, steps = 0;
+  while (steps < limit) {
+    evict();
+
+    // the lanes furthest behind go
+    uint64_t leader = UINT64_MAX;
+    for (size_t l = 0; l < width; l++) {
+      if (g.live[l]) leader = std::min<uint64_t>(leader, g.eip[l]);
+    }
+    if (leader == UINT64_MAX) break;
+
+    lanes32 on   = g.live & equal(g.eip, splat((uint32_t)leader));
+    size_t  some = 0;
+    while (!on[some]) some++;
+
+    // lanes detached decoding it don't go on
+    const auto& block = decode((uint32_t)leader, first + some);
+    for (size_t l = 0; l < width && first + l < lanes(); l++) {
+      if (detachedLanes[first + l]) g.live[l] = 0;
+    }
+    on = on & g.live;
+
+    if (block.insns.empty()) {
+      g.live = g.live & ~on;
+      continue;
+    }
+
+    // lanes in on stay together to the end of the block, but for
+    // those stopping
+    for (size_t i = 0; i < block.insns.size() && steps < limit && count(on); i++, steps++) {
+      if (vectorStep(g, on, block.insns[i])) {
+        ran += count(on);
+        continue;
+      }
+
+      for (size_t l = 0; l < width; l++) {
+        if (on[l] && laneStep(first + l, g, l, block.insns[i])) ran++;
+      }
+      on = on & g.live;
+    }
+  }
+
+  return ran;
+}
+
+const runner::block& runner::decode(uint32_t eip, size_t lane) {
+  if (auto it = decoded.find(eip); it != decoded.end()) return it->second;
+
+  block                b;
+  auto                 memory = emus[lane]->cpu.memoryAt(eip);
+  disasm::disassembler ds(memory, eip);
+  b.end = eip;
+  while (b.insns.size() < ::emu::maxBlockInsns) {
+    auto insn = ds.next();
+    if (!insn.valid()) break;
+
+    b.insns.push_back(insn);
+    b.end += insn.length;
+
+    auto type = disasm::info(insn.id).type;
+    if (type == disasm::CALL || type == disasm::JMP || type == disasm::RET) break;
+  }
+
+  // what didn't decode is as long as an instruction can be. Lanes
+  // with other bytes run other code, from here on write tracking
+  // keeps the rest the same
+  if (b.insns.empty() && eip < memory.size()) {
+    b.end = eip + (uint32_t)std::min(disasm::maxInsnLength, memory.size() - eip);
+  }
+  for (size_t other = 0; b.end > eip && other < lanes(); other++) {
+    if (detachedLanes[other] || other == lane) continue;
+    auto bytes = emus[other]->cpu.memoryAt(eip);
+    if (bytes.size() < b.end || memcmp(bytes.data() + eip, memory.data() + eip, b.end - eip)) detachedLanes[other] = 1;
+  }
+
+  for (auto page = eip / ::emu::cachePageSize; b.end > eip && page <= (b.end - 1) / ::emu::cachePageSize; page++) {
+    codePages[page] = 1;
+  }
+  return decoded.emplace(eip, std::move(b)).first->second;
+}
+
+void runner::noteWrite(size_t lane, uint32_t address, size_t n) {
+  for (auto page = address / ::emu::cachePageSize; page <= (address + n - 1) / ::emu::cachePageSize; page++) {
+    if (!codePages[page]) continue;
+
+    // wrote over decoded code, its own from now on
+    detachedLanes[lane] = 1;
+    written.push_back((uint32_t)page);
+  }
+}
+
+void runner::evict() {
+  if (written.empty()) return;
+
+  // the rest decode them again, from their own memory
+  for (auto page : written) codePages[page] = 0;
+  std::erase_if(decoded, [&](const auto& entry) {
+    uint32_t eip = entry.first, end = entry.second.end;
+    for (auto page = eip / ::emu::cachePageSize; end > eip && page <= (end - 1) / ::emu::cachePageSize; page++) {
+      if (!codePages[page]) return true;
+    }
+    return false;
+  });
+  written.clear();
+}
+
+bool runner::vectorStep(group& g, lanes32 on, const disasm::insn& insn) noexcept {
+  using enum disasm::operandForm;
+  auto info = disasm::info(insn.id);
+  if (info.bits != 32 || (disasm::hasModRM(info.form) && insn.isMemory())) return false;
+
+  uint32_t imm = info.form == rmImm8 ? (uint8_t)insn.imm : insn.imm;
+  auto&    dst = g.gprs[insn.gpr()];
+
+  // what inc/dec/adc need before they record themselves, like
+  // softCPU::eflags()
+  auto resolve = [&] {
+    for (size_t l = 0; l < width; l++) {
+      if (!on[l]) continue;
+      g.flags[l]  = ::emu::softCPU::resolveFlags(g.flags[l], (flagOp)g.lazyOp[l], (uint8_t)g.lazySize[l],
+                                                 g.lazyDst[l], g.lazySrc[l], g.lazyResult[l]);
+      g.lazyOp[l] = (uint32_t)flagOp::none;
+    }
+  };
+
+  // f(dst, n) on the lanes in on, recorded like emu::recordFlags
+  auto alu = [&](flagOp op, bool writes, lanes32 n, auto f) {
+    bool    logic  = op == flagOp::logic;
+    lanes32 before = dst, result = f(before, n);
+    if (writes) dst = pick(on, result, before);
+    g.lazyOp     = pick(on, splat((uint32_t)op), g.lazyOp);
+    g.lazySize   = pick(on, splat(4), g.lazySize);
+    g.lazyDst    = pick(on, logic ? splat(0) : before, g.lazyDst);
+    g.lazySrc    = pick(on, logic ? splat(0) : n, g.lazySrc);
+    g.lazyResult = pick(on, result, g.lazyResult);
+  };
+
+  auto plus = [](lanes32 a, lanes32 b) {
+    return a + b;
+  };
+  auto minus = [](lanes32 a, lanes32 b) {
+    return a - b;
+  };
+  auto both = [](lanes32 a, lanes32 b) {
+    return a & b;
+  };
+
+  switch (info.type) {
+  case disasm::MOV:
+    if (info.form == rmReg) dst = pick(on, g.gprs[insn.gpr2()], dst);
+    else if (info.form == regRm)
+      g.gprs[insn.gpr2()] = pick(on, dst, g.gprs[insn.gpr2()]);
+    else
+      dst = pick(on, splat(imm), dst);
+    break;
+  case disasm::ADD:
+    alu(flagOp::add, true, splat(imm), plus);
+    break;
+  case disasm::SUB:
+    alu(flagOp::sub, true, splat(imm), minus);
+    break;
+  case disasm::CMP:
+    alu(flagOp::sub, false, splat(imm), minus);
+    break;
+  case disasm::AND:
+    alu(flagOp::logic, true, splat(imm), both);
+    break;
+  case disasm::OR:
+    alu(flagOp::logic, true, splat(imm), [](lanes32 a, lanes32 b) {
+      return a | b;
+    });
+    break;
+  case disasm::XOR:
+    alu(flagOp::logic, true, splat(imm), [](lanes32 a, lanes32 b) {
+      return a ^ b;
+    });
+    break;
+  case disasm::TEST:
+    alu(flagOp::logic, false, g.gprs[insn.gpr2()], both);
+    break;
+  case disasm::INC:
+    resolve();
+    alu(flagOp::inc, true, splat(1), plus);
+    break;
+  case disasm::DEC:
+    resolve();
+    alu(flagOp::dec, true, splat(1), minus);
+    break;
+  case disasm::ADC: {
+    // carry in, with the interpreter's wrap at the immediate's width
+    resolve();
+    lanes32 n = splat(imm) + (g.flags & splat(proc::flags::carryFlag));
+    if (info.form == rmImm8) n = n & splat(0xff);
+    alu(flagOp::add, true, n, plus);
+    break;
+  }
+  case disasm::JMP:
+    g.eip = pick(on, splat(insn.imm), g.eip);
+    return true;
+  default:
+    // memory: push, pop, call, ret
+    return false;
+  }
+
+  g.eip = g.eip + (on & splat(insn.length));
+  return true;
+}
+
+bool runner::laneStep(size_t lane, group& g, size_t l, const disasm::insn& insn) {
+  auto& e = *emus[lane];
+  storeLane(g, l, e.cpu);
+  bool ran = e.step(insn);
+  loadLane(g, l, e.cpu);
+
+  // detached by noteWrite
+  if (!ran || detachedLanes[lane]) g.live[l] = 0;
+  return ran;
+}
@@ -0,0 +1,188 @@
+#pragma once
+
+#include "emu.hh"
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+namespace lockstep {
+  ///
+  /// Lanes run side by side, a vector register's worth of 32-bit
+  /// registers: 16 with AVX-512, 8 with AVX2, 4 in SSE/NEON ones
+  ///
+#if defined(__AVX512F__)
+  constexpr size_t width = 16;
+#elif defined(__AVX2__)
+  constexpr size_t width = 8;
+#else
+  constexpr size_t width = 4;
+#endif
+
+  ///
+  /// A 32-bit value per lane. With GCC/clang a vector, and operators
+  /// are SIMD instructions of the target. Elsewhere, or with
+  /// IMP_NO_SIMD, an array and loops over it
+  ///
+#if defined(__GNUC__) && !defined(IMP_NO_SIMD)
+  using lanes32 = uint32_t __attribute__((vector_size(width * sizeof(uint32_t))));
+
+  inline lanes32 splat(uint32_t n) noexcept {
+    return lanes32 {} + n;
+  }
+
+  /// All ones in the lanes where a and b are equal
+  inline lanes32 equal(lanes32 a, lanes32 b) noexcept {
+    return (lanes32)(a == b);
+  }
+#else
+  struct lanes32 {
+    uint32_t n[width];
+
+    uint32_t& operator[](size_t l) noexcept {
+      return n[l];
+    }
+
+    uint32_t operator[](size_t l) const noexcept {
+      return n[l];
+    }
+  };
+
+#define IMP_LOCKSTEP_OP(op)                                                                                            \
+  inline lanes32 operator op(lanes32 a, lanes32 b) noexcept {                                                          \
+    for (size_t l = 0; l < width; l++) a[l] = a[l] op b[l];                                                            \
+    return a;                                                                                                          \
+  }
+  IMP_LOCKSTEP_OP(+)
+  IMP_LOCKSTEP_OP(-)
+  IMP_LOCKSTEP_OP(&)
+  IMP_LOCKSTEP_OP(|)
+  IMP_LOCKSTEP_OP(^)
+#undef IMP_LOCKSTEP_OP
+
+  inline lanes32 operator~(lanes32 a) noexcept {
+    for (size_t l = 0; l < width; l++) a[l] = ~a[l];
+    return a;
+  }
+
+  inline lanes32 splat(uint32_t n) noexcept {
+    lanes32 out;
+    for (size_t l = 0; l < width; l++) out[l] = n;
+    return out;
+  }
+
+  inline lanes32 equal(lanes32 a, lanes32 b) noexcept {
+    for (size_t l = 0; l < width; l++) a[l] = a[l] == b[l] ? ~0u : 0;
+    return a;
+  }
+#endif
+
+  /// a where on is all ones, b where it's 0
+  inline lanes32 pick(lanes32 on, lanes32 a, lanes32 b) noexcept {
+    return (a & on) | (b & ~on);
+  }
+
+  ///
+  /// Many guests running the same code on different data. Every lane
+  /// is an emu, for its memory, and for setting it up and reading it
+  /// back. While running, the registers of each group of width lanes
+  /// are kept as one lanes32 per register, and instructions are
+  /// decoded once and run on every lane at their eip at the same time.
+  ///
+  /// Lanes at other eips are masked out; the lowest eip goes first,
+  /// so lanes behind catch up with the rest. 32-bit register
+  /// instructions run across lanes, the rest, anything touching
+  /// memory, on each lane's emu in turn.
+  ///
+  /// Code is decoded once and shared. A lane whose bytes aren't the
+  /// ones decoded, or that writes over code that was decoded, is
+  /// detached: its emu has its state, and it's left out of lockstep
+  /// from then on. Code changed through lane() is only seen where it
+  /// wasn't decoded yet
+  ///
+  struct runner {
+    runner(disasm::memoryViewType image, uint32_t ep, size_t lanes);
+
+    runner& operator=(const runner&) = delete;
+    runner(const runner&)            = delete;
+
+    size_t lanes() const noexcept {
+      return emus.size();
+    }
+
+    /// Lane i, up to date outside of run
+    ::emu& lane(size_t i) noexcept {
+      return *emus[i];
+    }
+
+    bool detached(size_t i) const noexcept {
+      return detachedLanes[i];
+    }
+
+    ///
+    /// Steps every group of lanes limit times, or until none of its
+    /// lanes can go on. Lanes stop at faults and at what doesn't
+    /// decode, with eip on it. Returns how many instructions ran,
+    /// summed over lanes
+    ///
+    size_t run(size_t limit);
+
+private:
+    /// Registers of width lanes, lane l of each is lane l's
+    struct group {
+      lanes32 gprs[proc::gpr::GPR_MAX];
+      lanes32 eip;
+      lanes32 flags;
+      /// softCPU::lazy, a field each
+      lanes32 lazyOp;
+      lanes32 lazySize;
+      lanes32 lazyDst;
+      lanes32 lazySrc;
+      lanes32 lazyResult;
+      /// All ones while the lane runs, 0 once it stopped
+      lanes32 live;
+    };
+
+    /// Instructions from eip up to a call/jmp/ret, like emu's blocks
+    struct block {
+      std::vector<disasm::insn> insns;
+      /// End of what they were decoded from, or of what didn't decode
+      uint32_t end;
+    };
+
+    /// Lane l of g from a softCPU, and back
+    static void loadLane(group& g, size_t l, const ::emu::softCPU& cpu) noexcept;
+    static void storeLane(const group& g, size_t l, ::emu::softCPU& cpu) noexcept;
+
+    /// Steps the group of lanes from first on, see run
+    size_t runGroup(size_t first, group& g, size_t limit);
+
+    ///
+    /// The block at eip, decoded from lane's memory if it's new. The
+    /// other lanes with other bytes there are detached. No insns if
+    /// nothing decodes at eip
+    ///
+    const block& decode(uint32_t eip, size_t lane);
+
+    /// A lane's emu wrote n bytes at address
+    void noteWrite(size_t lane, uint32_t address, size_t n);
+
+    /// Drops the blocks on pages written over
+    void evict();
+
+    /// Runs insn on the lanes in on, returns false if it isn't
+    /// one that runs across lanes
+    static bool vectorStep(group& g, lanes32 on, const disasm::insn& insn) noexcept;
+
+    /// Runs insn on lane l of g through its emu, false on a fault
+    bool laneStep(size_t lane, group& g, size_t l, const disasm::insn& insn);
+
+    std::vector<std::unique_ptr<::emu>> emus;
+    std::vector<uint8_t>                detachedLanes;
+    std::unordered_map<uint32_t, block> decoded;
+    /// Per page of memory, whether a block was decoded from it
+    std::vector<uint8_t> codePages;
+    /// Pages of decoded code written over, until evict
+    std::vector<uint32_t> written;
+  };
+} // namespace lockstep
@@ -2,8 +2,23 @@
 #include "proc.hh"
 #include "disasm.hh"
 #include "emu.hh"
+#include "sweep.hh"
+#include "cfg.hh"
+#include "xref.hh"
+#include "stream.hh"
+#include "fmt.hh"
+#include "index.hh"
+#include "patch.hh"
+#include "pool.hh"
+#include "batch.hh"
+#include "lockstep.hh"
+#include <atomic>
+#include <cstddef>
 #include <cstdio>
+#include <cstring>
 #include <string>
+#include <vector>
+#include <algorithm>
 #include <source_location>
 #include <assert.h>
 
@@ -28,6 +43,46 @@ namespace test {
     fail();                                                                                                            \
   }
 
+  namespace utl {
+    void testWorkPool() {
+      announce("testWorkPool");
+
+      std::atomic<size_t> sum = 0;
+      {
+        ::utl::workPool pool(4);
+        TEST(pool.size() == 4);
+
+        // tasks splitting themselves up, like the driver does
+        for (size_t i = 0; i < 100; i++) {
+          pool.submit([&, i] {
+            for (size_t j = 0; j < 10; j++) {
+              pool.submit([&, i, j] {
+                sum += i * 10 + j;
+              });
+            }
+          });
+        }
+        pool.wait();
+        TEST(sum == 999 * 1000 / 2);
+
+        // usable again after waiting
+        pool.submit([&] {
+          sum = 0;
+        });
+        pool.wait();
+        TEST(sum == 0);
+
+        // the destructor waits too
+        pool.submit([&] {
+          sum = 1;
+        });
+      }
+      TEST(sum == 1);
+
+      announce("testWorkPool finished");
+    }
+  } // namespace utl
+
   namespace disasm {
     void testGprMapping() {
       announce("testGprMapping");
@@ -261,6 +316,685 @@ namespace test {
 
       announce("testTest finished");
     }
+
+    void testGroups() {
+      announce("testGroups");
+
+      const uint8_t code[] = {
+          0x83, 0xe3, 0x0f, // and ebx, 0xf
+          0x83, 0xd7, 0x01, // adc edi, 1
+          0x85, 0xfe,       // test esi, edi
+          0x83, 0xd8, 0x01, // sbb eax, 1 (unsupported)
+      };
+
+      ::disasm::disassembler d(code);
+      auto                   v = d.consume();
+      auto                   x = std::get_if<::disasm::andReg32Imm8>(&v);
+      TEST(x);
+      TEST(x->gpr == proc::gpr::ebx);
+      TEST(x->imm == 0xf);
+      TEST(d.length() == 3);
+      auto v2 = d.consume();
+      auto x2 = std::get_if<::disasm::adcReg32Imm8>(&v2);
+      TEST(x2);
+      TEST(x2->gpr == proc::gpr::edi);
+      auto v3 = d.consume();
+      auto x3 = std::get_if<::disasm::testReg32Reg32>(&v3);
+      TEST(x3);
+      TEST(x3->gpr == proc::gpr::esi);
+      TEST(x3->gpr2 == proc::gpr::edi);
+      auto v4 = d.consume();
+      TEST(std::holds_alternative<::disasm::none>(v4));
+      TEST(d.length() == 0);
+
+      announce("testGroups finished");
+    }
+
+    void testAlu() {
+      announce("testAlu");
+
+      const uint8_t code[] = {
+          0x83, 0xe9, 0x01,       // sub ecx, 1
+          0x66, 0x83, 0xfa, 0x02, // cmp dx, 2
+          0x83, 0xf0, 0x03,       // xor eax, 3
+          0x83, 0xcb, 0x04,       // or ebx, 4
+          0xc3,                   // ret
+      };
+
+      ::disasm::disassembler d(code);
+      auto                   v = d.consume();
+      auto                   x = std::get_if<::disasm::subReg32Imm8>(&v);
+      TEST(x);
+      TEST(x->gpr == proc::gpr::ecx);
+      TEST(x->imm == 1);
+      auto v2 = d.consume();
+      auto x2 = std::get_if<::disasm::cmpReg16Imm8>(&v2);
+      TEST(x2);
+      TEST(x2->gpr == proc::gpr::edx);
+      TEST(x2->imm == 2);
+      TEST(d.length() == 4);
+      auto v3 = d.consume();
+      auto x3 = std::get_if<::disasm::xorReg32Imm8>(&v3);
+      TEST(x3);
+      TEST(x3->gpr == proc::gpr::eax);
+      auto v4 = d.consume();
+      auto x4 = std::get_if<::disasm::orReg32Imm8>(&v4);
+      TEST(x4);
+      TEST(x4->gpr == proc::gpr::ebx);
+      auto v5 = d.consume();
+      TEST(std::holds_alternative<::disasm::retNear32>(v5));
+      TEST(d.length() == 1);
+      auto v6 = d.consume();
+      TEST(std::holds_alternative<::disasm::none>(v6));
+
+      announce("testAlu finished");
+    }
+
+    void testDecodeRange() {
+      announce("testDecodeRange");
+
+      const uint8_t code[] = {
+          0xb9, 0x11, 0x22, 0x33, 0x44, // mov ecx, 0x44332211
+          0x85, 0xc8,                   // test eax, ecx
+          0xf4,                         // hlt (unsupported)
+          0x05, 0x01, 0x00, 0x00, 0x00, // add eax, 1
+          0xe9, 0xf0, 0xff, 0xff, 0xff, // jmp 2
+      };
+
+      ::disasm::insnBuffer out(16);
+      auto                 end = ::disasm::decodeRange(code, out);
+      TEST(end == sizeof(code));
+      TEST(out.size() == 5);
+      TEST(out.kinds[0] == ::disasm::kind::movReg32);
+      TEST(out.gprs[0] == proc::gpr::ecx);
+      TEST(out.imms[0] == 0x44332211);
+      TEST(out.lengths[0] == 5);
+      TEST(out.kinds[1] == ::disasm::kind::testReg32Reg32);
+      TEST(out.gprs[1] == proc::gpr::eax);
+      TEST(out.gprs2[1] == proc::gpr::ecx);
+      TEST(out.kinds[2] == ::disasm::kind::none);
+      TEST(out.lengths[2] == 1);
+      TEST(out.kinds[3] == ::disasm::kind::addEaxImm32);
+      TEST(out.gprs[3] == proc::gpr::eax);
+      TEST(out.offsets[4] == 13);
+      TEST(out.kinds[4] == ::disasm::kind::jmpNear32);
+      TEST(out.targets[4] == 2);
+
+      // stops once full, and picks up where it left
+      ::disasm::insnBuffer small(2);
+      auto                 mid = ::disasm::decodeRange(code, small);
+      TEST(mid == 7);
+      TEST(small.size() == 2);
+      ::disasm::decodeRange(code, small, mid);
+      TEST(small.kinds[1] == ::disasm::kind::addEaxImm32);
+
+      announce("testDecodeRange finished");
+    }
+
+    void testInsn() {
+      announce("testInsn");
+
+      const uint8_t code[] = {
+          0x66, 0x85, 0xd7,       // test di, dx
+          0x66, 0x6a, 0x80,       // pushw 0x0080
+          0xe8, 0xfb, 0xff, 0xff, // call 1 (truncated)
+      };
+
+      ::disasm::disassembler d(code);
+      auto                   i = d.next();
+      TEST(sizeof(i) == 16);
+      TEST(i.id == ::disasm::kind::testReg16Reg16);
+      TEST(i.length == 3);
+      TEST(i.gpr() == proc::gpr::edi);
+      TEST(i.gpr2() == proc::gpr::edx);
+      TEST(i.flags & ::disasm::insnFlags::operandSize16);
+      auto v = i.toRet();
+      auto x = std::get_if<::disasm::testReg16Reg16>(&v);
+      TEST(x);
+      TEST(x->gpr == proc::gpr::edi);
+      TEST(x->gpr2 == proc::gpr::edx);
+      auto i2 = d.next();
+      TEST(i2.id == ::disasm::kind::pushImm16From8);
+      TEST(i2.imm == 0x80);
+      auto v2 = i2.toRet();
+      TEST(std::get_if<::disasm::pushImm16From8>(&v2)->imm == 0x80);
+      auto i3 = d.next();
+      TEST(!i3.valid());
+      TEST(i3.length == 0);
+      TEST(std::holds_alternative<::disasm::none>(i3.toRet()));
+
+      announce("testInsn finished");
+    }
+
+    void testPrefixes() {
+      announce("testPrefixes");
+
+      const uint8_t code[] = {
+          0xf0, 0x2e, 0x67, 0x66, 0x83, 0xc0, 0x01, // lock cs: add ax, 1
+          0x66, 0x66, 0xb8, 0x11, 0x22,             // mov ax, 0x2211 (repeated prefix)
+          0xf2, 0x64, 0xf3, 0x65, 0x40,             // rep gs: inc eax (last of a group wins)
+      };
+
+      ::disasm::disassembler d(code);
+      auto                   i = d.next();
+      TEST(i.id == ::disasm::kind::addReg16Imm8);
+      TEST(i.length == 7);
+      TEST(i.flags & ::disasm::insnFlags::lockPrefix);
+      TEST(i.flags & ::disasm::insnFlags::addressSize16);
+      TEST(i.segmentOverride() == ::disasm::segment::cs);
+      auto i2 = d.next();
+      TEST(i2.id == ::disasm::kind::movReg16);
+      TEST(i2.imm == 0x2211);
+      TEST(i2.length == 5);
+      auto i3 = d.next();
+      TEST(i3.id == ::disasm::kind::incReg32);
+      TEST(i3.flags & ::disasm::insnFlags::repPrefix);
+      TEST(!(i3.flags & ::disasm::insnFlags::repnePrefix));
+      TEST(i3.segmentOverride() == ::disasm::segment::gs);
+      TEST(!d.next().valid());
+
+      // no more than 15 bytes in total
+      uint8_t tooLong[16];
+      memset(tooLong, 0x66, sizeof(tooLong));
+      tooLong[14] = 0x40; // inc ax, 15 bytes
+      TEST(::disasm::disassembler(tooLong).next().length == 15);
+      tooLong[14] = 0xb8; // mov ax, imm16, 17 bytes
+      TEST(!::disasm::disassembler(tooLong).next().valid());
+      tooLong[14] = 0x66;
+      tooLong[15] = 0x40; // inc ax, 16 bytes
+      TEST(!::disasm::disassembler(tooLong).next().valid());
+
+      announce("testPrefixes finished");
+    }
+
+    void testParallel() {
+      announce("testParallel");
+
+      // dense mix of everything we decode, plus junk
+      const uint8_t pool[] = {0x66, 0x67, 0xf0, 0x2e, 0x6a, 0x68, 0x50, 0x58, 0xb8, 0x83,
+                              0xc0, 0xd0, 0x81, 0x05, 0x40, 0x48, 0x85, 0xe8, 0xe9, 0xc3,
+                              0x00, 0xff, 0x11, 0xf4};
+      std::vector<uint8_t> code(0x4000);
+      uint32_t             seed = 0x1234;
+      for (auto& b : code) {
+        seed = seed * 1103515245 + 12345;
+        b    = pool[(seed >> 16) % sizeof(pool)];
+      }
+
+      ::disasm::insnBuffer expected(code.size());
+      ::disasm::decodeRange(code, expected);
+
+      auto same = [&](const auto& a, const auto& b) {
+        return std::equal(a.begin(), a.begin() + expected.size(), b.begin());
+      };
+
+      for (size_t threads : {1, 3, 8}) {
+        for (size_t minChunk : {16, 100, 0x1000}) {
+          ::disasm::insnBuffer out;
+          auto                 end = ::disasm::decodeRangeParallel(code, out, threads, minChunk);
+          TEST(end == code.size());
+          TEST(out.size() == expected.size());
+          TEST(same(out.kinds, expected.kinds));
+          TEST(same(out.offsets, expected.offsets));
+          TEST(same(out.lengths, expected.lengths));
+          TEST(same(out.imms, expected.imms));
+          TEST(same(out.targets, expected.targets));
+        }
+      }
+
+      announce("testParallel finished");
+    }
+
+    void testRecursiveDescent() {
+      announce("testRecursiveDescent");
+
+      const uint8_t code[] = {
+          0xe8, 0x0a, 0x00, 0x00, 0x00,                   // 0:  call 15
+          0xb8, 0x01, 0x00, 0x00, 0x00,                   // 5:  mov eax, 1
+          0xe9, 0x0b, 0x00, 0x00, 0x00,                   // 10: jmp 26
+          0x40,                                           // 15: inc eax
+          0xc3,                                           // 16: ret
+          0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, // 17: data
+          0x99,                                           //
+          0x48,                                           // 26: dec eax
+          0xe9, 0xea, 0xff, 0xff, 0xff,                   // 27: jmp 10
+      };
+
+      const uint32_t entries[] = {0};
+      auto           g         = ::disasm::recursiveDescent(code, entries);
+
+      // data is never decoded
+      TEST(g.insns.size() == 7);
+      TEST(g.insnAt(17) == g.npos);
+
+      // the jmp back into the middle of [5, 15) splits it
+      TEST(g.blockCount() == 5);
+      const uint32_t starts[] = {0, 5, 10, 15, 26};
+      const uint32_t ends[]   = {5, 10, 15, 17, 32};
+      for (size_t i = 0; i < 5; i++) {
+        TEST(g.blockStarts[i] == starts[i]);
+        TEST(g.blockEnds[i] == ends[i]);
+      }
+      TEST(g.blockAt(12) == 2);
+      TEST(g.blockAt(20) == g.npos);
+
+      auto s0 = g.successors(0);
+      TEST(s0.size() == 1 && s0[0] == 1);
+      auto c0 = g.callees(0);
+      TEST(c0.size() == 1 && c0[0] == 3);
+      TEST(g.successors(1).size() == 1 && g.successors(1)[0] == 2);
+      TEST(g.successors(2).size() == 1 && g.successors(2)[0] == 4);
+      TEST(g.successors(3).empty());
+      auto p2 = g.predecessors(2);
+      TEST(p2.size() == 2);
+
+      // function at 0 and the one it calls at 15
+      TEST(g.funcEntries.size() == 2);
+      TEST(g.funcEntries[0] == 0);
+      TEST(g.functionBlocks(0).size() == 4);
+      TEST(g.funcEntries[1] == 3);
+      TEST(g.functionBlocks(1).size() == 1);
+
+      announce("testRecursiveDescent finished");
+    }
+
+    void testXrefs() {
+      announce("testXrefs");
+
+      std::vector<uint8_t> code(0x1000, 0x90);
+      auto                 put = [&](uint32_t at, uint8_t opcode, uint32_t target) {
+        code[at] = opcode;
+        uint32_t rel = target - (at + 5);
+        memcpy(&code[at + 1], &rel, 4);
+      };
+
+      put(0x10, 0xe8, 0x800);  // call 0x800
+      put(0x123, 0xe8, 0x800); // call 0x800
+      put(0x200, 0xe9, 0x40);  // jmp 0x40
+      put(0x3f1, 0xe8, 0x800); // call 0x800, straddling SIMD blocks
+      put(0x500, 0xe8, 0x5000);         // out of the image
+      put(0xffb - 0x10, 0xe9, 0x800);   // jmp 0x800, near the tail
+      code[0xffe] = 0xe8;               // no room for a displacement
+
+      for (auto level : {::disasm::simdLevel::scalar, ::disasm::simdLevel::sse2, ::disasm::simdLevel::avx2,
+                         ::disasm::simdLevel::best}) {
+        auto x = ::disasm::scanXrefs(code, level);
+        TEST(x.size() == 5);
+        auto callers = x.sourcesOf(0x800);
+        TEST(callers.size() == 4);
+        TEST(callers[0] == 0x10);
+        TEST(callers[1] == 0x123);
+        TEST(callers[2] == 0x3f1);
+        TEST(callers[3] == 0xffb - 0x10);
+        auto [b, e] = x.range(0x40);
+        TEST(e - b == 1);
+        TEST(x.sources[b] == 0x200);
+        TEST(!x.isCall[b]);
+        TEST(!x.isTarget(0x5000));
+        TEST(!x.isTarget(0x41));
+      }
+
+      announce("testXrefs finished");
+    }
+
+    void testStream() {
+      announce("testStream");
+
+      const uint8_t pool[] = {0x66, 0xf3, 0x6a, 0x68, 0x50, 0xb8, 0x83, 0xc0, 0x81,
+                              0x05, 0x85, 0xe8, 0xe9, 0xc3, 0x00, 0xff, 0x11};
+      std::vector<uint8_t> code(0x5123);
+      uint32_t             seed = 0x4321;
+      for (auto& b : code) {
+        seed = seed * 1103515245 + 12345;
+        b    = pool[(seed >> 16) % sizeof(pool)];
+      }
+
+      ::disasm::insnBuffer expected(code.size());
+      ::disasm::decodeRange(code, expected);
+
+      auto check = [&](::disasm::streamDisassembler& s) {
+        ::disasm::insn i;
+        uint64_t       offset;
+        size_t         n    = 0;
+        bool           same = true;
+        while (s.next(i, offset)) {
+          ::disasm::insnBuffer one(1);
+          one.store(0, offset, i);
+          same = same && n < expected.size() && offset == expected.offsets[n] && i.id == expected.kinds[n]
+              && one.lengths[0] == expected.lengths[n] && one.imms[0] == expected.imms[n]
+              && one.targets[0] == expected.targets[n];
+          n++;
+        }
+        return same && n == expected.size();
+      };
+
+      // odd chunk sizes, so instructions keep straddling them
+      for (size_t chunk : {1, 7, 100, 0x10000}) {
+        size_t                       at = 0;
+        ::disasm::streamDisassembler s(
+            [&](uint8_t* dst, size_t size) {
+              // short reads too
+              size_t n = std::min({size, code.size() - at, (size_t)37});
+              memcpy(dst, &code[at], n);
+              at += n;
+              return n;
+            },
+            chunk);
+        TEST(check(s));
+      }
+
+      const char* path = "imp_stream_test.bin";
+      auto*       f    = fopen(path, "wb");
+      fwrite(code.data(), 1, code.size(), f);
+      fclose(f);
+      for (size_t window : {1, 0x1000, 0x100000}) {
+        ::disasm::streamDisassembler s(path, window);
+        TEST(s.ok());
+        TEST(check(s));
+      }
+      remove(path);
+
+      ::disasm::streamDisassembler missing("imp_does_not_exist.bin");
+      TEST(!missing.ok());
+
+      announce("testStream finished");
+    }
+
+    void testFormat() {
+      announce("testFormat");
+
+      const uint8_t code[] = {
+          0xb8, 0x11, 0x22, 0x33, 0x44, // mov eax, 0x44332211
+          0xf0, 0x66, 0x83, 0xc0, 0x01, // lock add ax, 0x1
+          0x66, 0x85, 0xc1,             // test cx, ax
+          0x6a, 0x00,                   // push 0x0
+          0xf4,                         // (bad)
+          0xe8, 0xeb, 0xff, 0xff, 0xff, // call 0
+          0xc3,                         // ret
+      };
+
+      const char* expected = "00001000: b8 11 22 33 44           mov eax, 0x44332211\n"
+                             "00001005: f0 66 83 c0 01           lock add ax, 0x1\n"
+                             "0000100a: 66 85 c1                 test cx, ax\n"
+                             "0000100d: 6a 00                    push 0x0\n"
+                             "0000100f: f4                       (bad)\n"
+                             "00001010: e8 eb ff ff ff           call 0x1000\n"
+                             "00001015: c3                       ret\n";
+
+      char   out[1024];
+      size_t at      = 0;
+      auto   written = ::disasm::formatListing(code, at, out, 0x1000);
+      TEST(at == sizeof(code));
+      TEST(std::string_view(out, written) == expected);
+
+      // stops before running out of room
+      size_t at2 = 0;
+      TEST(::disasm::formatListing(code, at2, std::span<char>(out, ::disasm::maxLineLength + 10)) > 0);
+      TEST(at2 == 5);
+      TEST(::disasm::formatInsn(std::span<char>(out, 16), 0, code, ::disasm::decodeAt(code, 0)) == 0);
+
+      announce("testFormat finished");
+    }
+
+    void testModRM() {
+      announce("testModRM");
+
+      const uint8_t code[] = {
+          0x8b, 0x44, 0x24, 0x08,                                     // mov eax, [esp+8]
+          0x89, 0x04, 0x8d, 0x10, 0x00, 0x00, 0x00,                   // mov [ecx*4+0x10], eax
+          0x83, 0x45, 0xfc, 0x01,                                     // add dword [ebp-4], 1
+          0xc7, 0x05, 0x00, 0x10, 0x00, 0x00, 0x2a, 0x00, 0x00, 0x00, // mov dword [0x1000], 0x2a
+          0x67, 0x8b, 0x40, 0x02,                                     // mov eax, [bx+si+2]
+          0x85, 0x1c, 0x73,                                           // test [ebx+esi*2], ebx
+          0x89, 0xd8,                                                 // mov eax, ebx
+          0x8b, 0x44, 0x24,                                           // mov eax, [esp+? (truncated)
+      };
+
+      ::disasm::disassembler d(code);
+      auto                   v = d.consume();
+      auto                   x = std::get_if<::disasm::movReg32Rm32>(&v);
+      TEST(x);
+      TEST(d.length() == 4);
+      TEST(x->gpr2 == proc::gpr::eax);
+      TEST(x->gpr == proc::gpr::GPR_MAX);
+      TEST(x->rm.memory && x->rm.base == proc::gpr::esp && x->rm.index == proc::gpr::GPR_MAX && x->rm.disp == 8);
+
+      auto v2 = d.consume();
+      auto x2 = std::get_if<::disasm::movRm32Reg32>(&v2);
+      TEST(x2);
+      TEST(d.length() == 7);
+      TEST(x2->rm.base == proc::gpr::GPR_MAX && x2->rm.index == proc::gpr::ecx && x2->rm.scale == 4);
+      TEST(x2->rm.disp == 0x10);
+
+      auto v3 = d.consume();
+      auto x3 = std::get_if<::disasm::addReg32Imm8>(&v3);
+      TEST(x3);
+      TEST(d.length() == 4);
+      TEST(x3->rm.base == proc::gpr::ebp && x3->rm.disp == -4 && x3->imm == 1);
+
+      auto v4 = d.consume();
+      auto x4 = std::get_if<::disasm::movRm32Imm32>(&v4);
+      TEST(x4);
+      TEST(d.length() == 10);
+      TEST(x4->rm.base == proc::gpr::GPR_MAX && x4->rm.disp == 0x1000 && x4->imm == 0x2a);
+
+      auto i5 = d.next();
+      TEST(i5.id == ::disasm::kind::movReg32Rm32);
+      TEST(i5.length == 4);
+      TEST(i5.rm().base == proc::gpr::ebx && i5.rm().index == proc::gpr::esi && i5.rm().disp == 2);
+
+      auto i6 = d.next();
+      TEST(i6.id == ::disasm::kind::testReg32Reg32);
+      TEST(i6.length == 3);
+      TEST(i6.rm().base == proc::gpr::ebx && i6.rm().index == proc::gpr::esi && i6.rm().scale == 2);
+      TEST(i6.gpr2() == proc::gpr::ebx);
+
+      auto i7 = d.next();
+      TEST(i7.id == ::disasm::kind::movRm32Reg32);
+      TEST(!i7.isMemory() && i7.gpr() == proc::gpr::eax && i7.gpr2() == proc::gpr::ebx);
+
+      TEST(!d.next().valid());
+
+      // past the address and bytes columns
+      char out[::disasm::maxLineLength];
+      auto line = [&](size_t at) {
+        auto i = ::disasm::decodeAt(code, at);
+        auto n = ::disasm::formatInsn(out, 0, std::span(code).subspan(at), i);
+        return std::string_view(out, n).substr(10 + 3 * std::max<size_t>(i.length, 8) + 1);
+      };
+      TEST(line(0) == "mov eax, dword ptr [esp+0x8]\n");
+      TEST(line(4) == "mov dword ptr [ecx*4+0x10], eax\n");
+      TEST(line(11) == "add dword ptr [ebp-0x4], 0x1\n");
+      TEST(line(15) == "mov dword ptr [0x1000], 0x2a\n");
+      TEST(line(25) == "mov eax, dword ptr [bx+si+0x2]\n");
+
+      announce("testModRM finished");
+    }
+
+    void testLength() {
+      announce("testLength");
+
+      const uint8_t pool[] = {0x66, 0x67, 0xf0, 0x2e, 0x6a, 0x68, 0x50, 0x58, 0xb8, 0x83, 0xc0, 0xd0, 0x81,
+                              0x05, 0x40, 0x48, 0x85, 0xe8, 0xe9, 0xc3, 0x89, 0x8b, 0xc7, 0x04, 0x44, 0x24,
+                              0x05, 0x45, 0x80, 0x00, 0xff, 0x11, 0xf4};
+      std::vector<uint8_t> code(0x4000);
+      uint32_t             seed = 0x4321;
+      for (auto& b : code) {
+        seed = seed * 1103515245 + 12345;
+        b    = pool[(seed >> 16) % sizeof(pool)];
+      }
+
+      // every offset, not only the ones a sweep lands on
+      bool same = true;
+      for (size_t at = 0; at <= code.size(); at++) {
+        ::disasm::disassembler d(code, at);
+        d.next();
+        same = same && ::disasm::lengthAt(code, at) == d.length();
+      }
+      TEST(same);
+
+      ::disasm::insnBuffer expected(code.size());
+      ::disasm::decodeRange(code, expected);
+
+      std::vector<uint64_t> starts((code.size() + 63) / 64);
+      auto                  marked = ::disasm::markStarts(code, starts);
+
+      size_t valid = 0;
+      same         = true;
+      for (size_t n = 0, next = 0; n < code.size(); n++) {
+        bool start = next < expected.size() && expected.offsets[next] == n;
+        if (start) {
+          start = expected.kinds[next] != ::disasm::kind::none;
+          next++;
+        }
+        valid += start;
+        same = same && start == (bool)((starts[n / 64] >> (n % 64)) & 1);
+      }
+      TEST(same);
+      TEST(marked == valid);
+
+      announce("testLength finished");
+    }
+
+    void testIndex() {
+      announce("testIndex");
+
+      const uint8_t code[] = {
+          0xe8, 0x0a, 0x00, 0x00, 0x00,                   // 0:  call 15
+          0xb8, 0x01, 0x00, 0x00, 0x00,                   // 5:  mov eax, 1
+          0xe9, 0x0b, 0x00, 0x00, 0x00,                   // 10: jmp 26
+          0x40,                                           // 15: inc eax
+          0xc3,                                           // 16: ret
+          0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, // 17: data
+          0x99,                                           //
+          0x48,                                           // 26: dec eax
+          0xe9, 0xea, 0xff, 0xff, 0xff,                   // 27: jmp 10
+      };
+
+      const uint32_t entries[] = {0};
+      auto           g         = ::disasm::recursiveDescent(code, entries);
+      auto           x         = ::disasm::scanXrefs(code);
+
+      const char* path = "imp_index_test.bin";
+      TEST(::disasm::saveIndex(path, sizeof(code), g, x));
+
+      {
+        ::disasm::imageIndex index(path);
+        TEST(index.ok());
+        TEST(index.codeSize() == sizeof(code));
+        TEST(index.insns.size() == g.insns.size());
+        TEST(std::equal(index.blockStarts.begin(), index.blockStarts.end(), g.blockStarts.begin()));
+
+        auto i = index.insnAt(5);
+        TEST(i && i->id == ::disasm::kind::movReg32 && i->imm == 1);
+        TEST(!index.insnAt(17));
+        TEST(index.blockAt(7) == g.blockAt(7));
+        TEST(index.blockAt(20) == index.npos);
+
+        auto sources = index.sourcesOf(10);
+        TEST(sources.size() == 1 && sources[0] == 27);
+      }
+
+      // an index of another ISA, where ids mean other instructions,
+      // is refused
+      auto f = fopen(path, "r+b");
+      fseek(f, offsetof(::disasm::indexHeader, kindCount), SEEK_SET);
+      const uint32_t kinds = (uint32_t)::disasm::kind::count + 1;
+      fwrite(&kinds, sizeof(kinds), 1, f);
+      fclose(f);
+      TEST(!::disasm::imageIndex(path).ok());
+
+      // and so is anything but an index of this version
+      f = fopen(path, "r+b");
+      fseek(f, offsetof(::disasm::indexHeader, version), SEEK_SET);
+      const uint32_t version = ::disasm::indexVersion + 1;
+      fwrite(&version, sizeof(version), 1, f);
+      fclose(f);
+      {
+        ::disasm::imageIndex index(path);
+        TEST(!index.ok());
+        TEST(!index.insnAt(5));
+      }
+      remove(path);
+
+      TEST(!::disasm::imageIndex(path).ok());
+
+      announce("testIndex finished");
+    }
+
+    void testPatch() {
+      announce("testPatch");
+
+      const uint8_t pool[] = {0x66, 0xf0, 0x6a, 0x68, 0x50, 0xb8, 0x83, 0xc0, 0x81, 0x05, 0x85, 0x89,
+                              0x8b, 0x44, 0x24, 0xe8, 0xe9, 0xc3, 0x00, 0x01, 0xff, 0xfe, 0x11};
+      std::vector<uint8_t> code(0x2000);
+      uint32_t             seed = 0x5678;
+      auto                 rand = [&] {
+        seed = seed * 1103515245 + 12345;
+        return seed >> 16;
+      };
+      for (auto& b : code) b = pool[rand() % sizeof(pool)];
+
+      ::disasm::patchableImage image(code);
+      // has to match decoding the patched image from scratch
+      auto same = [&] {
+        ::disasm::patchableImage fresh(std::vector<uint8_t>(image.code().begin(), image.code().end()));
+        bool                     ok = image.size() == fresh.size() && image.pages.size() == fresh.pages.size();
+        for (size_t pg = 0; ok && pg < fresh.pages.size(); pg++) {
+          auto &a = image.pages[pg], &b = fresh.pages[pg];
+          ok = a.offsets == b.offsets && a.blockStarts == b.blockStarts && a.refTargets == b.refTargets
+               && a.refSources == b.refSources && a.refIsCall == b.refIsCall;
+          for (size_t n = 0; ok && n < b.insns.size(); n++) {
+            ok = memcmp(&a.insns[n], &b.insns[n], sizeof(b.insns[n])) == 0;
+          }
+        }
+        return ok;
+      };
+      TEST(same());
+
+      // the sweep agrees with decodeRange
+      ::disasm::insnBuffer expected(code.size());
+      ::disasm::decodeRange(code, expected);
+      TEST(image.size() == expected.size());
+      TEST(image.insnAt(expected.offsets[100])->id == expected.kinds[100]);
+
+      // a call into the middle of the image starts a block there
+      const uint8_t call[] = {0xe8, 0xfb, 0x0f, 0x00, 0x00}; // call 0x1000
+      auto [start, end]    = image.patch(0, call);
+      TEST(start == 0 && end >= 5);
+      TEST(image.insnAt(0)->id == ::disasm::kind::callNear32);
+      TEST(image.sourcesOf(0x1000).size() == 1 && image.sourcesOf(0x1000)[0] == 0);
+      TEST(!image.insnAt(0x1000) || !image.insnAt(0x1000)->valid() || image.startsBlock(0x1000));
+      TEST(image.startsBlock(5) == image.insnAt(5)->valid());
+      TEST(same());
+
+      bool all = true;
+      for (size_t n = 0; n < 300; n++) {
+        uint8_t patch[6];
+        for (auto& b : patch) b = pool[rand() % sizeof(pool)];
+        image.patch(rand() % code.size(), std::span(patch, 1 + rand() % sizeof(patch)));
+        all = all && same();
+      }
+      TEST(all);
+
+      // past the end is ignored, clipped at it otherwise
+      const uint8_t tail[] = {0xc3, 0xc3, 0xc3};
+      image.patch(code.size(), tail);
+      image.patch(code.size() - 1, tail);
+      TEST(image.code().size() == code.size() && image.code().back() == 0xc3);
+      TEST(same());
+
+      // so is an empty patch, at the start too
+      auto [from, to] = image.patch(0, {});
+      TEST(from == 0 && to == 0);
+      TEST(same());
+
+      auto x = image.xrefs();
+      TEST(std::is_sorted(x.targets.begin(), x.targets.end()));
+      TEST(image.blockStarts().front() == 0);
+
+      announce("testPatch finished");
+    }
   } // namespace disasm
 
   namespace emu {
@@ -302,7 +1036,7 @@ namespace test {
       }
 
       TEST(e.cpu.gprs[proc::gpr::eax] == 0);
-      TEST(e.cpu.flags & proc::flags::carryFlag);
+      TEST(e.cpu.eflags() & proc::flags::carryFlag);
 
       announce("testAdd1 finished");
     }
@@ -324,7 +1058,7 @@ namespace test {
       }
 
       TEST(e.cpu.gprs[proc::gpr::eax] == 1);
-      TEST(!(e.cpu.flags & proc::flags::carryFlag));
+      TEST(!(e.cpu.eflags() & proc::flags::carryFlag));
 
       announce("testAdd2 finished");
     }
@@ -346,7 +1080,7 @@ namespace test {
       }
 
       TEST(e.cpu.gprs[proc::gpr::eax] == 1);
-      TEST(!(e.cpu.flags & proc::flags::carryFlag));
+      TEST(!(e.cpu.eflags() & proc::flags::carryFlag));
 
       announce("testAdd3 finished");
     }
@@ -367,7 +1101,7 @@ namespace test {
       }
 
       TEST(e.cpu.gprs[proc::gpr::eax] == 0xffff0000);
-      TEST(!(e.cpu.flags & proc::flags::carryFlag));
+      TEST(!(e.cpu.eflags() & proc::flags::carryFlag));
 
       announce("testAdd4 finished");
     }
@@ -411,8 +1145,8 @@ namespace test {
       }
 
       TEST(e.cpu.gprs[proc::gpr::eax] == 0);
-      TEST(!(e.cpu.flags & proc::flags::carryFlag));
-      TEST(e.cpu.flags & proc::flags::zeroFlag);
+      TEST(!(e.cpu.eflags() & proc::flags::carryFlag));
+      TEST(e.cpu.eflags() & proc::flags::zeroFlag);
 
       announce("testInc finished");
     }
@@ -433,7 +1167,7 @@ namespace test {
       }
 
       TEST(e.cpu.gprs[proc::gpr::eax] == 0xffffffff);
-      TEST(e.cpu.flags & proc::flags::signFlag);
+      TEST(e.cpu.eflags() & proc::flags::signFlag);
 
       announce("testDec finished");
     }
@@ -500,7 +1234,7 @@ namespace test {
         running = e.execBool();
       }
 
-      TEST(e.cpu.flags & proc::flags::zeroFlag);
+      TEST(e.cpu.eflags() & proc::flags::zeroFlag);
 
       announce("testTest finished");
     }
@@ -528,12 +1262,511 @@ namespace test {
 
       announce("testJmp finished");
     }
+
+    void testAlu() {
+      announce("testAlu");
+
+      const uint8_t code[] = {
+          0xb8, 0x05, 0x00, 0x00, 0x00, // mov eax, 5
+          0x83, 0xe8, 0x06,             // sub eax, 6
+          0x83, 0xf0, 0x0f,             // xor eax, 0xf
+          0x83, 0xcb, 0x03,             // or ebx, 3
+          0x83, 0xfb, 0x03,             // cmp ebx, 3
+      };
+
+      ::emu e(code, 0);
+      bool  running = true;
+      while (running) {
+        e.cpu.dump();
+        running = e.execBool();
+      }
+
+      TEST(e.cpu.gprs[proc::gpr::eax] == 0xfffffff0);
+      TEST(e.cpu.gprs[proc::gpr::ebx] == 3);
+      TEST(e.cpu.eflags() & proc::flags::zeroFlag);
+      TEST(!(e.cpu.eflags() & proc::flags::carryFlag));
+
+      announce("testAlu finished");
+    }
+
+    void testCallRet() {
+      announce("testCallRet");
+
+      const uint8_t code[] = {
+          0xe8, 0x06, 0x00, 0x00, 0x00, // call 11
+          0xb9, 0x01, 0x00, 0x00, 0x00, // mov ecx, 1
+          0xf4,                         // hlt (unsupported, stops)
+          0xb8, 0x02, 0x00, 0x00, 0x00, // mov eax, 2
+          0xc3,                         // ret
+      };
+
+      ::emu e(code, 0);
+      bool  running = true;
+      while (running) {
+        e.cpu.dump();
+        running = e.execBool();
+      }
+
+      TEST(e.cpu.gprs[proc::gpr::eax] == 2);
+      TEST(e.cpu.gprs[proc::gpr::ecx] == 1);
+      TEST(e.cpu.gprs[proc::gpr::esp] == 0xffffffff);
+      TEST(e.cpu.eip == 10);
+
+      announce("testCallRet finished");
+    }
+
+    void testJmp2() {
+      announce("testJmp2");
+
+      const uint8_t code[] = {
+          0xb8, 0x01, 0x00, 0x00, 0x00, // mov eax, 1
+          0xe9, 0x05, 0x00, 0x00, 0x00, // jmp 15
+          0xb8, 0x02, 0x00, 0x00, 0x00, // mov eax, 2
+          0xb9, 0x03, 0x00, 0x00, 0x00, // mov ecx, 3
+      };
+
+      ::emu e(code, 0);
+      bool  running = true;
+      while (running) {
+        e.cpu.dump();
+        running = e.execBool();
+      }
+
+      TEST(e.cpu.gprs[proc::gpr::eax] == 1);
+      TEST(e.cpu.gprs[proc::gpr::ecx] == 3);
+
+      announce("testJmp2 finished");
+    }
+
+    void testMemory() {
+      announce("testMemory");
+
+      const uint8_t code[] = {
+          0xb8, 0x44, 0x33, 0x22, 0x11,                               // mov eax, 0x11223344
+          0xc7, 0x05, 0x00, 0x10, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, // mov dword [0x1000], 1
+          0x83, 0x05, 0x00, 0x10, 0x00, 0x00, 0x02,                   // add dword [0x1000], 2
+          0x8b, 0x0d, 0x00, 0x10, 0x00, 0x00,                         // mov ecx, [0x1000]
+          0xbb, 0x00, 0x20, 0x00, 0x00,                               // mov ebx, 0x2000
+          0xbe, 0x02, 0x00, 0x00, 0x00,                               // mov esi, 2
+          0x89, 0x44, 0xb3, 0xfc,                                     // mov [ebx+esi*4-4], eax
+          0x8b, 0x53, 0x04,                                           // mov edx, [ebx+4]
+          0x85, 0x43, 0x04,                                           // test [ebx+4], eax
+          0x8b, 0x05, 0x00, 0x00, 0x00, 0x80,                         // mov eax, [0x80000000]
+      };
+
+      ::emu e(code, 0);
+      for (size_t n = 0; n < 9; n++) TEST(e.execBool());
+
+      TEST(e.cpu.gprs[proc::gpr::ecx] == 3);
+      TEST(e.cpu.gprs[proc::gpr::edx] == 0x11223344);
+      TEST(!(e.cpu.eflags() & proc::flags::zeroFlag));
+
+      // outside of ram, nothing happens
+      auto eip = e.cpu.eip;
+      TEST(!e.execBool());
+      TEST(e.cpu.eip == eip);
+      TEST(e.cpu.gprs[proc::gpr::eax] == 0x11223344);
+
+      announce("testMemory finished");
+    }
+
+    void testAddressSpace() {
+      announce("testAddressSpace");
+
+      const uint8_t code[] = {
+          0xc7, 0x05, 0x00, 0x00, 0x00, 0xff, 0x05, 0x00, 0x00, 0x00, // mov dword [0xff000000], 5
+          0x8b, 0x05, 0x00, 0x00, 0x00, 0xff,                         // mov eax, [0xff000000]
+          0x8b, 0x0d, 0x00, 0x00, 0x00, 0x40,                         // mov ecx, [0x40000000]
+      };
+
+      ::emu e(code, 0);
+      TEST(e.cpu.toRam(0x8000, 4) == e.cpu.ram.base + 0x8000);
+      TEST(e.cpu.mapped(0xff000000, 4));
+      TEST(!e.cpu.mapped(0x40000000, 4));
+      TEST(!e.cpu.mapped(0xfffffffe, 4));
+
+      // the bottom of the stack window is as mapped as the top, the
+      // block stops at the unmapped load with eip on it
+      TEST(e.runBlock() == 2);
+      TEST(e.cpu.gprs[proc::gpr::eax] == 5);
+      TEST(e.cpu.gprs[proc::gpr::ecx] == 0);
+      TEST(e.cpu.eip == 16);
+      TEST(!e.execBool());
+      TEST(e.cpu.eip == 16);
+
+      // popping off the top of the address space faults, esp stays
+      const uint8_t pop[] = {
+          0x58, // pop eax
+      };
+
+      ::emu p(pop, 0);
+      TEST(!p.execBool());
+      TEST(p.cpu.eip == 0);
+      TEST(p.cpu.gprs[proc::gpr::esp] == 0xffffffff);
+
+      announce("testAddressSpace finished");
+    }
+
+    void testSnapshot() {
+      announce("testSnapshot");
+
+      const uint8_t code[] = {
+          0xc7, 0x05, 0x00, 0x10, 0x00, 0x00, 0x07, 0x00, 0x00, 0x00, // mov dword [0x1000], 7
+          0x83, 0x05, 0x00, 0x10, 0x00, 0x00, 0x01,                   // add dword [0x1000], 1
+          0x68, 0x78, 0x56, 0x34, 0x12,                               // push 0x12345678
+          0xc7, 0x05, 0x21, 0x00, 0x00, 0x00, 0x09, 0x00, 0x00, 0x00, // mov dword [0x21], 9
+          0xb8, 0x03, 0x00, 0x00, 0x00,                               // mov eax, 3, made mov eax, 9
+          0x83, 0xc0, 0x01,                                           // add eax, 1
+      };
+
+      ::emu e(code, 0);
+      TEST(!e.restore());
+      e.cpu.snapshot();
+
+      auto value = [&](uint32_t address) {
+        return *(uint32_t*)e.cpu.toRam(address, 4);
+      };
+
+      for (size_t round = 0; round < 2; round++) {
+        e.run(6);
+        TEST(e.cpu.eip == sizeof(code));
+        TEST(e.cpu.gprs[proc::gpr::eax] == 10);
+        TEST(value(0x1000) == 8);
+        TEST(value(0xfffffffb) == 0x12345678);
+        // the data page, the stack's and the code's
+        TEST(e.cpu.dirtyPages().size() == 3);
+
+        TEST(e.restore());
+        TEST(e.cpu.eip == 0);
+        TEST(e.cpu.gprs[proc::gpr::eax] == 0);
+        TEST(e.cpu.gprs[proc::gpr::esp] == 0xffffffff);
+        TEST(value(0x1000) == 0);
+        TEST(value(0x21) == 3);
+        TEST(e.cpu.dirtyPages().empty());
+      }
+
+      // the block decoded from the patched code went with the restore
+      e.cpu.eip = 0x20;
+      e.runBlock();
+      TEST(e.cpu.gprs[proc::gpr::eax] == 4);
+
+      announce("testSnapshot finished");
+    }
+
+    void testBatch() {
+      announce("testBatch");
+
+      const uint8_t loop[] = {
+          0x83, 0xd0, 0x01,             // adc eax, 1
+          0xe9, 0xf8, 0xff, 0xff, 0xff, // jmp 0
+      };
+      const uint8_t faults[] = {
+          0x68, 0x01, 0x00, 0x00, 0x00,       // push 1
+          0x8b, 0x05, 0x00, 0x00, 0x00, 0x80, // mov eax, [0x80000000]
+      };
+      const uint8_t runsOff[] = {
+          0xb8, 0x01, 0x00, 0x00, 0x00, // mov eax, 1
+      };
+
+      // images mixed up, so workers switch between them
+      std::vector<::batch::job> jobs;
+      for (uint32_t i = 0; i < 300; i++) {
+        ::batch::job j;
+        j.budget = 100 + i;
+        if (i % 3 == 0) j.image = loop;
+        else if (i % 3 == 1)
+          j.image = faults;
+        else
+          j.image = runsOff;
+        j.gprs[proc::gpr::eax] = i;
+        j.flags |= i % 2 ? proc::flags::carryFlag : 0;
+        jobs.push_back(j);
+      }
+
+      ::batch::runner r(4);
+      TEST(r.threads() == 4);
+
+      // twice, the second one on emus that already ran
+      for (size_t round = 0; round < 2; round++) {
+        auto results = r.run(jobs);
+        TEST(results.size() == jobs.size());
+
+        bool right = true;
+        for (uint32_t i = 0; i < jobs.size(); i++) {
+          auto& res = results[i];
+          if (i % 3 == 0) {
+            // the carry goes in with the first adc
+            size_t adcs = (jobs[i].budget + 1) / 2;
+            right &= res.stop == ::batch::stopReason::budget && res.executed == jobs[i].budget;
+            right &= res.gprs[proc::gpr::eax] == i + adcs + i % 2;
+            right &= res.eip == (jobs[i].budget % 2 ? 3u : 0u);
+          } else if (i % 3 == 1) {
+            right &= res.stop == ::batch::stopReason::fault && res.executed == 1 && res.eip == 5;
+            right &= res.gprs[proc::gpr::esp] == 0xfffffffb && res.gprs[proc::gpr::eax] == i;
+          } else {
+            right &= res.stop == ::batch::stopReason::invalid && res.executed == 1 && res.eip == 5;
+            right &= res.gprs[proc::gpr::eax] == 1 && (res.flags & proc::flags::carryFlag) == (i % 2);
+          }
+        }
+        TEST(right);
+      }
+
+      TEST(r.run({}).empty());
+
+      announce("testBatch finished");
+    }
+
+    void testLockstep() {
+      announce("testLockstep");
+
+      uint8_t code[0x30] = {
+          0x83, 0xc0, 0x05,             // add eax, 5
+          0xe9, 0x18, 0x00, 0x00, 0x00, // jmp 0x20
+          0x50,                         // push eax
+          0x83, 0xc2, 0x07,             // add edx, 7
+          0x89, 0xd3,                   // mov ebx, edx
+      };
+      const uint8_t detour[] = {
+          0x41,                         // inc ecx
+          0x41,                         // inc ecx
+          0xe9, 0xe1, 0xff, 0xff, 0xff, // jmp 8
+      };
+      memcpy(code + 0x20, detour, sizeof(detour));
+
+      // more lanes than fill a group. Every other one starts on the
+      // detour, where the rest catch up with it, and the last one
+      // faults on the push
+      ::lockstep::runner r(code, 0, 6);
+      TEST(r.lanes() == 6);
+      for (size_t l = 0; l < r.lanes(); l++) {
+        r.lane(l).cpu.eip                  = l % 2 ? 0x20 : 0;
+        r.lane(l).cpu.gprs[proc::gpr::edx] = (uint32_t)l;
+      }
+      r.lane(5).cpu.gprs[proc::gpr::esp] = 0x80000000;
+
+      TEST(r.run(100) == 3 * 8 + 2 * 6 + 3);
+      for (size_t l = 0; l < 5; l++) {
+        auto& cpu = r.lane(l).cpu;
+        TEST(cpu.eip == 0x0e);
+        TEST(cpu.gprs[proc::gpr::ecx] == 2);
+        TEST(cpu.gprs[proc::gpr::ebx] == l + 7);
+        TEST(*(uint32_t*)cpu.stackToRam() == (l % 2 ? 0u : 5u));
+        TEST(!(cpu.eflags() & proc::flags::zeroFlag));
+        TEST(!r.detached(l));
+      }
+
+      TEST(r.lane(5).cpu.eip == 8);
+      TEST(r.lane(5).cpu.gprs[proc::gpr::esp] == 0x80000000);
+
+      // all stopped, nothing more runs
+      TEST(r.run(100) == 0);
+
+      // a lane writing over decoded code goes on by itself, as a plain
+      // emu would. One whose code isn't what was decoded does too, and
+      // the rest go on in lockstep
+      const uint8_t patching[] = {
+          0x83, 0x05, 0x0c, 0x00, 0x00, 0x00, 0x01, // add dword [0x0c], 1
+          0xe9, 0x00, 0x00, 0x00, 0x00,             // jmp 0x0c
+          0x40,                                     // inc eax
+          0xe9, 0xee, 0xff, 0xff, 0xff,             // jmp 0
+      };
+      const uint8_t looping[] = {
+          0x40,                         // inc eax
+          0xe9, 0xfa, 0xff, 0xff, 0xff, // jmp 0x1000
+      };
+      std::vector<uint8_t> image(0x1000 + sizeof(looping));
+      memcpy(image.data(), patching, sizeof(patching));
+      memcpy(image.data() + 0x1000, looping, sizeof(looping));
+
+      ::lockstep::runner patched(image, 0, 3);
+      patched.lane(1).cpu.eip = patched.lane(2).cpu.eip = 0x1000;
+      // lane 2 runs inc ecx in its place
+      *(uint8_t*)patched.lane(2).cpu.toRam(0x1000, 1) = 0x41;
+
+      TEST(patched.run(12) == 12);
+      TEST(patched.detached(0));
+      TEST(!patched.detached(1));
+      TEST(patched.lane(1).cpu.gprs[proc::gpr::eax] == 6);
+      TEST(patched.detached(2));
+      TEST(patched.lane(2).cpu.eip == 0x1000 && patched.lane(2).cpu.gprs[proc::gpr::ecx] == 0);
+
+      auto& lane = patched.lane(0);
+      ::emu plain(patching, 0);
+      for (size_t i = 0; i < 11; i++) TEST(plain.execBool());
+      while (!lane.cpu.gprs[proc::gpr::ebx]) TEST(lane.execBool());
+      TEST(lane.cpu.eip == plain.cpu.eip);
+      for (auto gpr : {proc::gpr::eax, proc::gpr::ecx, proc::gpr::edx, proc::gpr::ebx}) {
+        TEST(lane.cpu.gprs[gpr] == plain.cpu.gprs[gpr]);
+        TEST(lane.cpu.gprs[gpr] == (gpr != proc::gpr::eax));
+      }
+
+      announce("testLockstep finished");
+    }
+
+    void testLazyFlags() {
+      announce("testLazyFlags");
+
+      const uint8_t code[] = {
+          0xb8, 0xff, 0xff, 0xff, 0xff, // mov eax, 0xffffffff
+          0x83, 0xc0, 0x01,             // add eax, 1
+          0x43,                         // inc ebx
+          0x83, 0xd1, 0x00,             // adc ecx, 0
+          0x83, 0xea, 0x01,             // sub edx, 1
+      };
+
+      ::emu e(code, 0);
+      TEST(e.execBool());
+      TEST(e.execBool());
+      // recorded, not worked out yet
+      TEST(e.cpu.lazy.op == ::emu::softCPU::flagOp::add);
+      TEST(e.cpu.eflags() & proc::flags::carryFlag);
+      TEST(e.cpu.eflags() & proc::flags::zeroFlag);
+      TEST(e.cpu.lazy.op == ::emu::softCPU::flagOp::none);
+
+      // inc keeps the carry for adc to read
+      TEST(e.execBool());
+      TEST(e.execBool());
+      TEST(e.cpu.gprs[proc::gpr::ecx] == 1);
+
+      TEST(e.execBool());
+      auto flags = e.cpu.eflags();
+      TEST(flags & proc::flags::carryFlag);
+      TEST(flags & proc::flags::signFlag);
+      TEST(flags & proc::flags::parityFlag);
+      TEST(!(flags & proc::flags::zeroFlag));
+      TEST(!(flags & proc::flags::overflowFlag));
+
+      announce("testLazyFlags finished");
+    }
+
+    void testFusion() {
+      announce("testFusion");
+
+      const uint8_t code[] = {
+          0xb8, 0xff, 0xff, 0xff, 0xff, // mov eax, 0xffffffff
+          0x83, 0xc0, 0x01,             // add eax, 1
+          0x83, 0xd2, 0x05,             // adc edx, 5
+          0x55,                         // push ebp
+          0x89, 0xe5,                   // mov ebp, esp
+          0x68, 0x44, 0x33, 0x22, 0x11, // push 0x11223344
+          0x59,                         // pop ecx
+          0xe9, 0x00, 0x00, 0x00, 0x00, // jmp 25
+      };
+
+      ::emu fused(code, 0), plain(code, 0);
+      fused.jitEnabled = plain.jitEnabled = false;
+      plain.setFusion(false);
+      TEST(fused.fusion());
+      TEST(!plain.fusion());
+
+      TEST(fused.runBlock() == 8);
+      TEST(plain.runBlock() == 8);
+
+      auto& ops = fused.cache.blocks.at(0).ops;
+      TEST(ops[1] == ::emu::addAdc);
+      TEST(ops[3] == ::emu::pushMov);
+      TEST(ops[5] == ::emu::pushPop);
+
+      TEST(fused.cpu.gprs == plain.cpu.gprs);
+      TEST(fused.cpu.eip == plain.cpu.eip);
+      TEST(fused.cpu.eflags() == plain.cpu.eflags());
+      TEST(fused.cpu.gprs[proc::gpr::edx] == 6);
+      TEST(fused.cpu.gprs[proc::gpr::ecx] == 0x11223344);
+      TEST(fused.cpu.gprs[proc::gpr::ebp] == 0xfffffffb);
+
+      announce("testFusion finished");
+    }
+
+    void testJit() {
+      announce("testJit");
+
+      const uint8_t code[] = {
+          0x83, 0xc0, 0x03,                   // L: add eax, 3
+          0x41,                               // inc ecx
+          0x83, 0xd2, 0x00,                   // adc edx, 0
+          0x53,                               // push ebx
+          0x89, 0xc3,                         // mov ebx, eax
+          0x83, 0xf3, 0x55,                   // xor ebx, 0x55
+          0x5b,                               // pop ebx
+          0x83, 0x05, 0x00, 0x80, 0x00, 0x00, // add dword [0x8000], 1
+          0x01,                               //
+          0x85, 0xc9,                         // test ecx, ecx
+          0x83, 0xe8, 0x01,                   // sub eax, 1
+          0xe9, 0xe1, 0xff, 0xff, 0xff,       // jmp L
+      };
+
+      ::emu compiled(code, 0), interpreted(code, 0);
+      interpreted.jitEnabled = false;
+
+      TEST(compiled.run(11000) == 11000);
+      TEST(interpreted.run(11000) == 11000);
+#ifdef IMP_JIT
+      TEST(compiled.cache.compiled == 1);
+#endif
+      TEST(compiled.cpu.gprs == interpreted.cpu.gprs);
+      TEST(compiled.cpu.eip == interpreted.cpu.eip);
+      TEST(compiled.cpu.eflags() == interpreted.cpu.eflags());
+      TEST(*(uint32_t*)compiled.cpu.toRam(0x8000, 4) == 1000);
+      TEST(compiled.cpu.gprs[proc::gpr::ecx] == 1000);
+
+      announce("testJit finished");
+    }
+
+    void testBlockCache() {
+      announce("testBlockCache");
+
+      const uint8_t loop[] = {
+          0xb8, 0x00, 0x00, 0x00, 0x00, // mov eax, 0
+          0x83, 0xc0, 0x01,             // add eax, 1
+          0xe9, 0xf8, 0xff, 0xff, 0xff, // jmp 5
+      };
+
+      ::emu e(loop, 0);
+      for (size_t n = 0; n < 10; n++) TEST(e.runBlock() != 0);
+
+      TEST(e.cpu.gprs[proc::gpr::eax] == 10);
+      TEST(e.cache.misses == 2);
+      TEST(e.cache.hits == 8);
+      TEST(e.cache.blocks.size() == 2);
+
+      // stops at the limit, after whole blocks
+      TEST(e.run(5) == 6);
+      TEST(e.cpu.gprs[proc::gpr::eax] == 13);
+
+      // a page at a time
+      e.invalidate(5, 1);
+      TEST(e.cache.blocks.empty());
+      TEST(e.cache.flushes == 1);
+      TEST(e.runBlock() == 2);
+      TEST(e.cache.misses == 3);
+
+      // the add at 10 becomes add eax, 5 after its first run
+      const uint8_t modifying[] = {
+          0xb8, 0x00, 0x00, 0x00, 0x00,                               // mov eax, 0
+          0xe9, 0x00, 0x00, 0x00, 0x00,                               // jmp 10
+          0x83, 0xc0, 0x01,                                           // add eax, 1
+          0xe9, 0x00, 0x00, 0x00, 0x00,                               // jmp 18
+          0xc7, 0x05, 0x0c, 0x00, 0x00, 0x00, 0x05, 0xe9, 0x00, 0x00, // mov dword [12], 0xe905
+          0xe9, 0xe9, 0xff, 0xff, 0xff,                               // jmp 10
+      };
+
+      ::emu m(modifying, 0);
+      for (size_t n = 0; n < 5; n++) TEST(m.runBlock() != 0);
+
+      TEST(m.cpu.gprs[proc::gpr::eax] == 6);
+      TEST(m.cpu.eip == 18);
+      TEST(m.cache.flushes == 1);
+      TEST(m.cache.misses == 5);
+
+      announce("testBlockCache finished");
+    }
   } // namespace emu
 
 #undef TEST
 } // namespace test
 
 int main() {
+  test::utl::testWorkPool();
   test::disasm::testGprMapping();
   test::disasm::testMov();
   test::disasm::testPushPop1();
@@ -543,6 +1776,20 @@ int main() {
   test::disasm::testInc();
   test::disasm::testDec();
   test::disasm::testTest();
+  test::disasm::testGroups();
+  test::disasm::testAlu();
+  test::disasm::testDecodeRange();
+  test::disasm::testInsn();
+  test::disasm::testPrefixes();
+  test::disasm::testParallel();
+  test::disasm::testRecursiveDescent();
+  test::disasm::testXrefs();
+  test::disasm::testStream();
+  test::disasm::testFormat();
+  test::disasm::testModRM();
+  test::disasm::testLength();
+  test::disasm::testIndex();
+  test::disasm::testPatch();
   test::emu::testGprMapping();
   test::emu::testAdd1();
   test::emu::testAdd2();
@@ -555,5 +1802,17 @@ int main() {
   test::emu::testPushPop2();
   test::emu::testTest();
   test::emu::testJmp();
+  test::emu::testAlu();
+  test::emu::testCallRet();
+  test::emu::testJmp2();
+  test::emu::testMemory();
+  test::emu::testAddressSpace();
+  test::emu::testSnapshot();
+  test::emu::testBatch();
+  test::emu::testLockstep();
+  test::emu::testLazyFlags();
+  test::emu::testBlockCache();
+  test::emu::testJit();
+  test::emu::testFusion();
   return 0;
 }
@@ -0,0 +1,242 @@
+#include "patch.hh"
+#include <algorithm>
+#include <cstring>
+
+using namespace disasm;
+
+namespace {
+  bool endsBlock(const insn& i) noexcept {
+    if (!i.valid()) return true;
+
+    auto t = info(i.id).type;
+    return t == instructionType::CALL || t == instructionType::JMP || t == instructionType::RET;
+  }
+
+  /// Bytes a decode at some offset may have looked at
+  size_t reach(const insn& i) noexcept {
+    return i.valid() ? i.length : maxInsnLength;
+  }
+
+  /// Index of the entry at offset in p, or of the first one past it
+  size_t lowerBound(const patchableImage::page& p, uint32_t offset) noexcept {
+    return std::lower_bound(p.offsets.begin(), p.offsets.end(), offset) - p.offsets.begin();
+  }
+
+  /// Range of the references to target in p
+  std::pair<size_t, size_t> refRange(const patchableImage::page& p, uint32_t target) noexcept {
+    auto [b, e] = std::equal_range(p.refTargets.begin(), p.refTargets.end(), target);
+    return {(size_t)(b - p.refTargets.begin()), (size_t)(e - p.refTargets.begin())};
+  }
+} // namespace
+
+patchableImage::patchableImage(std::vector<uint8_t> code) : bytes(std::move(code)) {
+  pages.resize((bytes.size() + pageSize - 1) / pageSize);
+
+  for (size_t at = 0; at < bytes.size(); count++) {
+    auto  i = decodeAt(bytes, at);
+    auto& p = pageOf((uint32_t)at);
+    p.insns.push_back(i);
+    p.offsets.push_back((uint32_t)at);
+    at += sweepLength(i);
+
+    if (i.hasTarget() && i.imm < bytes.size()) {
+      auto& t = pageOf(i.imm);
+      t.refTargets.push_back(i.imm);
+      t.refSources.push_back(p.offsets.back());
+    }
+  }
+
+  for (auto& p : pages) {
+    // sources are in order already, a stable sort keeps them so
+    std::vector<size_t> order(p.refTargets.size());
+    for (size_t n = 0; n < order.size(); n++) order[n] = n;
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+      return p.refTargets[a] < p.refTargets[b];
+    });
+
+    std::vector<uint32_t> targets, sources;
+    for (auto n : order) {
+      targets.push_back(p.refTargets[n]);
+      sources.push_back(p.refSources[n]);
+      p.refIsCall.push_back(info(insnAt(p.refSources[n])->id).type == instructionType::CALL);
+    }
+    p.refTargets = std::move(targets);
+    p.refSources = std::move(sources);
+  }
+
+  for (auto& p : pages) {
+    p.blockStarts.resize(p.insns.size());
+    for (auto at : p.offsets) updateBlockStart(at);
+  }
+}
+
+const insn* patchableImage::insnAt(uint32_t offset) const noexcept {
+  if (offset >= bytes.size()) return nullptr;
+
+  auto& p = pageOf(offset);
+  auto  n = lowerBound(p, offset);
+  if (n == p.offsets.size() || p.offsets[n] != offset) return nullptr;
+  return &p.insns[n];
+}
+
+bool patchableImage::startsBlock(uint32_t offset) const noexcept {
+  auto i = insnAt(offset);
+  if (!i) return false;
+
+  auto& p = pageOf(offset);
+  return p.blockStarts[i - p.insns.data()];
+}
+
+std::span<const uint32_t> patchableImage::sourcesOf(uint32_t target) const noexcept {
+  if (target >= bytes.size()) return {};
+
+  auto& p      = pageOf(target);
+  auto [b, e] = refRange(p, target);
+  return {p.refSources.data() + b, p.refSources.data() + e};
+}
+
+std::vector<uint32_t> patchableImage::blockStarts() const {
+  std::vector<uint32_t> starts;
+  for (auto& p : pages) {
+    for (size_t n = 0; n < p.insns.size(); n++) {
+      if (p.blockStarts[n]) starts.push_back(p.offsets[n]);
+    }
+  }
+  return starts;
+}
+
+xrefIndex patchableImage::xrefs() const {
+  xrefIndex x;
+  for (auto& p : pages) {
+    x.targets.insert(x.targets.end(), p.refTargets.begin(), p.refTargets.end());
+    x.sources.insert(x.sources.end(), p.refSources.begin(), p.refSources.end());
+    x.isCall.insert(x.isCall.end(), p.refIsCall.begin(), p.refIsCall.end());
+  }
+  return x;
+}
+
+std::pair<uint32_t, uint32_t> patchableImage::patch(size_t offset, std::span<const uint8_t> data) {
+  if (offset >= bytes.size()) return {(uint32_t)bytes.size(), (uint32_t)bytes.size()};
+  data = data.first(std::min(data.size(), bytes.size() - offset));
+  // nothing changes, nothing to decode again
+  if (data.empty()) return {(uint32_t)offset, (uint32_t)offset};
+  memcpy(&bytes[offset], data.data(), data.size());
+
+  size_t patchEnd = offset + data.size();
+
+  // first entry whose decode may have read a patched byte, valid
+  // instructions only read their own bytes, failed decodes up to
+  // maxInsnLength of them. The one covering offset is among these
+  uint32_t start = (uint32_t)offset;
+  uint32_t from  = (uint32_t)(offset >= maxInsnLength - 1 ? offset - (maxInsnLength - 1) : 0);
+  for (auto pg = from / pageSize; pg <= offset / pageSize; pg++) {
+    auto& p = pages[pg];
+    for (auto n = lowerBound(p, from); n < p.offsets.size() && p.offsets[n] <= offset; n++) {
+      if (p.offsets[n] + reach(p.insns[n]) > offset) start = std::min(start, p.offsets[n]);
+    }
+  }
+
+  // decode again until past the patch, on a boundary the previous
+  // sweep had too
+  std::vector<insn>     newInsns;
+  std::vector<uint32_t> newOffsets;
+  size_t                at = start;
+  while (at < bytes.size()) {
+    if (at >= patchEnd && insnAt((uint32_t)at)) break;
+
+    auto i = decodeAt(bytes, at);
+    newInsns.push_back(i);
+    newOffsets.push_back((uint32_t)at);
+    at += sweepLength(i);
+  }
+  uint32_t end = (uint32_t)at;
+
+  // out with the old entries, and their references
+  std::vector<uint32_t> touched;
+  for (auto pg = start / pageSize; pg <= (end - 1) / pageSize; pg++) {
+    auto& p = pages[pg];
+    auto  b = lowerBound(p, start);
+    auto  e = lowerBound(p, end);
+    for (auto n = b; n < e; n++) {
+      removeRef(p.offsets[n], p.insns[n]);
+      if (p.insns[n].hasTarget()) touched.push_back(p.insns[n].imm);
+    }
+
+    p.insns.erase(p.insns.begin() + b, p.insns.begin() + e);
+    p.offsets.erase(p.offsets.begin() + b, p.offsets.begin() + e);
+    p.blockStarts.erase(p.blockStarts.begin() + b, p.blockStarts.begin() + e);
+    count -= e - b;
+  }
+
+  // in with the new, a page at a time
+  for (size_t n = 0; n < newInsns.size();) {
+    auto& p    = pageOf(newOffsets[n]);
+    auto  pg   = newOffsets[n] / pageSize;
+    auto  last = n;
+    while (last < newInsns.size() && newOffsets[last] / pageSize == pg) last++;
+
+    auto at2 = lowerBound(p, newOffsets[n]);
+    p.insns.insert(p.insns.begin() + at2, newInsns.begin() + n, newInsns.begin() + last);
+    p.offsets.insert(p.offsets.begin() + at2, newOffsets.begin() + n, newOffsets.begin() + last);
+    p.blockStarts.insert(p.blockStarts.begin() + at2, last - n, 0);
+    count += last - n;
+    n = last;
+  }
+
+  for (size_t n = 0; n < newInsns.size(); n++) {
+    addRef(newOffsets[n], newInsns[n]);
+    if (newInsns[n].hasTarget()) touched.push_back(newInsns[n].imm);
+  }
+
+  // blocks of the new entries, the entry right after them, and
+  // the targets that gained or lost a reference
+  for (auto o : newOffsets) updateBlockStart(o);
+  if (end < bytes.size()) updateBlockStart(end);
+  for (auto t : touched) {
+    if (t < bytes.size()) updateBlockStart(t);
+  }
+
+  return {start, end};
+}
+
+void patchableImage::addRef(uint32_t source, const insn& i) {
+  if (!i.hasTarget() || i.imm >= bytes.size()) return;
+
+  auto& p      = pageOf(i.imm);
+  auto [b, e] = refRange(p, i.imm);
+  auto at      = std::lower_bound(p.refSources.begin() + b, p.refSources.begin() + e, source) - p.refSources.begin();
+  p.refTargets.insert(p.refTargets.begin() + at, i.imm);
+  p.refSources.insert(p.refSources.begin() + at, source);
+  p.refIsCall.insert(p.refIsCall.begin() + at, info(i.id).type == instructionType::CALL);
+}
+
+void patchableImage::removeRef(uint32_t source, const insn& i) {
+  if (!i.hasTarget() || i.imm >= bytes.size()) return;
+
+  auto& p      = pageOf(i.imm);
+  auto [b, e] = refRange(p, i.imm);
+  auto it      = std::lower_bound(p.refSources.begin() + b, p.refSources.begin() + e, source);
+  if (it == p.refSources.begin() + e || *it != source) return;
+
+  auto at = it - p.refSources.begin();
+  p.refTargets.erase(p.refTargets.begin() + at);
+  p.refSources.erase(p.refSources.begin() + at);
+  p.refIsCall.erase(p.refIsCall.begin() + at);
+}
+
+void patchableImage::updateBlockStart(uint32_t offset) noexcept {
+  auto& p = pageOf(offset);
+  auto  n = lowerBound(p, offset);
+  if (n == p.offsets.size() || p.offsets[n] != offset) return;
+
+  // the entry before, which may be in an earlier page
+  const insn* prev = nullptr;
+  if (n > 0) prev = &p.insns[n - 1];
+  else {
+    for (auto pg = offset / pageSize; !prev && pg-- > 0;) {
+      if (!pages[pg].insns.empty()) prev = &pages[pg].insns.back();
+    }
+  }
+
+  p.blockStarts[n] = p.insns[n].valid() && (!prev || endsBlock(*prev) || isTarget(offset));
+}
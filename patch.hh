@@ -0,0 +1,95 @@
+#pragma once
+
+#include "disasm.hh"
+#include "xref.hh"
+#include <cstdint>
+#include <span>
+#include <utility>
+#include <vector>
+
+namespace disasm {
+  ///
+  /// Linear sweep of an image that is kept up to date as its bytes are
+  /// patched. A patch re-decodes the instructions it touches, and the
+  /// ones after it until the sweep lands on an offset the previous
+  /// one did too; from there on nothing can have changed.
+  ///
+  /// Everything is kept per page of code, so a patch only ever moves
+  /// the entries and references of the few pages it touches
+  ///
+  struct patchableImage {
+    static constexpr size_t pageSize = 0x1000;
+
+    struct page {
+      /// Entries that start in the page, like decodeRange gives them:
+      /// sorted by offset, bytes that don't decode are 1 byte long
+      /// kind::none entries
+      std::vector<insn>     insns;
+      std::vector<uint32_t> offsets;
+      /// Per entry, whether it starts a block: the first instruction,
+      /// ones after a call/jmp/ret or a failed decode, and call/jmp
+      /// targets. A block runs up to the next start, or failed decode
+      std::vector<uint8_t> blockStarts;
+
+      /// References of decoded calls/jmps that land in the page,
+      /// sorted by target then by source
+      std::vector<uint32_t> refTargets;
+      std::vector<uint32_t> refSources;
+      std::vector<uint8_t>  refIsCall;
+    };
+
+    explicit patchableImage(std::vector<uint8_t> code);
+
+    memoryViewType code() const noexcept {
+      return bytes;
+    }
+
+    size_t size() const noexcept {
+      return count;
+    }
+
+    ///
+    /// Overwrites code at offset with data, clipped to the end of code,
+    /// and re-decodes what that affects. Returns the range of code that
+    /// was decoded again, as [start, end)
+    ///
+    std::pair<uint32_t, uint32_t> patch(size_t offset, std::span<const uint8_t> data);
+
+    /// Entry starting at offset, nullptr if none
+    const insn* insnAt(uint32_t offset) const noexcept;
+
+    bool startsBlock(uint32_t offset) const noexcept;
+
+    /// Offsets of the calls/jmps to target
+    std::span<const uint32_t> sourcesOf(uint32_t target) const noexcept;
+
+    bool isTarget(uint32_t target) const noexcept {
+      return !sourcesOf(target).empty();
+    }
+
+    /// Sorted block starts, gathered from all pages
+    std::vector<uint32_t> blockStarts() const;
+
+    /// References, gathered from all pages
+    xrefIndex xrefs() const;
+
+    std::vector<page> pages;
+
+private:
+    page& pageOf(uint32_t offset) noexcept {
+      return pages[offset / pageSize];
+    }
+
+    const page& pageOf(uint32_t offset) const noexcept {
+      return pages[offset / pageSize];
+    }
+
+    void addRef(uint32_t source, const insn& i);
+    void removeRef(uint32_t source, const insn& i);
+    /// Recomputes whether the entry at offset starts a block
+    void updateBlockStart(uint32_t offset) noexcept;
+
+    std::vector<uint8_t> bytes;
+    size_t               count = 0;
+  };
+} // namespace disasm
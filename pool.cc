@@ -0,0 +1,113 @@
+#include "pool.hh"
+#include <algorithm>
+
+using namespace utl;
+
+namespace {
+  /// Pool and worker index of the calling thread, if it's a worker
+  thread_local const workPool* currentPool   = nullptr;
+  thread_local size_t          currentWorker = 0;
+} // namespace
+
+workPool::workPool(size_t threads) {
+  if (threads == 0) threads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+
+  for (size_t i = 0; i < threads; i++) workers.push_back(std::make_unique<worker>());
+  for (size_t i = 0; i < threads; i++) {
+    this->threads.emplace_back([this, i] {
+      run(i);
+    });
+  }
+}
+
+workPool::~workPool() {
+  wait();
+
+  {
+    std::lock_guard l(sleepLock);
+    stopping = true;
+  }
+  wake.notify_all();
+
+  // before the members they use go away
+  threads.clear();
+}
+
+void workPool::submit(task t) {
+  size_t target = currentPool == this ? currentWorker : nextWorker++ % workers.size();
+
+  pending++;
+  {
+    std::lock_guard l(workers[target]->lock);
+    workers[target]->tasks.push_back(std::move(t));
+  }
+  queued++;
+
+  // taking the lock orders this against a worker about to sleep
+  { std::lock_guard l(sleepLock); }
+  wake.notify_one();
+}
+
+size_t workPool::workerIndex() const noexcept {
+  return currentPool == this ? currentWorker : workers.size();
+}
+
+void workPool::wait() {
+  std::unique_lock l(sleepLock);
+  done.wait(l, [&] {
+    return pending == 0;
+  });
+}
+
+bool workPool::take(size_t self, task& t) {
+  // own tasks, newest first
+  {
+    auto&           w = *workers[self];
+    std::lock_guard l(w.lock);
+    if (!w.tasks.empty()) {
+      t = std::move(w.tasks.back());
+      w.tasks.pop_back();
+      queued--;
+      return true;
+    }
+  }
+
+  // other workers' tasks, oldest first
+  for (size_t i = 1; i < workers.size(); i++) {
+    auto&           w = *workers[(self + i) % workers.size()];
+    std::lock_guard l(w.lock);
+    if (!w.tasks.empty()) {
+      t = std::move(w.tasks.front());
+      w.tasks.pop_front();
+      queued--;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void workPool::run(size_t self) {
+  currentPool   = this;
+  currentWorker = self;
+
+  while (true) {
+    task t;
+    if (take(self, t)) {
+      t();
+      // whatever it captured goes before wait() can return
+      t = nullptr;
+      if (--pending == 0) {
+        { std::lock_guard l(sleepLock); }
+        done.notify_all();
+      }
+      continue;
+    }
+
+    std::unique_lock l(sleepLock);
+    wake.wait(l, [&] {
+      return queued > 0 || stopping;
+    });
+    if (stopping && queued == 0) return;
+  }
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace utl {
+  ///
+  /// Fixed set of worker threads, each with its own deque of tasks.
+  /// A worker runs the newest task of its own deque, and once that's
+  /// empty steals the oldest one of another worker. Tasks submitted
+  /// from a worker go to its own deque, so a task splitting itself
+  /// up keeps the pieces close, while idle workers take them over
+  ///
+  struct workPool {
+    using task = std::function<void()>;
+
+    /// threads = 0 uses every hardware thread
+    explicit workPool(size_t threads = 0);
+    /// Waits for every task, then stops the workers
+    ~workPool();
+
+    workPool& operator=(const workPool&) = delete;
+    workPool(const workPool&)            = delete;
+
+    void submit(task t);
+
+    /// Blocks until every task submitted so far, and every task
+    /// those submitted, has run. Not to be called from a task
+    void wait();
+
+    size_t size() const noexcept {
+      return workers.size();
+    }
+
+    /// Index of the calling worker, size() if it isn't one of this
+    /// pool's. For per-worker state, tasks only ever run on workers
+    size_t workerIndex() const noexcept;
+
+private:
+    struct worker {
+      std::mutex       lock;
+      std::deque<task> tasks;
+    };
+
+    void run(size_t self);
+    bool take(size_t self, task& t);
+
+    std::vector<std::unique_ptr<worker>> workers;
+    std::vector<std::jthread>            threads;
+
+    /// Submitted but not finished, and waiting in a deque
+    std::atomic<size_t> pending = 0;
+    std::atomic<size_t> queued  = 0;
+    /// Where tasks from outside of the pool go, round robin
+    std::atomic<size_t> nextWorker = 0;
+
+    std::mutex              sleepLock;
+    std::condition_variable wake;
+    std::condition_variable done;
+    bool                    stopping = false;
+  };
+} // namespace utl
@@ -0,0 +1,162 @@
+#include "stream.hh"
+#include <algorithm>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace disasm;
+
+namespace {
+  /// Mappings have to start at a multiple of this
+  size_t mapGranularity() noexcept {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwAllocationGranularity;
+#else
+    return (size_t)sysconf(_SC_PAGESIZE);
+#endif
+  }
+} // namespace
+
+streamDisassembler::streamDisassembler(reader read, size_t chunkSize)
+    : read(std::move(read)), chunkSize(std::max(chunkSize, maxInsnLength)) {
+  buffer.resize(this->chunkSize + maxInsnLength);
+}
+
+streamDisassembler::streamDisassembler(const char* path, size_t windowSize) {
+  auto granularity = mapGranularity();
+  // room for the carry-over past the alignment slack
+  this->windowSize = std::max(windowSize, granularity) + granularity;
+
+#ifdef _WIN32
+  file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+  if (file == INVALID_HANDLE_VALUE) {
+    file   = nullptr;
+    opened = false;
+    return;
+  }
+
+  LARGE_INTEGER size;
+  GetFileSizeEx(file, &size);
+  fileSize = size.QuadPart;
+  if (fileSize) fileMapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  opened = fileSize == 0 || fileMapping;
+#else
+  file = ::open(path, O_RDONLY);
+  if (file < 0) {
+    opened = false;
+    return;
+  }
+
+  struct stat st;
+  fstat(file, &st);
+  fileSize = st.st_size;
+#endif
+}
+
+streamDisassembler::~streamDisassembler() {
+  unmap();
+#ifdef _WIN32
+  if (fileMapping) CloseHandle(fileMapping);
+  if (file) CloseHandle(file);
+#else
+  if (file >= 0) ::close(file);
+#endif
+}
+
+void streamDisassembler::unmap() noexcept {
+  if (!mapping) return;
+
+#ifdef _WIN32
+  UnmapViewOfFile(mapping);
+#else
+  munmap(mapping, mapLength);
+#endif
+  mapping = nullptr;
+}
+
+void streamDisassembler::refillChunk() {
+  // carry over what's left of the current chunk
+  size_t left = view.size() - pos;
+  memmove(buffer.data(), buffer.data() + pos, left);
+  viewBase += pos;
+  pos = 0;
+
+  size_t filled = left;
+  while (filled < buffer.size()) {
+    auto n = read(buffer.data() + filled, buffer.size() - filled);
+    if (n == 0) {
+      atEnd = true;
+      break;
+    }
+    filled += n;
+  }
+
+  view = memoryViewType {buffer.data(), filled};
+}
+
+void streamDisassembler::refillWindow() {
+  auto     granularity = mapGranularity();
+  uint64_t at          = viewBase + pos;
+  uint64_t aligned     = at - (at % granularity);
+  size_t   length      = (size_t)std::min<uint64_t>(windowSize, fileSize - aligned);
+
+  // dropping the previous window is what keeps memory use flat
+  unmap();
+  if (length == 0) {
+    atEnd = true;
+    view  = {};
+    return;
+  }
+
+#ifdef _WIN32
+  mapping = MapViewOfFile(fileMapping, FILE_MAP_READ, (DWORD)(aligned >> 32), (DWORD)aligned, length);
+#else
+  mapping = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, file, (off_t)aligned);
+  if (mapping == MAP_FAILED) mapping = nullptr;
+  else
+    madvise(mapping, length, MADV_SEQUENTIAL);
+#endif
+
+  if (!mapping) {
+    atEnd = true;
+    view  = {};
+    return;
+  }
+
+  mapLength = length;
+  view      = memoryViewType {(const uint8_t*)mapping, length};
+  viewBase  = aligned;
+  pos       = (size_t)(at - aligned);
+  atEnd     = aligned + length == fileSize;
+}
+
+void streamDisassembler::refill() {
+  if (atEnd || view.size() - pos >= maxInsnLength) return;
+
+  if (read) refillChunk();
+  else
+    refillWindow();
+}
+
+bool streamDisassembler::next(insn& out, uint64_t& offset) {
+  if (!opened) return false;
+
+  refill();
+  if (pos >= view.size()) return false;
+
+  out    = decodeAt(view, pos);
+  offset = viewBase + pos;
+  pos += sweepLength(out);
+
+  // targets were resolved relative to the view
+  out.rebase(viewBase);
+
+  return true;
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "disasm.hh"
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+namespace disasm {
+  ///
+  /// Linear sweep over input that never has to be in memory as a
+  /// whole, either pulled through a reader in chunks, or read from a
+  /// file through a sliding memory mapped window. Instructions that
+  /// straddle two chunks/windows are carried over, what comes out is
+  /// what decodeRange would give for the whole input
+  ///
+  struct streamDisassembler {
+    /// Fills up to size bytes of dst, returns how many, 0 at the end
+    using reader = std::function<size_t(uint8_t* dst, size_t size)>;
+
+    /// Keeps chunkSize bytes, plus what's carried over, in memory
+    streamDisassembler(reader read, size_t chunkSize = 0x100000);
+    /// Maps windowSize bytes of the file at a time, sequentially
+    streamDisassembler(const char* path, size_t windowSize = 0x1000000);
+    ~streamDisassembler();
+
+    streamDisassembler& operator=(const streamDisassembler&) = delete;
+    streamDisassembler(const streamDisassembler&)            = delete;
+
+    /// Whether the file could be opened, always true for readers
+    bool ok() const noexcept {
+      return opened;
+    }
+
+    ///
+    /// Decodes the next instruction, and where it starts in the input.
+    /// Undecodable bytes come out as 1 byte long kind::none, targets are
+    /// relative to the start of the input. false at the end
+    ///
+    bool next(insn& out, uint64_t& offset);
+
+private:
+    /// Makes sure a whole instruction is in view past pos, unless
+    /// the input ends before that
+    void refill();
+    void refillChunk();
+    void refillWindow();
+    void unmap() noexcept;
+
+    memoryViewType view;
+    uint64_t       viewBase = 0; // input offset of view[0]
+    size_t         pos      = 0;
+    bool           atEnd    = false;
+    bool           opened   = true;
+
+    // chunked input
+    reader               read;
+    std::vector<uint8_t> buffer;
+    size_t               chunkSize = 0;
+
+    // mapped input
+    uint64_t fileSize   = 0;
+    size_t   windowSize = 0;
+    void*    mapping    = nullptr;
+    size_t   mapLength  = 0;
+#ifdef _WIN32
+    void* file        = nullptr;
+    void* fileMapping = nullptr;
+#else
+    int file = -1;
+#endif
+  };
+} // namespace disasm
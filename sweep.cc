@@ -0,0 +1,172 @@
+#include "sweep.hh"
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+using namespace disasm;
+
+namespace {
+  /// Candidate start offsets tried at the beginning of each chunk,
+  /// the first one being the chunk boundary itself
+  constexpr size_t candidateCount = 4;
+
+  constexpr size_t npos = (size_t)-1;
+
+  struct stream {
+    std::vector<insn>     insns;
+    std::vector<uint32_t> offsets;
+    /// Where decoding stopped, at or past the end of the chunk
+    size_t end = 0;
+    /// Index in the primary stream this one runs into, npos if never
+    size_t joins = npos;
+  };
+
+  struct chunk {
+    size_t begin;
+    size_t end;
+    /// Decoded from begin
+    stream primary;
+    /// Decoded from begin + 1, begin + 2..., until they join primary
+    stream candidates[candidateCount - 1];
+
+    /// Index of the primary instruction starting at offset, npos if none
+    size_t find(size_t offset) const noexcept {
+      auto it = std::lower_bound(primary.offsets.begin(), primary.offsets.end(), (uint32_t)offset);
+      if (it == primary.offsets.end() || *it != offset) return npos;
+      return it - primary.offsets.begin();
+    }
+  };
+
+  ///
+  /// Decodes from at until either the end of the chunk, or
+  /// if joining, until running into its primary stream
+  ///
+  void decodeStream(memoryViewType code, const chunk& c, size_t at, stream& s, bool joining) {
+    while (at < c.end) {
+      if (joining) {
+        if (auto idx = c.find(at); idx != npos) {
+          s.joins = idx;
+          break;
+        }
+      }
+
+      auto decoded = decodeAt(code, at);
+      s.insns.push_back(decoded);
+      s.offsets.push_back((uint32_t)at);
+      at += sweepLength(decoded);
+    }
+
+    s.end = at;
+  }
+
+  void decodeChunk(memoryViewType code, chunk& c) {
+    // a sweep doesn't take more than 1 instruction per byte
+    c.primary.insns.reserve(c.end - c.begin);
+    c.primary.offsets.reserve(c.end - c.begin);
+    decodeStream(code, c, c.begin, c.primary, false);
+
+    for (size_t i = 0; i < candidateCount - 1; i++) {
+      auto at = c.begin + i + 1;
+      if (at >= c.end) break;
+      decodeStream(code, c, at, c.candidates[i], true);
+    }
+  }
+
+  ///
+  /// A run of instructions taken from one of the chunk streams
+  ///
+  struct piece {
+    const stream* s;
+    size_t        from;
+    size_t        to;
+    /// Where it goes in the output
+    size_t at;
+  };
+} // namespace
+
+size_t disasm::decodeRangeParallel(memoryViewType code, insnBuffer& out, size_t threads, size_t minChunk) {
+  if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+  minChunk = std::max(minChunk, maxInsnLength);
+
+  size_t chunkCount = std::clamp(code.size() / minChunk, (size_t)1, threads);
+  size_t chunkSize  = (code.size() + chunkCount - 1) / chunkCount;
+
+  std::vector<chunk> chunks(chunkCount);
+  for (size_t i = 0; i < chunkCount; i++) {
+    chunks[i].begin = std::min(i * chunkSize, code.size());
+    chunks[i].end   = std::min(chunks[i].begin + chunkSize, code.size());
+  }
+
+  // decode
+  {
+    std::vector<std::jthread> workers;
+    workers.reserve(chunkCount - 1);
+    for (size_t i = 1; i < chunkCount; i++) {
+      workers.emplace_back([&, i] {
+        decodeChunk(code, chunks[i]);
+      });
+    }
+    decodeChunk(code, chunks[0]);
+  }
+
+  // stitch, p being where the sequential stream is at
+  std::vector<piece> pieces;
+  std::vector<stream> fallbacks(chunkCount);
+  size_t              p     = 0;
+  size_t              total = 0;
+
+  auto take = [&](const stream& s, size_t from) {
+    pieces.push_back({&s, from, s.insns.size(), total});
+    total += s.insns.size() - from;
+  };
+
+  for (size_t i = 0; i < chunkCount; i++) {
+    auto& c = chunks[i];
+    // the previous chunk's last instruction spans over this whole one
+    if (p >= c.end) continue;
+
+    if (auto idx = c.find(p); idx != npos) {
+      take(c.primary, idx);
+      p = c.primary.end;
+      continue;
+    }
+
+    const stream* prefix = nullptr;
+    for (auto& s : c.candidates) {
+      if (!s.offsets.empty() && s.offsets.front() == p) prefix = &s;
+    }
+
+    // out of candidates, catch up sequentially
+    if (!prefix) {
+      decodeStream(code, c, p, fallbacks[i], true);
+      prefix = &fallbacks[i];
+    }
+
+    take(*prefix, 0);
+    p = prefix->end;
+    if (prefix->joins != npos) {
+      take(c.primary, prefix->joins);
+      p = c.primary.end;
+    }
+  }
+
+  // pieces land in disjoint parts of out, fill them in parallel too
+  out       = insnBuffer(total);
+  out.count = total;
+  {
+    auto fill = [&](const piece& pc) {
+      for (size_t j = pc.from; j < pc.to; j++) out.store(pc.at + (j - pc.from), pc.s->offsets[j], pc.s->insns[j]);
+    };
+
+    std::vector<std::jthread> workers;
+    workers.reserve(pieces.size());
+    for (size_t i = 1; i < pieces.size(); i++) {
+      workers.emplace_back([&, i] {
+        fill(pieces[i]);
+      });
+    }
+    if (!pieces.empty()) fill(pieces[0]);
+  }
+
+  return p;
+}
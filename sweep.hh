@@ -0,0 +1,18 @@
+#pragma once
+
+#include "disasm.hh"
+#include <cstdint>
+
+namespace disasm {
+  ///
+  /// Parallel linear sweep, yields exactly what decodeRange would
+  /// for the whole of code. code is split into chunks decoded on
+  /// their own threads, each from a few candidate start offsets, and
+  /// the chunks are then stitched together where each one re-joins
+  /// the instruction stream of the previous one.
+  ///
+  /// threads = 0 uses every hardware thread, chunks are never made
+  /// smaller than minChunk bytes. out is reallocated to fit
+  ///
+  size_t decodeRangeParallel(memoryViewType code, insnBuffer& out, size_t threads = 0, size_t minChunk = 0x10000);
+} // namespace disasm
@@ -6,6 +6,11 @@
 #include <cstdlib>
 #include <cmath>
 #include <functional>
+#include <cstdio>
+#include <cstring>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
 
 namespace utl {
   template <size_t N>
@@ -48,6 +53,34 @@ namespace utl {
     return (value >= low && value <= high);
   }
 
+  ///
+  /// Host CPU features, for picking SIMD paths at runtime.
+  /// IMP_TARGET lets a single function use instructions the
+  /// rest of the build isn't compiled for
+  ///
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define IMP_X86
+#endif
+#if defined(__GNUC__)
+#define IMP_TARGET(x) __attribute__((target(x)))
+#else
+#define IMP_TARGET(x)
+#endif
+
+  namespace cpu {
+    inline bool avx2() noexcept {
+#if defined(IMP_X86) && defined(__GNUC__)
+      return __builtin_cpu_supports("avx2");
+#elif defined(IMP_X86) && defined(_MSC_VER)
+      int regs[4];
+      __cpuidex(regs, 7, 0);
+      return (regs[1] & (1 << 5)) && (_xgetbv(0) & 0b110) == 0b110;
+#else
+      return false;
+#endif
+    }
+  } // namespace cpu
+
   struct defer {
     defer(std::function<void()> &&func) : func(std::move(func)) {
     }
@@ -0,0 +1,167 @@
+#include "utl.hh"
+#include "xref.hh"
+#include <algorithm>
+#include <bit>
+#include <limits>
+#ifdef IMP_X86
+#include <immintrin.h>
+#endif
+
+using namespace disasm;
+
+namespace {
+  /// call/jmp rel32, opcode and displacement
+  constexpr size_t nearLength = 5;
+
+  ///
+  /// Pre-scan, appends the offsets of every 0xe8/0xe9 byte in
+  /// [0, end) to out. The SIMD versions leave the tail to scalar
+  ///
+  void scanScalar(memoryViewType code, size_t from, size_t end, std::vector<uint32_t>& out) {
+    for (size_t i = from; i < end; i++) {
+      if ((code[i] & 0xfe) == 0xe8) out.push_back((uint32_t)i);
+    }
+  }
+
+#ifdef IMP_X86
+  IMP_TARGET("sse2")
+  void scanSse2(memoryViewType code, size_t end, std::vector<uint32_t>& out) {
+    const auto opcode = _mm_set1_epi8((char)0xe8);
+    const auto mask   = _mm_set1_epi8((char)0xfe);
+
+    size_t i = 0;
+    for (; i + 16 <= end; i += 16) {
+      auto     v    = _mm_loadu_si128((const __m128i*)&code[i]);
+      uint32_t bits = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(v, mask), opcode));
+      while (bits) {
+        out.push_back((uint32_t)(i + std::countr_zero(bits)));
+        bits &= bits - 1;
+      }
+    }
+
+    scanScalar(code, i, end, out);
+  }
+
+  IMP_TARGET("avx2")
+  void scanAvx2(memoryViewType code, size_t end, std::vector<uint32_t>& out) {
+    const auto opcode = _mm256_set1_epi8((char)0xe8);
+    const auto mask   = _mm256_set1_epi8((char)0xfe);
+
+    size_t i = 0;
+    for (; i + 32 <= end; i += 32) {
+      auto     v    = _mm256_loadu_si256((const __m256i*)&code[i]);
+      uint32_t bits = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(v, mask), opcode));
+      while (bits) {
+        out.push_back((uint32_t)(i + std::countr_zero(bits)));
+        bits &= bits - 1;
+      }
+    }
+
+    scanScalar(code, i, end, out);
+  }
+#endif
+
+  ///
+  /// Resolves the rel32 of each candidate, writes code.size()
+  /// (never in range) for the ones whose target isn't in code
+  ///
+  void resolveScalar(memoryViewType code, std::span<const uint32_t> at, uint32_t* targets, size_t from = 0) {
+    for (size_t i = from; i < at.size(); i++) {
+      uint32_t t = at[i] + nearLength + utl::readU32(&code[at[i] + 1]);
+      targets[i] = t < code.size() ? t : (uint32_t)code.size();
+    }
+  }
+
+#ifdef IMP_X86
+  IMP_TARGET("avx2")
+  void resolveAvx2(memoryViewType code, std::span<const uint32_t> at, uint32_t* targets) {
+    const auto length = _mm256_set1_epi32(nearLength);
+    // no unsigned compare, bias both sides instead
+    const auto bias = _mm256_set1_epi32((int)0x80000000);
+    const auto size = _mm256_set1_epi32((int)code.size());
+    const auto max  = _mm256_xor_si256(size, bias);
+
+    size_t i = 0;
+    for (; i + 8 <= at.size(); i += 8) {
+      auto pos = _mm256_loadu_si256((const __m256i*)&at[i]);
+      // displacement sits right after the opcode
+      auto rel = _mm256_i32gather_epi32((const int*)&code[1], pos, 1);
+      auto t   = _mm256_add_epi32(_mm256_add_epi32(pos, length), rel);
+      auto in  = _mm256_cmpgt_epi32(max, _mm256_xor_si256(t, bias));
+      _mm256_storeu_si256((__m256i*)&targets[i], _mm256_blendv_epi8(size, t, in));
+    }
+
+    resolveScalar(code, at, targets, i);
+  }
+#endif
+} // namespace
+
+std::pair<size_t, size_t> xrefIndex::range(uint32_t target) const noexcept {
+  auto [b, e] = std::equal_range(targets.begin(), targets.end(), target);
+  return {(size_t)(b - targets.begin()), (size_t)(e - targets.begin())};
+}
+
+xrefIndex disasm::scanXrefs(memoryViewType code, simdLevel level) {
+  xrefIndex x;
+  if (code.size() < nearLength) return x;
+
+#ifdef IMP_X86
+  if (level == simdLevel::best) level = utl::cpu::avx2() ? simdLevel::avx2 : simdLevel::sse2;
+  if (level == simdLevel::avx2 && !utl::cpu::avx2()) level = simdLevel::sse2;
+#else
+  level = simdLevel::scalar;
+#endif
+
+  // opcodes with a whole displacement after them
+  size_t                end = code.size() - (nearLength - 1);
+  std::vector<uint32_t> candidates;
+  candidates.reserve(code.size() / 64);
+
+  std::vector<uint32_t> resolved;
+  switch (level) {
+#ifdef IMP_X86
+  case simdLevel::avx2:
+    scanAvx2(code, end, candidates);
+    resolved.resize(candidates.size());
+    // gather indices are signed
+    if (code.size() <= (size_t)std::numeric_limits<int32_t>::max()) resolveAvx2(code, candidates, resolved.data());
+    else
+      resolveScalar(code, candidates, resolved.data());
+    break;
+  case simdLevel::sse2:
+    scanSse2(code, end, candidates);
+    resolved.resize(candidates.size());
+    resolveScalar(code, candidates, resolved.data());
+    break;
+#endif
+  default:
+    scanScalar(code, 0, end, candidates);
+    resolved.resize(candidates.size());
+    resolveScalar(code, candidates, resolved.data());
+    break;
+  }
+
+  // confirm what's left with the decoder
+  std::vector<uint64_t> refs; // target << 32 | source, sorts by target then source
+  for (size_t i = 0; i < candidates.size(); i++) {
+    if (resolved[i] >= code.size()) continue;
+
+    auto decoded = decodeAt(code, candidates[i]);
+    auto type    = info(decoded.id).type;
+    if (!decoded.valid() || (type != instructionType::CALL && type != instructionType::JMP)) continue;
+
+    refs.push_back(((uint64_t)decoded.imm << 32) | candidates[i]);
+  }
+  std::sort(refs.begin(), refs.end());
+
+  x.targets.reserve(refs.size());
+  x.sources.reserve(refs.size());
+  x.isCall.reserve(refs.size());
+  for (auto r : refs) {
+    x.targets.push_back((uint32_t)(r >> 32));
+    x.sources.push_back((uint32_t)r);
+    x.isCall.push_back(code[(uint32_t)r] == 0xe8);
+  }
+
+  return x;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "disasm.hh"
+#include <cstdint>
+#include <span>
+#include <vector>
+
+namespace disasm {
+  ///
+  /// Every near call/jmp target found in an image, sorted by target
+  /// so that references to an address are found by binary search
+  ///
+  struct xrefIndex {
+    std::vector<uint32_t> targets;
+    std::vector<uint32_t> sources; // offset of the call/jmp
+    std::vector<uint8_t>  isCall;  // jmp otherwise
+
+    size_t size() const noexcept {
+      return targets.size();
+    }
+
+    /// Indices of the references to target, in source order
+    std::pair<size_t, size_t> range(uint32_t target) const noexcept;
+
+    /// Offsets of the calls/jmps to target
+    std::span<const uint32_t> sourcesOf(uint32_t target) const noexcept {
+      auto [b, e] = range(target);
+      return {sources.data() + b, sources.data() + e};
+    }
+
+    bool isTarget(uint32_t target) const noexcept {
+      auto [b, e] = range(target);
+      return b != e;
+    }
+  };
+
+  enum class simdLevel { scalar, sse2, avx2, best };
+
+  ///
+  /// Finds 0xe8/0xe9 bytes in bulk, resolves their rel32 targets,
+  /// keeps the ones that land inside code and confirms them with the
+  /// decoder. Candidates aren't checked against instruction boundaries,
+  /// so bytes inside other instructions or data can yield references
+  ///
+  xrefIndex scanXrefs(memoryViewType code, simdLevel level = simdLevel::best);
+} // namespace disasm